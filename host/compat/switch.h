@@ -0,0 +1,31 @@
+#pragma once
+
+// Just enough of libnx for the platform independent sources to build on a
+// host, for the tests and benchmarks in this folder. Not used by the Switch build.
+
+#include <stdint.h>
+#include <time.h>
+
+typedef uint8_t u8;
+typedef uint16_t u16;
+typedef uint32_t u32;
+typedef uint64_t u64;
+typedef int8_t s8;
+typedef int16_t s16;
+typedef int32_t s32;
+typedef int64_t s64;
+
+typedef struct PrintConsole PrintConsole;
+
+/// Ticks are nanoseconds here
+static inline u64 armGetSystemTick(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (u64)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static inline u64 armTicksToNs(u64 tick)
+{
+    return tick;
+}
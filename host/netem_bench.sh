@@ -0,0 +1,41 @@
+#!/bin/sh
+# Runs tuning_bench against a local HTTP server over loopback with netem
+# adding latency, so the bandwidth-delay product is that of a slow link.
+#
+#   host/netem_bench.sh [delay] [size MB] [runs]
+#
+# Adding the qdisc needs root and the sch_netem module. Without them the
+# benchmark still runs, but on plain loopback.
+
+set -e
+
+delay=${1:-40ms}
+size=${2:-64}
+runs=${3:-5}
+port=8765
+dir=$(mktemp -d)
+here=$(dirname "$0")
+
+netem=0
+cleanup()
+{
+    [ -n "$server" ] && kill "$server" 2>/dev/null || true
+    [ "$netem" = 1 ] && tc qdisc del dev lo root || true
+    rm -rf "$dir"
+}
+trap cleanup EXIT INT TERM
+
+make -C "$here" build/tuning_bench >/dev/null
+head -c "$((size * 1024 * 1024))" /dev/urandom >"$dir/blob"
+python3 -m http.server "$port" --bind 127.0.0.1 --directory "$dir" >/dev/null 2>&1 &
+server=$!
+sleep 1
+
+if tc qdisc add dev lo root netem delay "$delay" 2>/dev/null; then
+    netem=1
+    echo "loopback delayed by $delay each way"
+else
+    echo "can't add a netem qdisc to lo, measuring plain loopback"
+fi
+
+"$here/build/tuning_bench" "http://127.0.0.1:$port/blob" "$runs"
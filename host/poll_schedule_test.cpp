@@ -0,0 +1,107 @@
+// Continuous mode's pacing, driven by a fake clock instead of real waits
+
+#include "poll_schedule.hpp"
+
+#include <stdio.h>
+#include <vector>
+#include <functional>
+
+static int failures = 0;
+
+#define CHECK_EQ(actual, expected)                                                                \
+    do                                                                                           \
+    {                                                                                            \
+        unsigned long long a = (actual), e = (expected);                                         \
+        if (a != e)                                                                              \
+        {                                                                                        \
+            printf("%s:%d: %s is %llu, expected %llu\n", __FILE__, __LINE__, #actual, a, e);     \
+            failures++;                                                                          \
+        }                                                                                        \
+    } while (0)
+
+/// Run the poll loop until `end_ms` on a fake clock. `changed` says whether the
+/// cycle starting at a given time finds anything to do. Returns the times cycles started.
+static std::vector<uint64_t> run(PollSchedule &schedule, uint64_t end_ms, const std::function<bool(uint64_t)> &changed)
+{
+    std::vector<uint64_t> starts;
+    for (uint64_t now = 0; now < end_ms; now += schedule.next(changed(now)))
+    {
+        starts.push_back(now);
+    }
+    return starts;
+}
+
+static void backs_off_while_idle()
+{
+    PollSchedule schedule(300000, 3600000);
+    std::vector<uint64_t> starts = run(schedule, 6 * 3600000, [](uint64_t)
+                                       { return false; });
+    // 5, 10, 20, 40 minutes, then capped at an hour
+    std::vector<uint64_t> expected = {0, 300000, 900000, 2100000, 4500000, 8100000, 11700000, 15300000, 18900000};
+    CHECK_EQ(starts.size(), expected.size());
+    for (size_t i = 0; i < starts.size() && i < expected.size(); i++)
+    {
+        CHECK_EQ(starts[i], expected[i]);
+    }
+}
+
+static void resets_on_change()
+{
+    PollSchedule schedule(300000, 3600000);
+    // Idle until the first cycle after 2 hours finds a change
+    bool pending = true;
+    std::vector<uint64_t> starts = run(schedule, 3 * 3600000, [&](uint64_t now)
+                                       {
+                                           bool changed = pending && now >= 7200000;
+                                           pending = pending && !changed;
+                                           return changed;
+                                       });
+    std::vector<uint64_t> gaps;
+    for (size_t i = 1; i < starts.size(); i++)
+    {
+        gaps.push_back(starts[i] - starts[i - 1]);
+    }
+    // Backed off to the cap, the busy cycle goes straight back to the base interval, then backs off again
+    std::vector<uint64_t> expected = {300000, 600000, 1200000, 2400000, 3600000, 300000, 300000, 600000, 1200000};
+    CHECK_EQ(gaps.size(), expected.size());
+    for (size_t i = 0; i < gaps.size() && i < expected.size(); i++)
+    {
+        CHECK_EQ(gaps[i], expected[i]);
+    }
+}
+
+static void stays_at_base_while_busy()
+{
+    PollSchedule schedule(60000, 600000);
+    for (int i = 0; i < 10; i++)
+    {
+        CHECK_EQ(schedule.next(true), 60000);
+    }
+}
+
+static void clamps_configuration()
+{
+    // At least a second between cycles
+    PollSchedule fast(0, 0);
+    CHECK_EQ(fast.next(false), 1000);
+    CHECK_EQ(fast.next(false), 1000);
+    // A cap below the interval is the interval
+    PollSchedule capped(300000, 1000);
+    CHECK_EQ(capped.next(false), 300000);
+    CHECK_EQ(capped.next(false), 300000);
+}
+
+int main()
+{
+    backs_off_while_idle();
+    resets_on_change();
+    stays_at_base_while_busy();
+    clamps_configuration();
+    if (failures)
+    {
+        printf("%d checks failed\n", failures);
+        return 1;
+    }
+    printf("all checks passed\n");
+    return 0;
+}
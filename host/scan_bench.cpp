@@ -0,0 +1,170 @@
+// Local scan benchmark: readdir() plus stat() per entry, as scan_dir() used to
+// work, against LocalDir's batched reads, both filling a FileList.
+//
+//   build/scan_bench [folder] [files]
+//
+// Without a folder, a tree of `files` files (default 100000) is generated
+// under /tmp first: 100 folders of 10 subfolders of equally many files. Runs
+// are made with a warm cache, so this measures the calls, not the disk.
+
+#include "local_dir.hpp"
+#include "file_list.hpp"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <algorithm>
+#include <chrono>
+#include <string>
+#include <vector>
+
+using namespace std;
+
+static void scan_readdir(const string &base_path, FileList &out, u32 parent, string &rel_path)
+{
+    DIR *dir = opendir((base_path + rel_path).c_str());
+    if (dir == NULL)
+    {
+        return;
+    }
+    struct dirent *ent;
+    struct stat attr;
+    while ((ent = readdir(dir)) != NULL)
+    {
+        if (strcmp(ent->d_name, ".") == 0 || strcmp(ent->d_name, "..") == 0)
+            continue;
+        size_t len = rel_path.size();
+        rel_path += '/';
+        rel_path += ent->d_name;
+        if (stat((base_path + rel_path).c_str(), &attr) == 0)
+        {
+            if (!S_ISDIR(attr.st_mode))
+            {
+                out.add(parent, ent->d_name, false, attr.st_size, attr.st_mtime);
+            }
+            else
+            {
+                u32 i = out.add(parent, ent->d_name, true, 0, attr.st_mtime);
+                scan_readdir(base_path, out, i, rel_path);
+            }
+        }
+        rel_path.resize(len);
+    }
+    closedir(dir);
+}
+
+static void scan_local_dir(const string &base_path, FileList &out, u32 parent, string &rel_path)
+{
+    LocalDir dir(base_path + rel_path);
+    if (!dir.is_open())
+    {
+        return;
+    }
+    LocalDir::Entry *ent;
+    while ((ent = dir.next()) != NULL)
+    {
+        size_t len = rel_path.size();
+        rel_path += '/';
+        rel_path += ent->name;
+        if (dir.details(*ent))
+        {
+            if (!ent->folder)
+            {
+                out.add(parent, ent->name, false, ent->size, ent->mtime);
+            }
+            else
+            {
+                u32 i = out.add(parent, ent->name, true, 0, ent->mtime);
+                scan_local_dir(base_path, out, i, rel_path);
+            }
+        }
+        rel_path.resize(len);
+    }
+}
+
+static bool generate(const string &base, unsigned files)
+{
+    const unsigned top = 100, sub = 10;
+    unsigned per_folder = max(1u, files / (top * sub));
+    if (mkdir(base.c_str(), 0777) != 0 && errno != EEXIST)
+    {
+        perror(base.c_str());
+        return false;
+    }
+    char path[512];
+    for (unsigned a = 0; a < top; a++)
+    {
+        snprintf(path, sizeof(path), "%s/dir%03u", base.c_str(), a);
+        mkdir(path, 0777);
+        for (unsigned b = 0; b < sub; b++)
+        {
+            snprintf(path, sizeof(path), "%s/dir%03u/sub%02u", base.c_str(), a, b);
+            mkdir(path, 0777);
+            for (unsigned c = 0; c < per_folder; c++)
+            {
+                snprintf(path, sizeof(path), "%s/dir%03u/sub%02u/file%04u.sav", base.c_str(), a, b, c);
+                int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+                if (fd < 0)
+                {
+                    perror(path);
+                    return false;
+                }
+                // Sizes differ, like real saves
+                if (ftruncate(fd, (a * 7 + b * 13 + c) % 4096) != 0)
+                {
+                    perror(path);
+                }
+                close(fd);
+            }
+        }
+    }
+    return true;
+}
+
+typedef void (*Scanner)(const string &, FileList &, u32, string &);
+
+static void measure(const char *name, Scanner scan, const string &base, int runs)
+{
+    vector<double> times;
+    u32 entries = 0;
+    for (int r = 0; r < runs; r++)
+    {
+        auto start = chrono::steady_clock::now();
+        FileList files;
+        string rel_path;
+        scan(base, files, FileList::root, rel_path);
+        times.push_back(chrono::duration<double, milli>(chrono::steady_clock::now() - start).count());
+        entries = files.size() - 1;
+    }
+    sort(times.begin(), times.end());
+    double median = times[times.size() / 2];
+    printf("%-16s %8u entries  best %8.1f ms  median %8.1f ms  %10.0f entries/s\n", name, entries, times[0], median,
+           entries / (median / 1000));
+}
+
+int main(int argc, char *argv[])
+{
+    string base = argc > 1 ? argv[1] : "/tmp/nxdavsync-scan-bench";
+    unsigned files = argc > 2 ? atoi(argv[2]) : 100000;
+    if (argc <= 1)
+    {
+        printf("generating %u files in %s...\n", files, base.c_str());
+        if (!generate(base, files))
+        {
+            return 1;
+        }
+    }
+    const int runs = 5;
+    // One untimed pass, so both start with the same warm cache
+    FileList warm;
+    string rel_path;
+    scan_readdir(base, warm, FileList::root, rel_path);
+    measure("readdir+stat", scan_readdir, base, runs);
+    measure("LocalDir", scan_local_dir, base, runs);
+    return 0;
+}
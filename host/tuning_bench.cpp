@@ -0,0 +1,111 @@
+// Buffer tuning benchmark: downloads a URL with curl's default buffers, then
+// with a BufferTuner learning from each transfer, and compares throughput.
+//
+//   build/tuning_bench <url> [runs]
+//
+// Every request opens a new connection, as socket buffers only apply to those.
+// netem_bench.sh runs this against a local server behind an emulated link.
+
+#include "net_tuning.hpp"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <algorithm>
+#include <vector>
+
+using namespace std;
+
+// metrics.cpp logs through the console
+void console_printf(const char *fmt, ...)
+{
+    va_list args;
+    va_start(args, fmt);
+    vprintf(fmt, args);
+    va_end(args);
+}
+
+static size_t discard(char *ptr, size_t size, size_t nmemb, void *userdata)
+{
+    return size * nmemb;
+}
+
+/// One download, returns its timing
+static RequestTiming download(const char *url, BufferTuner *tuner)
+{
+    CURL *curl = curl_easy_init();
+    curl_easy_setopt(curl, CURLOPT_URL, url);
+    curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, discard);
+    curl_easy_setopt(curl, CURLOPT_FRESH_CONNECT, 1L);
+    curl_easy_setopt(curl, CURLOPT_FORBID_REUSE, 1L);
+    if (tuner)
+    {
+        tuner->apply(curl);
+    }
+    CURLcode res = curl_easy_perform(curl);
+    long code = 0;
+    curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &code);
+    RequestTiming timing = RequestTiming::from_curl(curl, res == CURLE_OK && code < 400);
+    if (res != CURLE_OK)
+    {
+        printf("%s: %s\n", url, curl_easy_strerror(res));
+    }
+    curl_easy_cleanup(curl);
+    return timing;
+}
+
+static double mb_per_s(const RequestTiming &t)
+{
+    return t.total > 0 ? t.bytes_down / (double)t.total : 0;
+}
+
+/// Median throughput over `runs` downloads, in MB/s
+static double measure(const char *name, const char *url, int runs, BufferTuner *tuner)
+{
+    vector<double> rates;
+    for (int r = 0; r < runs; r++)
+    {
+        RequestTiming t = download(url, tuner);
+        if (!t.ok)
+        {
+            return 0;
+        }
+        if (tuner)
+        {
+            tuner->observe(t);
+        }
+        printf("%-8s run %d: %s\n", name, r + 1, t.summary().c_str());
+        rates.push_back(mb_per_s(t));
+    }
+    sort(rates.begin(), rates.end());
+    return rates[rates.size() / 2];
+}
+
+int main(int argc, char *argv[])
+{
+    if (argc < 2)
+    {
+        printf("usage: %s <url> [runs]\n", argv[0]);
+        return 2;
+    }
+    const char *url = argv[1];
+    int runs = argc > 2 ? max(1, atoi(argv[2])) : 5;
+    curl_global_init(CURL_GLOBAL_DEFAULT);
+
+    double before = measure("default", url, runs, NULL);
+    BufferTuner tuner;
+    // Like SocketRxBufMaxKB/SocketTxBufMaxKB set to 4 MiB
+    tuner.configure(0, 0, 4 * 1024 * 1024);
+    // Until one download was observed the tuner keeps the defaults
+    RequestTiming probe = download(url, &tuner);
+    tuner.observe(probe);
+    printf("tuned    probe: %s\n", probe.summary().c_str());
+    double after = measure("tuned", url, runs, &tuner);
+
+    printf("\ntuned buffers: download %ld, upload %ld, socket %d bytes\n", tuner.download_buffer(),
+           tuner.upload_buffer(), tuner.socket_buffer());
+    printf("median throughput: default %.1f MB/s, tuned %.1f MB/s (%+.0f%%)\n", before, after,
+           before > 0 ? (after / before - 1) * 100 : 0);
+    curl_global_cleanup();
+    return before > 0 && after > 0 ? 0 : 1;
+}
@@ -0,0 +1,612 @@
+#include "archive.hpp"
+#include "console.hpp"
+
+#include <algorithm>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#include <curl/curl.h>
+
+using namespace std;
+
+/// Tar data is produced and compressed in pieces this big
+static const size_t chunk_size = 64 * 1024;
+
+/// Octal with a terminating NUL where it fits, GNU base-256 otherwise
+static void put_number(char *field, size_t width, u64 value)
+{
+    if (value < (1ULL << (3 * (width - 1))))
+    {
+        snprintf(field, width, "%0*llo", (int)width - 1, (unsigned long long)value);
+        return;
+    }
+    field[0] = (char)0x80;
+    for (size_t i = width - 1; i > 0; i--)
+    {
+        field[i] = value & 0xff;
+        value >>= 8;
+    }
+}
+
+static u64 get_number(const char *field, size_t width)
+{
+    if (field[0] & 0x80)
+    {
+        u64 value = field[0] & 0x7f;
+        for (size_t i = 1; i < width; i++)
+            value = (value << 8) | (unsigned char)field[i];
+        return value;
+    }
+    char digits[16] = {0};
+    memcpy(digits, field, min(width, sizeof(digits) - 1));
+    return strtoull(digits, NULL, 8);
+}
+
+static unsigned header_checksum(const char *header)
+{
+    // Computed with the checksum field itself as spaces
+    unsigned sum = 0;
+    for (int i = 0; i < 512; i++)
+        sum += i >= 148 && i < 156 ? ' ' : (unsigned char)header[i];
+    return sum;
+}
+
+/// GNU tar header; longer names need a long name entry before it
+static string tar_header(const string &name, char type, u64 size, time_t mtime, u32 mode)
+{
+    char h[512] = {0};
+    memcpy(h, name.data(), min(name.size(), (size_t)100));
+    put_number(h + 100, 8, mode);
+    put_number(h + 108, 8, 0);
+    put_number(h + 116, 8, 0);
+    put_number(h + 124, 12, size);
+    put_number(h + 136, 12, mtime > 0 ? mtime : 0);
+    h[156] = type;
+    memcpy(h + 257, "ustar  ", 8);
+    snprintf(h + 148, 7, "%06o", header_checksum(h));
+    h[155] = ' ';
+    return string(h, sizeof(h));
+}
+
+static size_t block_padding(u64 size)
+{
+    return (512 - size % 512) % 512;
+}
+
+ArchiveWriter::ArchiveWriter(const string &base_path, const FileList &files, FileProgress *progress)
+    : base_path(base_path), files(files), progress(progress), fp(NULL)
+{
+    memset(&this->zs, 0, sizeof(this->zs));
+    // gzip framing. The fastest level, the Switch's CPU is slower than most networks.
+    deflateInit2(&this->zs, Z_BEST_SPEED, Z_DEFLATED, 16 + MAX_WBITS, 8, Z_DEFAULT_STRATEGY);
+    this->in.reserve(chunk_size);
+    this->rewind();
+}
+
+ArchiveWriter::~ArchiveWriter()
+{
+    if (this->fp)
+    {
+        fclose(this->fp);
+    }
+    deflateEnd(&this->zs);
+}
+
+bool ArchiveWriter::rewind()
+{
+    if (this->fp)
+    {
+        fclose(this->fp);
+        this->fp = NULL;
+    }
+    deflateReset(&this->zs);
+    this->zs.avail_in = 0;
+    this->in.clear();
+    this->entry = 0;
+    this->pending.clear();
+    this->pending_offset = 0;
+    this->remaining = 0;
+    this->padding = 0;
+    this->trailer = false;
+    this->input_done = false;
+    this->finished = false;
+    this->broken = false;
+    this->read_bytes = 0;
+    if (this->progress)
+    {
+        this->progress->update(0);
+    }
+    return true;
+}
+
+bool ArchiveWriter::failed() const
+{
+    return this->broken;
+}
+
+size_t ArchiveWriter::read(char *buffer, size_t size, size_t nitems, void *userp)
+{
+    return ((ArchiveWriter *)userp)->fill(buffer, size * nitems);
+}
+
+size_t ArchiveWriter::fill(char *buffer, size_t size)
+{
+    this->zs.next_out = (Bytef *)buffer;
+    this->zs.avail_out = size;
+    while (this->zs.avail_out > 0 && !this->finished)
+    {
+        if (this->zs.avail_in == 0 && !this->input_done)
+        {
+            if (!this->produce())
+            {
+                this->broken = true;
+                return CURL_READFUNC_ABORT;
+            }
+            this->zs.next_in = (Bytef *)this->in.data();
+            this->zs.avail_in = this->in.size();
+        }
+        int res = deflate(&this->zs, this->input_done && this->zs.avail_in == 0 ? Z_FINISH : Z_NO_FLUSH);
+        if (res == Z_STREAM_END)
+        {
+            this->finished = true;
+        }
+        else if (res != Z_OK && res != Z_BUF_ERROR)
+        {
+            this->broken = true;
+            return CURL_READFUNC_ABORT;
+        }
+    }
+    return size - this->zs.avail_out;
+}
+
+bool ArchiveWriter::produce()
+{
+    this->in.resize(chunk_size);
+    size_t used = 0;
+    while (used < chunk_size && !this->input_done)
+    {
+        if (this->pending_offset < this->pending.size())
+        {
+            size_t n = min(chunk_size - used, this->pending.size() - this->pending_offset);
+            memcpy(this->in.data() + used, this->pending.data() + this->pending_offset, n);
+            used += n;
+            this->pending_offset += n;
+        }
+        else if (this->remaining > 0)
+        {
+            size_t n = fread(this->in.data() + used, 1, min((u64)(chunk_size - used), this->remaining), this->fp);
+            if (n == 0)
+            {
+                // Shrunk since it was listed, the header already promised more
+                return false;
+            }
+            used += n;
+            this->remaining -= n;
+            this->read_bytes += n;
+            if (this->progress)
+            {
+                this->progress->update(this->read_bytes);
+            }
+        }
+        else if (this->padding > 0)
+        {
+            this->pending.assign(this->padding, '\0');
+            this->pending_offset = 0;
+            this->padding = 0;
+        }
+        else if (this->entry < this->files.size())
+        {
+            if (this->fp)
+            {
+                fclose(this->fp);
+                this->fp = NULL;
+            }
+            if (!this->start_entry(this->entry++))
+            {
+                return false;
+            }
+        }
+        else if (!this->trailer)
+        {
+            // Two empty blocks end the archive
+            this->pending.assign(1024, '\0');
+            this->pending_offset = 0;
+            this->trailer = true;
+        }
+        else
+        {
+            this->input_done = true;
+        }
+    }
+    this->in.resize(used);
+    return true;
+}
+
+bool ArchiveWriter::start_entry(u32 i)
+{
+    if (i == FileList::root)
+    {
+        return true;
+    }
+    string rel_path = this->files.path(i);
+    // Relative names, "saves/" and "saves/game.sav"
+    string name = rel_path.substr(1);
+    bool folder = this->files.folder(i);
+    u64 size = folder ? 0 : this->files[i].size;
+    this->pending.clear();
+    this->pending_offset = 0;
+    if (name.size() > 100)
+    {
+        this->pending += tar_header("././@LongLink", 'L', name.size() + 1, 0, 0644);
+        this->pending += name;
+        this->pending.append(1 + block_padding(name.size() + 1), '\0');
+    }
+    this->pending += tar_header(name, folder ? '5' : '0', size, this->files[i].mtime, folder ? 0755 : 0644);
+    if (size > 0)
+    {
+        string local_path = this->base_path + rel_path;
+        this->fp = fopen(local_path.c_str(), "rb");
+        if (!this->fp)
+        {
+            console_printf("can't read %s: %s\n", local_path.c_str(), strerror(errno));
+            return false;
+        }
+    }
+    this->remaining = size;
+    this->padding = block_padding(size);
+    return true;
+}
+
+/// The path record of pax extended header records ("<length> path=<value>\n"), "" if there is none
+static string pax_path(const string &records)
+{
+    size_t pos = 0;
+    while (pos < records.size())
+    {
+        char *end;
+        unsigned long length = strtoul(records.c_str() + pos, &end, 10);
+        size_t key = end - records.c_str() + 1;
+        if (length == 0 || pos + length > records.size() || key >= pos + length)
+            break;
+        if (records.compare(key, 5, "path=") == 0)
+            return records.substr(key + 5, pos + length - 1 - (key + 5));
+        pos += length;
+    }
+    return "";
+}
+
+/// Relative, and never climbing out of the folder it is unpacked into
+static bool safe_path(const string &name)
+{
+    if (name.empty() || name[0] == '/')
+    {
+        return false;
+    }
+    size_t start = 0;
+    while (start <= name.size())
+    {
+        size_t end = name.find('/', start);
+        if (end == string::npos)
+            end = name.size();
+        if (name.compare(start, end - start, "..") == 0)
+            return false;
+        start = end + 1;
+    }
+    return true;
+}
+
+/// Create the missing folders above `path`, for archives without folder entries
+static void make_parents(const string &path)
+{
+    for (size_t slash = path.find('/', 1); slash != string::npos; slash = path.find('/', slash + 1))
+    {
+        mkdir(path.substr(0, slash).c_str(), 0777);
+    }
+}
+
+ArchiveReader::ArchiveReader(const string &base_path) : base_path(base_path), fp(NULL)
+{
+    memset(&this->zs, 0, sizeof(this->zs));
+    inflateInit2(&this->zs, 16 + MAX_WBITS);
+    this->restart();
+}
+
+ArchiveReader::~ArchiveReader()
+{
+    this->close_file();
+    inflateEnd(&this->zs);
+}
+
+bool ArchiveReader::restart()
+{
+    this->close_file();
+    inflateReset(&this->zs);
+    this->stream_end = false;
+    this->header_used = 0;
+    this->long_name.clear();
+    this->meta_type = 0;
+    this->remaining = 0;
+    this->padding = 0;
+    this->ended = false;
+    this->broken = false;
+    this->files = 0;
+    return true;
+}
+
+bool ArchiveReader::finish()
+{
+    if (!this->close_file())
+    {
+        this->broken = true;
+    }
+    return !this->broken && this->stream_end && this->ended;
+}
+
+bool ArchiveReader::failed() const
+{
+    return this->broken;
+}
+
+u32 ArchiveReader::file_count() const
+{
+    return this->files;
+}
+
+size_t ArchiveReader::write(char *data, size_t size, size_t nmemb, void *userp)
+{
+    ArchiveReader *reader = (ArchiveReader *)userp;
+    z_stream &zs = reader->zs;
+    static thread_local char out[chunk_size];
+    zs.next_in = (Bytef *)data;
+    zs.avail_in = size * nmemb;
+    while (!reader->stream_end && (zs.avail_in > 0 || zs.avail_out == 0))
+    {
+        zs.next_out = (Bytef *)out;
+        zs.avail_out = sizeof(out);
+        int res = inflate(&zs, Z_NO_FLUSH);
+        if (res != Z_OK && res != Z_STREAM_END && res != Z_BUF_ERROR)
+        {
+            console_printf("archive is not gzip compressed or corrupt\n");
+            reader->broken = true;
+            return 0;
+        }
+        if (!reader->consume(out, sizeof(out) - zs.avail_out))
+        {
+            reader->broken = true;
+            return 0;
+        }
+        reader->stream_end = res == Z_STREAM_END;
+        if (res == Z_BUF_ERROR)
+        {
+            break;
+        }
+    }
+    // Anything after the gzip stream is ignored
+    return size * nmemb;
+}
+
+bool ArchiveReader::consume(const char *data, size_t size)
+{
+    while (size > 0 && !this->ended)
+    {
+        if (this->remaining > 0)
+        {
+            size_t n = min((u64)size, this->remaining);
+            if (this->meta_type)
+            {
+                this->long_name.append(data, n);
+            }
+            else if (this->fp && fwrite(data, 1, n, this->fp) != n)
+            {
+                console_printf("can't write restored file: %s\n", strerror(errno));
+                return false;
+            }
+            data += n;
+            size -= n;
+            this->remaining -= n;
+            if (this->remaining == 0)
+            {
+                if (this->meta_type)
+                {
+                    this->long_name = this->meta_type == 'x' ? pax_path(this->long_name)
+                                                             : this->long_name.substr(0, strnlen(this->long_name.c_str(), this->long_name.size()));
+                    this->meta_type = 0;
+                }
+                if (!this->close_file())
+                {
+                    return false;
+                }
+            }
+        }
+        else if (this->padding > 0)
+        {
+            size_t n = min(size, this->padding);
+            data += n;
+            size -= n;
+            this->padding -= n;
+        }
+        else
+        {
+            size_t n = min(size, sizeof(this->header) - this->header_used);
+            memcpy(this->header + this->header_used, data, n);
+            data += n;
+            size -= n;
+            this->header_used += n;
+            if (this->header_used == sizeof(this->header))
+            {
+                this->header_used = 0;
+                if (!this->parse_header())
+                {
+                    return false;
+                }
+            }
+        }
+    }
+    return true;
+}
+
+bool ArchiveReader::parse_header()
+{
+    const char *h = this->header;
+    // The first empty block is the end, the rest of the archive is padding
+    if (all_of(h, h + sizeof(this->header), [](char c)
+               {
+                   return c == 0;
+               }))
+    {
+        this->ended = true;
+        return true;
+    }
+    if (get_number(h + 148, 8) != header_checksum(h))
+    {
+        console_printf("archive is corrupt: bad tar header\n");
+        return false;
+    }
+    u64 size = get_number(h + 124, 12);
+    char type = h[156];
+    this->remaining = size;
+    this->padding = block_padding(size);
+    if (type == 'L' || type == 'x')
+    {
+        this->long_name.clear();
+        this->meta_type = type;
+        return true;
+    }
+
+    string name;
+    if (!this->long_name.empty())
+    {
+        name = this->long_name;
+        this->long_name.clear();
+    }
+    else
+    {
+        name.assign(h, strnlen(h, 100));
+        // POSIX ustar keeps the start of long names in a prefix field
+        if (memcmp(h + 257, "ustar\0", 6) == 0 && h[345])
+        {
+            name = string(h + 345, strnlen(h + 345, 155)) + "/" + name;
+        }
+    }
+    if (name.compare(0, 2, "./") == 0)
+    {
+        name.erase(0, 2);
+    }
+    while (!name.empty() && name.back() == '/')
+    {
+        name.pop_back();
+    }
+    if (name.empty() || name == ".")
+    {
+        // The folder itself
+        return true;
+    }
+    if (!safe_path(name))
+    {
+        // The contents are skipped, nothing is open
+        console_printf("%s: unsafe path in archive, skipped\n", name.c_str());
+        return true;
+    }
+
+    string local_path = this->base_path + "/" + name;
+    if (type == '5')
+    {
+        if (mkdir(local_path.c_str(), 0777) != 0 && errno != EEXIST)
+        {
+            console_printf("can't create local dir %s: %s\n", local_path.c_str(), strerror(errno));
+            return false;
+        }
+    }
+    else if (type == '0' || type == '\0')
+    {
+        this->fp = fopen(local_path.c_str(), "wb");
+        if (!this->fp && errno == ENOENT)
+        {
+            make_parents(local_path);
+            this->fp = fopen(local_path.c_str(), "wb");
+        }
+        if (!this->fp)
+        {
+            console_printf("can't open %s for writing: %s\n", local_path.c_str(), strerror(errno));
+            return false;
+        }
+        this->files++;
+        if (size == 0)
+        {
+            return this->close_file();
+        }
+    }
+    // Links and special files aren't restored
+    return true;
+}
+
+bool ArchiveReader::close_file()
+{
+    if (!this->fp)
+    {
+        return true;
+    }
+    bool ok = fclose(this->fp) == 0;
+    this->fp = NULL;
+    if (!ok)
+    {
+        console_printf("can't write restored file: %s\n", strerror(errno));
+    }
+    return ok;
+}
+
+static const char *manifest_header = "NXDavSync-archive 1\n";
+
+optional<ArchiveManifest> load_archive_manifest(const string &file)
+{
+    FILE *fp = fopen(file.c_str(), "r");
+    if (!fp)
+    {
+        return nullopt;
+    }
+    char line[256];
+    if (!fgets(line, sizeof(line), fp) || strcmp(line, manifest_header) != 0)
+    {
+        fclose(fp);
+        return nullopt;
+    }
+    ArchiveManifest manifest;
+    while (fgets(line, sizeof(line), fp))
+    {
+        char key[64];
+        unsigned long long value;
+        if (sscanf(line, "%63s %llu", key, &value) != 2)
+            continue;
+        if (strcmp(key, "count") == 0)
+            manifest.local.count = value;
+        else if (strcmp(key, "size") == 0)
+            manifest.local.size = value;
+        else if (strcmp(key, "max_mtime") == 0)
+            manifest.local.max_mtime = value;
+        else if (strcmp(key, "digest") == 0)
+            manifest.local.digest = value;
+        else if (strcmp(key, "remote_mtime") == 0)
+            manifest.remote_mtime = value;
+    }
+    fclose(fp);
+    return manifest;
+}
+
+bool save_archive_manifest(const string &file, const ArchiveManifest &manifest)
+{
+    FILE *fp = fopen(file.c_str(), "w");
+    if (!fp)
+    {
+        console_printf("can't write %s: %s\n", file.c_str(), strerror(errno));
+        return false;
+    }
+    fputs(manifest_header, fp);
+    fprintf(fp, "count %llu\n", (unsigned long long)manifest.local.count);
+    fprintf(fp, "size %llu\n", (unsigned long long)manifest.local.size);
+    fprintf(fp, "max_mtime %llu\n", (unsigned long long)manifest.local.max_mtime);
+    fprintf(fp, "digest %llu\n", (unsigned long long)manifest.local.digest);
+    fprintf(fp, "remote_mtime %llu\n", (unsigned long long)manifest.remote_mtime);
+    return fclose(fp) == 0;
+}
@@ -0,0 +1,107 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <optional>
+#include <ctime>
+#include <stdio.h>
+#include <switch.h>
+#include <zlib.h>
+
+#include "file_list.hpp"
+#include "tree_state.hpp"
+#include "progress.hpp"
+
+/// A local tree as a gzip compressed tar archive, produced while it is read so
+/// it can be streamed into a request body without a temporary file
+class ArchiveWriter
+{
+public:
+    /// Archive `files`, a listing of `base_path`. `progress`, if any, counts the bytes read from them.
+    ArchiveWriter(const std::string &base_path, const FileList &files, FileProgress *progress = NULL);
+    ArchiveWriter(const ArchiveWriter &) = delete;
+    ArchiveWriter &operator=(const ArchiveWriter &) = delete;
+    ~ArchiveWriter();
+
+    /// Start over, for a retried request
+    bool rewind();
+    /// Whether the last pass aborted because a file couldn't be read or changed size
+    bool failed() const;
+    /// CURLOPT_READFUNCTION, with this as CURLOPT_READDATA
+    static size_t read(char *buffer, size_t size, size_t nitems, void *userp);
+
+private:
+    const std::string base_path;
+    const FileList &files;
+    FileProgress *progress;
+    z_stream zs;
+    std::vector<char> in; // Uncompressed tar, not yet fed to zlib
+    // Position in the tar stream
+    u32 entry;
+    std::string pending; // Header, padding or trailer still to go out
+    size_t pending_offset;
+    FILE *fp;
+    u64 remaining; // Of the current file
+    size_t padding;
+    bool trailer;
+    bool input_done;
+    bool finished;
+    bool broken;
+    u64 read_bytes;
+
+    size_t fill(char *buffer, size_t size);
+    /// Produce the next piece of tar into `in`, false on failure
+    bool produce();
+    bool start_entry(u32 i);
+};
+
+/// Unpacks a gzip compressed tar archive while it is received, into a local folder
+class ArchiveReader
+{
+public:
+    explicit ArchiveReader(const std::string &base_path);
+    ArchiveReader(const ArchiveReader &) = delete;
+    ArchiveReader &operator=(const ArchiveReader &) = delete;
+    ~ArchiveReader();
+
+    /// Start over, for a retried request. Files written so far are simply overwritten.
+    bool restart();
+    /// Whether the archive was complete and everything in it could be written
+    bool finish();
+    bool failed() const;
+    /// Files written so far
+    u32 file_count() const;
+    /// CURLOPT_WRITEFUNCTION, with this as CURLOPT_WRITEDATA
+    static size_t write(char *data, size_t size, size_t nmemb, void *userp);
+
+private:
+    const std::string base_path;
+    z_stream zs;
+    bool stream_end;
+    // Tar parsing state
+    char header[512];
+    size_t header_used;
+    std::string long_name; // From a GNU long name or pax header entry, for the next header
+    char meta_type;        // 'L' or 'x' while reading such an entry, 0 otherwise
+    FILE *fp;
+    u64 remaining;  // Content bytes of the current entry
+    size_t padding; // After the content
+    bool ended;
+    bool broken;
+    u32 files;
+
+    bool consume(const char *data, size_t size);
+    bool parse_header();
+    bool close_file();
+};
+
+/// What the last archive upload or restore was made from
+struct ArchiveManifest
+{
+    TreeSummary local;
+    time_t remote_mtime = 0; // Of the archive on the server
+};
+
+/// nullopt if missing or unreadable
+std::optional<ArchiveManifest> load_archive_manifest(const std::string &file);
+bool save_archive_manifest(const std::string &file, const ArchiveManifest &manifest);
@@ -0,0 +1,198 @@
+#include "block_map.hpp"
+#include "console.hpp"
+
+#include <algorithm>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+using namespace std;
+
+static const char *header = "NXDavSync-blocks 1\n";
+
+optional<BlockMap> hash_blocks(const string &path, u32 block_size)
+{
+    FILE *fp = fopen(path.c_str(), "rb");
+    if (!fp)
+    {
+        return nullopt;
+    }
+    BlockMap map{block_size, 0, 0, ""};
+    vector<char> block(block_size);
+    size_t n;
+    while ((n = fread(block.data(), 1, block_size, fp)) > 0)
+    {
+        u8 hash[SHA1_HASH_SIZE];
+        sha1CalculateHash(hash, block.data(), n);
+        map.hashes.append((const char *)hash, sizeof(hash));
+        map.size += n;
+    }
+    bool failed = ferror(fp);
+    fclose(fp);
+    if (failed)
+    {
+        return nullopt;
+    }
+    return map;
+}
+
+vector<pair<u64, u64>> changed_ranges(const BlockMap &before, const BlockMap &now)
+{
+    vector<pair<u64, u64>> ranges;
+    size_t blocks = now.hashes.size() / SHA1_HASH_SIZE;
+    for (size_t i = 0; i < blocks; i++)
+    {
+        // A block past the old end, or one whose length changed, hashes differently too
+        bool same = (i + 1) * SHA1_HASH_SIZE <= before.hashes.size() &&
+                    before.hashes.compare(i * SHA1_HASH_SIZE, SHA1_HASH_SIZE, now.hashes, i * SHA1_HASH_SIZE, SHA1_HASH_SIZE) == 0;
+        if (same)
+            continue;
+        u64 first = (u64)i * now.block_size;
+        u64 last = min(first + now.block_size, now.size);
+        if (!ranges.empty() && ranges.back().second == first)
+            ranges.back().second = last;
+        else
+            ranges.push_back(make_pair(first, last));
+    }
+    return ranges;
+}
+
+static string to_hex(const string &bytes)
+{
+    static const char digits[] = "0123456789abcdef";
+    string hex;
+    hex.reserve(bytes.size() * 2);
+    for (unsigned char c : bytes)
+    {
+        hex += digits[c >> 4];
+        hex += digits[c & 15];
+    }
+    return hex;
+}
+
+static bool from_hex(const char *hex, size_t length, string &bytes)
+{
+    if (length % 2)
+        return false;
+    bytes.clear();
+    for (size_t i = 0; i < length; i += 2)
+    {
+        char byte[3] = {hex[i], hex[i + 1], 0};
+        char *end;
+        bytes += (char)strtoul(byte, &end, 16);
+        if (end != byte + 2)
+            return false;
+    }
+    return true;
+}
+
+BlockMapStore::BlockMapStore() : loaded(false)
+{
+}
+
+void BlockMapStore::set_file(const string &file)
+{
+    lock_guard<mutex> guard(this->lock);
+    this->file = file;
+    this->loaded = false;
+    this->maps.clear();
+}
+
+void BlockMapStore::load()
+{
+    this->loaded = true;
+    FILE *fp = this->file.empty() ? NULL : fopen(this->file.c_str(), "r");
+    if (!fp)
+    {
+        return;
+    }
+    char *line = NULL;
+    size_t capacity = 0;
+    ssize_t length = getline(&line, &capacity, fp);
+    if (length < 0 || strcmp(line, header) != 0)
+    {
+        free(line);
+        fclose(fp);
+        return;
+    }
+    while ((length = getline(&line, &capacity, fp)) > 0)
+    {
+        if (line[length - 1] == '\n')
+            line[--length] = '\0';
+        // B <block size> <size> <mtime> <hashes> <path>
+        BlockMap map;
+        unsigned block_size;
+        unsigned long long size;
+        long long mtime;
+        int hashes_start = -1, hashes_end = -1;
+        if (sscanf(line, "B\t%u\t%llu\t%lld\t%n%*[0-9a-f]%n", &block_size, &size, &mtime, &hashes_start, &hashes_end) != 3 ||
+            hashes_end < 0 || hashes_end >= length || line[hashes_end] != '\t' || !from_hex(line + hashes_start, hashes_end - hashes_start, map.hashes))
+        {
+            // Torn or foreign line, that file just uploads in full once
+            continue;
+        }
+        map.block_size = block_size;
+        map.size = size;
+        map.mtime = mtime;
+        this->maps[string(line + hashes_end + 1)] = map;
+    }
+    free(line);
+    fclose(fp);
+}
+
+optional<BlockMap> BlockMapStore::get(const string &path)
+{
+    lock_guard<mutex> guard(this->lock);
+    if (!this->loaded)
+    {
+        this->load();
+    }
+    auto it = this->maps.find(path);
+    if (it == this->maps.end())
+    {
+        return nullopt;
+    }
+    return it->second;
+}
+
+void BlockMapStore::put(const string &path, const BlockMap &map)
+{
+    lock_guard<mutex> guard(this->lock);
+    if (!this->loaded)
+    {
+        this->load();
+    }
+    this->maps[path] = map;
+    if (this->file.empty())
+    {
+        return;
+    }
+
+    string tmp = this->file + ".tmp";
+    FILE *fp = fopen(tmp.c_str(), "w");
+    if (!fp)
+    {
+        console_printf("can't write %s: %s\n", tmp.c_str(), strerror(errno));
+        return;
+    }
+    fputs(header, fp);
+    for (const auto &[name, m] : this->maps)
+    {
+        fprintf(fp, "B\t%u\t%" PRIu64 "\t%lld\t%s\t%s\n", m.block_size, m.size, (long long)m.mtime, to_hex(m.hashes).c_str(), name.c_str());
+    }
+    // A map must never describe content the server doesn't have, so it's replaced whole
+    bool ok = fflush(fp) == 0 && fsync(fileno(fp)) == 0;
+    ok = fclose(fp) == 0 && ok;
+    if (ok)
+    {
+        remove(this->file.c_str());
+        ok = rename(tmp.c_str(), this->file.c_str()) == 0;
+    }
+    if (!ok)
+    {
+        console_printf("can't save block maps %s\n", this->file.c_str());
+        remove(tmp.c_str());
+    }
+}
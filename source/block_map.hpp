@@ -0,0 +1,46 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <map>
+#include <mutex>
+#include <optional>
+#include <utility>
+#include <ctime>
+#include <switch.h>
+
+/// SHA1 of every fixed size block of a file, to find what changed between two versions
+struct BlockMap
+{
+    u32 block_size;
+    u64 size;
+    time_t mtime;       // Of the remote file the map describes
+    std::string hashes; // 20 bytes per block
+};
+
+/// Hash the file at `path` in blocks of `block_size`, nullopt if it can't be read
+std::optional<BlockMap> hash_blocks(const std::string &path, u32 block_size);
+
+/// Byte ranges [first, second) where `now` differs from `before`, adjacent blocks merged
+std::vector<std::pair<u64, u64>> changed_ranges(const BlockMap &before, const BlockMap &now);
+
+/// Block maps of the remote versions of one profile's large files, kept in a
+/// single file next to its state. Safe to use from every lane.
+class BlockMapStore
+{
+public:
+    BlockMapStore();
+    /// Keep the maps in `file`, loaded on first use. Without one they only last for this run.
+    void set_file(const std::string &file);
+    std::optional<BlockMap> get(const std::string &path);
+    /// Remember the map and atomically replace the file
+    void put(const std::string &path, const BlockMap &map);
+
+private:
+    std::mutex lock;
+    std::string file;
+    bool loaded;
+    std::map<std::string, BlockMap> maps;
+
+    void load();
+};
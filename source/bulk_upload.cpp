@@ -0,0 +1,436 @@
+#include "bulk_upload.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <random>
+#include <thread>
+#include <ctype.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <curl/curl.h>
+
+using namespace std;
+
+optional<BulkEndpoint> bulk_endpoint(const string &web_root)
+{
+    size_t dav = web_root.find("/remote.php/");
+    if (dav == string::npos)
+    {
+        return nullopt;
+    }
+    string rest = web_root.substr(dav + strlen("/remote.php/"));
+    string folder;
+    if (rest.compare(0, strlen("dav/files/"), "dav/files/") == 0)
+    {
+        // Skip the user name
+        size_t slash = rest.find('/', strlen("dav/files/"));
+        folder = slash == string::npos ? "" : rest.substr(slash);
+    }
+    else if (rest.compare(0, strlen("webdav"), "webdav") == 0 &&
+             (rest.size() == strlen("webdav") || rest[strlen("webdav")] == '/'))
+    {
+        folder = rest.substr(strlen("webdav"));
+    }
+    else
+    {
+        return nullopt;
+    }
+    // X-File-Path is a plain path, the URL is escaped
+    int length = 0;
+    char *unescaped = curl_easy_unescape(NULL, folder.c_str(), folder.size(), &length);
+    if (!unescaped)
+    {
+        return nullopt;
+    }
+    folder.assign(unescaped, length);
+    curl_free(unescaped);
+    while (!folder.empty() && folder.back() == '/')
+    {
+        folder.pop_back();
+    }
+    string server = web_root.substr(0, dav);
+    return BulkEndpoint{server + "/remote.php/dav/bulk", folder, server + "/ocs/v2.php/cloud/capabilities?format=json"};
+}
+
+BulkBody::BulkBody(const vector<BulkPart> &parts) : parts(parts), total(0), part(0), offset(0), fp(NULL), broken(false)
+{
+    // Long enough that no file will contain it
+    static thread_local mt19937_64 rng(chrono::steady_clock::now().time_since_epoch().count() ^
+                                       hash<thread::id>()(this_thread::get_id()));
+    char id[40];
+    snprintf(id, sizeof(id), "%016llx%016llx", (unsigned long long)rng(), (unsigned long long)rng());
+    this->boundary = string("NXDavSync-") + id;
+
+    for (size_t i = 0; i < parts.size(); i++)
+    {
+        const BulkPart &p = parts[i];
+        string head = i == 0 ? "" : "\r\n";
+        head += "--" + this->boundary + "\r\n";
+        head += "X-File-Path: " + p.target + "\r\n";
+        head += "X-File-MD5: " + p.md5 + "\r\n";
+        head += "X-File-Mtime: " + to_string(p.mtime) + "\r\n";
+        head += "Content-Length: " + to_string(p.size) + "\r\n\r\n";
+        this->total += head.size() + p.size;
+        this->heads.push_back(head);
+    }
+    this->tail = "\r\n--" + this->boundary + "--\r\n";
+    this->total += this->tail.size();
+}
+
+BulkBody::~BulkBody()
+{
+    if (this->fp)
+    {
+        fclose(this->fp);
+    }
+}
+
+string BulkBody::content_type() const
+{
+    return "multipart/related; boundary=" + this->boundary;
+}
+
+u64 BulkBody::length() const
+{
+    return this->total;
+}
+
+bool BulkBody::rewind()
+{
+    if (this->fp)
+    {
+        fclose(this->fp);
+        this->fp = NULL;
+    }
+    this->part = 0;
+    this->offset = 0;
+    this->broken = false;
+    return true;
+}
+
+bool BulkBody::failed() const
+{
+    return this->broken;
+}
+
+size_t BulkBody::read(char *buffer, size_t size, size_t nitems, void *userp)
+{
+    return ((BulkBody *)userp)->fill(buffer, size * nitems);
+}
+
+size_t BulkBody::fill(char *buffer, size_t size)
+{
+    size_t written = 0;
+    while (written < size && this->part <= this->parts.size())
+    {
+        const string &head = this->part < this->parts.size() ? this->heads[this->part] : this->tail;
+        if (this->offset < head.size())
+        {
+            size_t n = min(size - written, (size_t)(head.size() - this->offset));
+            memcpy(buffer + written, head.data() + this->offset, n);
+            written += n;
+            this->offset += n;
+            continue;
+        }
+        if (this->part == this->parts.size())
+        {
+            // All sent
+            this->part++;
+            break;
+        }
+
+        const BulkPart &p = this->parts[this->part];
+        u64 sent = this->offset - head.size();
+        if (sent < p.size)
+        {
+            if (!this->fp && !(this->fp = fopen(p.local_path.c_str(), "rb")))
+            {
+                this->broken = true;
+                return CURL_READFUNC_ABORT;
+            }
+            size_t n = fread(buffer + written, 1, min((u64)(size - written), p.size - sent), this->fp);
+            if (n == 0)
+            {
+                // Shrunk since it was listed, Content-Length can't be kept
+                this->broken = true;
+                return CURL_READFUNC_ABORT;
+            }
+            written += n;
+            this->offset += n;
+            continue;
+        }
+        // Anything the file grew by meanwhile fails the MD5 check on the server instead
+        if (this->fp)
+        {
+            fclose(this->fp);
+            this->fp = NULL;
+        }
+        this->part++;
+        this->offset = 0;
+    }
+    return written;
+}
+
+static void skip_space(const char *&p, const char *end)
+{
+    while (p < end && (*p == ' ' || *p == '\t' || *p == '\n' || *p == '\r'))
+        p++;
+}
+
+static void append_utf8(string &out, u32 c)
+{
+    if (c < 0x80)
+    {
+        out += (char)c;
+    }
+    else if (c < 0x800)
+    {
+        out += (char)(0xc0 | c >> 6);
+        out += (char)(0x80 | (c & 0x3f));
+    }
+    else if (c < 0x10000)
+    {
+        out += (char)(0xe0 | c >> 12);
+        out += (char)(0x80 | (c >> 6 & 0x3f));
+        out += (char)(0x80 | (c & 0x3f));
+    }
+    else
+    {
+        out += (char)(0xf0 | c >> 18);
+        out += (char)(0x80 | (c >> 12 & 0x3f));
+        out += (char)(0x80 | (c >> 6 & 0x3f));
+        out += (char)(0x80 | (c & 0x3f));
+    }
+}
+
+static bool parse_hex4(const char *&p, const char *end, u32 &value)
+{
+    if (end - p < 4)
+        return false;
+    char digits[5] = {p[0], p[1], p[2], p[3], 0};
+    char *stop;
+    value = strtoul(digits, &stop, 16);
+    p += 4;
+    return stop == digits + 4;
+}
+
+static bool parse_string(const char *&p, const char *end, string &out)
+{
+    out.clear();
+    if (p >= end || *p != '"')
+        return false;
+    p++;
+    while (p < end && *p != '"')
+    {
+        if (*p != '\\')
+        {
+            out += *p++;
+            continue;
+        }
+        if (++p >= end)
+            return false;
+        char c = *p++;
+        switch (c)
+        {
+        case 'b':
+            out += '\b';
+            break;
+        case 'f':
+            out += '\f';
+            break;
+        case 'n':
+            out += '\n';
+            break;
+        case 'r':
+            out += '\r';
+            break;
+        case 't':
+            out += '\t';
+            break;
+        case 'u':
+        {
+            // PHP escapes everything outside ASCII, as UTF-16
+            u32 unit;
+            if (!parse_hex4(p, end, unit))
+                return false;
+            if (unit >= 0xd800 && unit < 0xdc00 && end - p >= 6 && p[0] == '\\' && p[1] == 'u')
+            {
+                const char *low_start = p + 2;
+                u32 low;
+                if (parse_hex4(low_start, end, low) && low >= 0xdc00 && low < 0xe000)
+                {
+                    unit = 0x10000 + ((unit - 0xd800) << 10) + (low - 0xdc00);
+                    p = low_start;
+                }
+            }
+            append_utf8(out, unit);
+            break;
+        }
+        default:
+            // \" \\ and \/ stand for themselves
+            out += c;
+        }
+    }
+    if (p >= end)
+        return false;
+    p++;
+    return true;
+}
+
+/// Skip any value; results only need strings and booleans
+static bool skip_value(const char *&p, const char *end)
+{
+    skip_space(p, end);
+    if (p >= end)
+        return false;
+    if (*p == '"')
+    {
+        string ignored;
+        return parse_string(p, end, ignored);
+    }
+    if (*p == '{' || *p == '[')
+    {
+        char close = *p == '{' ? '}' : ']';
+        p++;
+        skip_space(p, end);
+        if (p < end && *p == close)
+        {
+            p++;
+            return true;
+        }
+        while (true)
+        {
+            if (close == '}')
+            {
+                string key;
+                skip_space(p, end);
+                if (!parse_string(p, end, key))
+                    return false;
+                skip_space(p, end);
+                if (p >= end || *p++ != ':')
+                    return false;
+            }
+            if (!skip_value(p, end))
+                return false;
+            skip_space(p, end);
+            if (p < end && *p == ',')
+            {
+                p++;
+                continue;
+            }
+            if (p < end && *p == close)
+            {
+                p++;
+                return true;
+            }
+            return false;
+        }
+    }
+    // Numbers, true, false and null
+    const char *start = p;
+    while (p < end && (isalnum((unsigned char)*p) || *p == '-' || *p == '+' || *p == '.'))
+        p++;
+    return p > start;
+}
+
+static bool parse_result(const char *&p, const char *end, BulkResult &result)
+{
+    result = BulkResult{false, "", ""};
+    bool error = true;
+    skip_space(p, end);
+    if (p >= end || *p++ != '{')
+        return false;
+    skip_space(p, end);
+    if (p < end && *p == '}')
+    {
+        p++;
+        return true;
+    }
+    while (true)
+    {
+        string key;
+        skip_space(p, end);
+        if (!parse_string(p, end, key))
+            return false;
+        skip_space(p, end);
+        if (p >= end || *p++ != ':')
+            return false;
+        skip_space(p, end);
+        if (key == "error")
+        {
+            error = end - p < 5 || strncmp(p, "false", 5) != 0;
+            if (!skip_value(p, end))
+                return false;
+        }
+        else if ((key == "etag" || key == "message") && p < end && *p == '"')
+        {
+            if (!parse_string(p, end, key == "etag" ? result.etag : result.message))
+                return false;
+        }
+        else if (!skip_value(p, end))
+        {
+            return false;
+        }
+        skip_space(p, end);
+        if (p < end && *p == ',')
+        {
+            p++;
+            continue;
+        }
+        if (p < end && *p == '}')
+        {
+            p++;
+            result.ok = !error;
+            return true;
+        }
+        return false;
+    }
+}
+
+optional<map<string, BulkResult>> parse_bulk_response(const string &json)
+{
+    map<string, BulkResult> results;
+    const char *p = json.data();
+    const char *end = p + json.size();
+    skip_space(p, end);
+    // PHP encodes an empty result as an empty array
+    if (end - p >= 2 && p[0] == '[' && p[1] == ']')
+    {
+        return results;
+    }
+    if (p >= end || *p++ != '{')
+    {
+        return nullopt;
+    }
+    skip_space(p, end);
+    if (p < end && *p == '}')
+    {
+        return results;
+    }
+    while (true)
+    {
+        string path;
+        BulkResult result;
+        skip_space(p, end);
+        if (!parse_string(p, end, path))
+            return nullopt;
+        skip_space(p, end);
+        if (p >= end || *p++ != ':')
+            return nullopt;
+        if (!parse_result(p, end, result))
+            return nullopt;
+        results[path] = result;
+        skip_space(p, end);
+        if (p < end && *p == ',')
+        {
+            p++;
+            continue;
+        }
+        if (p < end && *p == '}')
+        {
+            return results;
+        }
+        return nullopt;
+    }
+}
@@ -0,0 +1,76 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <map>
+#include <optional>
+#include <ctime>
+#include <stdio.h>
+#include <switch.h>
+
+/// Where a web root lives on a Nextcloud server, for its bulk upload endpoint
+struct BulkEndpoint
+{
+    std::string url;          // <server>/remote.php/dav/bulk
+    std::string folder;       // The web root below the user's files, "" for the top
+    std::string capabilities; // OCS capability list, which announces the endpoint
+};
+
+/// nullopt if `web_root` isn't a Nextcloud files URL (remote.php/dav/files/<user> or remote.php/webdav)
+std::optional<BulkEndpoint> bulk_endpoint(const std::string &web_root);
+
+/// One file of a bulk upload
+struct BulkPart
+{
+    std::string local_path;
+    std::string target; // X-File-Path, relative to the user's files
+    u64 size;
+    time_t mtime;
+    std::string md5;
+};
+
+/// A multipart/related request body streamed straight from the files, one at a time,
+/// so a batch never has to fit in memory
+class BulkBody
+{
+public:
+    BulkBody(const std::vector<BulkPart> &parts);
+    BulkBody(const BulkBody &) = delete;
+    BulkBody &operator=(const BulkBody &) = delete;
+    ~BulkBody();
+
+    std::string content_type() const;
+    u64 length() const;
+    /// Start over, for a retried request
+    bool rewind();
+    /// Whether the last pass aborted because a file couldn't be read or changed size
+    bool failed() const;
+    /// CURLOPT_READFUNCTION, with this as CURLOPT_READDATA
+    static size_t read(char *buffer, size_t size, size_t nitems, void *userp);
+
+private:
+    const std::vector<BulkPart> &parts;
+    std::string boundary;
+    std::vector<std::string> heads; // Boundary and headers before each part's content
+    std::string tail;
+    u64 total;
+    // Position: part `part`, `offset` bytes into its head and content
+    size_t part;
+    u64 offset;
+    FILE *fp;
+    bool broken;
+
+    size_t fill(char *buffer, size_t size);
+};
+
+/// What the server did with one file of a batch
+struct BulkResult
+{
+    bool ok;
+    std::string etag;
+    std::string message;
+};
+
+/// Parse the bulk endpoint's JSON response, which maps each X-File-Path to its result.
+/// nullopt if it isn't one.
+std::optional<std::map<std::string, BulkResult>> parse_bulk_response(const std::string &json);
@@ -0,0 +1,94 @@
+#include "capabilities.hpp"
+#include "console.hpp"
+
+#include <stdio.h>
+#include <string.h>
+
+using namespace std;
+
+static const char *header = "NXDavSync-caps 1\n";
+
+string ServerCapabilities::summary() const
+{
+    string s;
+    s += this->oc_properties ? "ownCloud properties" : "plain WebDAV";
+    s += this->infinite_depth ? ", infinite depth" : ", folder by folder listing";
+    if (this->ranges)
+        s += ", ranges";
+    if (this->http2)
+        s += ", HTTP/2";
+    if (this->sync_collection)
+        s += ", sync-collection";
+    if (this->bulk_upload)
+        s += ", bulk upload";
+    if (this->partial_update)
+        s += ", partial updates";
+    return s;
+}
+
+optional<ServerCapabilities> load_capabilities(const string &file, time_t ttl)
+{
+    FILE *fp = fopen(file.c_str(), "r");
+    if (!fp)
+    {
+        return nullopt;
+    }
+    char line[256];
+    if (!fgets(line, sizeof(line), fp) || strcmp(line, header) != 0)
+    {
+        fclose(fp);
+        return nullopt;
+    }
+    ServerCapabilities caps;
+    while (fgets(line, sizeof(line), fp))
+    {
+        char key[64];
+        long long value;
+        if (sscanf(line, "%63s %lld", key, &value) != 2)
+            continue;
+        if (strcmp(key, "probed") == 0)
+            caps.probed = value;
+        else if (strcmp(key, "oc_properties") == 0)
+            caps.oc_properties = value;
+        else if (strcmp(key, "infinite_depth") == 0)
+            caps.infinite_depth = value;
+        else if (strcmp(key, "ranges") == 0)
+            caps.ranges = value;
+        else if (strcmp(key, "http2") == 0)
+            caps.http2 = value;
+        else if (strcmp(key, "sync_collection") == 0)
+            caps.sync_collection = value;
+        else if (strcmp(key, "bulk_upload") == 0)
+            caps.bulk_upload = value;
+        else if (strcmp(key, "partial_update") == 0)
+            caps.partial_update = value;
+    }
+    fclose(fp);
+    time_t now = time(NULL);
+    // A clock that went backwards invalidates the cache too
+    if (caps.probed == 0 || now < caps.probed || now - caps.probed >= ttl)
+    {
+        return nullopt;
+    }
+    return caps;
+}
+
+bool save_capabilities(const string &file, const ServerCapabilities &caps)
+{
+    FILE *fp = fopen(file.c_str(), "w");
+    if (!fp)
+    {
+        console_printf("can't write %s: %s\n", file.c_str(), strerror(errno));
+        return false;
+    }
+    fputs(header, fp);
+    fprintf(fp, "probed %lld\n", (long long)caps.probed);
+    fprintf(fp, "oc_properties %d\n", caps.oc_properties);
+    fprintf(fp, "infinite_depth %d\n", caps.infinite_depth);
+    fprintf(fp, "ranges %d\n", caps.ranges);
+    fprintf(fp, "http2 %d\n", caps.http2);
+    fprintf(fp, "sync_collection %d\n", caps.sync_collection);
+    fprintf(fp, "bulk_upload %d\n", caps.bulk_upload);
+    fprintf(fp, "partial_update %d\n", caps.partial_update);
+    return fclose(fp) == 0;
+}
@@ -0,0 +1,31 @@
+#pragma once
+
+#include <string>
+#include <optional>
+#include <ctime>
+
+/// What a server supports, as far as the sync strategy is concerned
+struct ServerCapabilities
+{
+    // ownCloud/Nextcloud properties and headers: oc:checksums, X-OC-Mtime, OC-Checksum
+    bool oc_properties = true;
+    // PROPFIND with Depth: infinity; otherwise listings go folder by folder
+    bool infinite_depth = true;
+    // Byte ranges on GET, so an interrupted download continues where it stopped
+    bool ranges = false;
+    bool http2 = false;
+    // RFC 6578 REPORT, for incremental listings
+    bool sync_collection = false;
+    // Nextcloud's bulk upload endpoint, many small files in one request
+    bool bulk_upload = false;
+    // SabreDAV's PATCH with X-Update-Range, to rewrite parts of a file
+    bool partial_update = false;
+    time_t probed = 0; // When this was found out, 0 if never
+
+    /// One line for the log
+    std::string summary() const;
+};
+
+/// Capabilities cached by an earlier run, nullopt if missing or older than `ttl` seconds
+std::optional<ServerCapabilities> load_capabilities(const std::string &file, time_t ttl);
+bool save_capabilities(const std::string &file, const ServerCapabilities &caps);
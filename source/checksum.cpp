@@ -0,0 +1,196 @@
+#include "checksum.hpp"
+
+#include <algorithm>
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+#include <switch.h>
+
+using namespace std;
+
+static string to_hex(const u8 *hash, size_t size)
+{
+    string hex;
+    for (size_t i = 0; i < size; i++)
+    {
+        char byte[3];
+        snprintf(byte, sizeof(byte), "%02x", hash[i]);
+        hex += byte;
+    }
+    return hex;
+}
+
+optional<string> file_sha1(const string &path)
+{
+    FILE *fp = fopen(path.c_str(), "rb");
+    if (!fp)
+    {
+        return nullopt;
+    }
+    Sha1Context ctx;
+    sha1ContextCreate(&ctx);
+    static thread_local char buf[64 * 1024];
+    size_t n;
+    while ((n = fread(buf, 1, sizeof(buf), fp)) > 0)
+    {
+        sha1ContextUpdate(&ctx, buf, n);
+    }
+    bool failed = ferror(fp);
+    fclose(fp);
+    if (failed)
+    {
+        return nullopt;
+    }
+
+    u8 hash[SHA1_HASH_SIZE];
+    sha1ContextGetHash(&ctx, hash);
+    return to_hex(hash, SHA1_HASH_SIZE);
+}
+
+// libnx has no MD5, this follows RFC 1321
+struct Md5Context
+{
+    u32 state[4] = {0x67452301, 0xefcdab89, 0x98badcfe, 0x10325476};
+    u64 length = 0;
+    u8 block[64];
+};
+
+static const u32 md5_k[64] = {
+    0xd76aa478, 0xe8c7b756, 0x242070db, 0xc1bdceee, 0xf57c0faf, 0x4787c62a, 0xa8304613, 0xfd469501,
+    0x698098d8, 0x8b44f7af, 0xffff5bb1, 0x895cd7be, 0x6b901122, 0xfd987193, 0xa679438e, 0x49b40821,
+    0xf61e2562, 0xc040b340, 0x265e5a51, 0xe9b6c7aa, 0xd62f105d, 0x02441453, 0xd8a1e681, 0xe7d3fbc8,
+    0x21e1cde6, 0xc33707d6, 0xf4d50d87, 0x455a14ed, 0xa9e3e905, 0xfcefa3f8, 0x676f02d9, 0x8d2a4c8a,
+    0xfffa3942, 0x8771f681, 0x6d9d6122, 0xfde5380c, 0xa4beea44, 0x4bdecfa9, 0xf6bb4b60, 0xbebfbc70,
+    0x289b7ec6, 0xeaa127fa, 0xd4ef3085, 0x04881d05, 0xd9d4d039, 0xe6db99e5, 0x1fa27cf8, 0xc4ac5665,
+    0xf4292244, 0x432aff97, 0xab9423a7, 0xfc93a039, 0x655b59c3, 0x8f0ccc92, 0xffeff47d, 0x85845dd1,
+    0x6fa87e4f, 0xfe2ce6e0, 0xa3014314, 0x4e0811a1, 0xf7537e82, 0xbd3af235, 0x2ad7d2bb, 0xeb86d391,
+};
+
+static const u8 md5_shift[64] = {
+    7, 12, 17, 22, 7, 12, 17, 22, 7, 12, 17, 22, 7, 12, 17, 22,
+    5, 9, 14, 20, 5, 9, 14, 20, 5, 9, 14, 20, 5, 9, 14, 20,
+    4, 11, 16, 23, 4, 11, 16, 23, 4, 11, 16, 23, 4, 11, 16, 23,
+    6, 10, 15, 21, 6, 10, 15, 21, 6, 10, 15, 21, 6, 10, 15, 21,
+};
+
+static void md5_block(Md5Context &ctx, const u8 *data)
+{
+    u32 m[16];
+    for (int i = 0; i < 16; i++)
+    {
+        m[i] = data[i * 4] | (data[i * 4 + 1] << 8) | (data[i * 4 + 2] << 16) | ((u32)data[i * 4 + 3] << 24);
+    }
+    u32 a = ctx.state[0], b = ctx.state[1], c = ctx.state[2], d = ctx.state[3];
+    for (int i = 0; i < 64; i++)
+    {
+        u32 f;
+        int g;
+        if (i < 16)
+            f = (b & c) | (~b & d), g = i;
+        else if (i < 32)
+            f = (d & b) | (~d & c), g = (5 * i + 1) % 16;
+        else if (i < 48)
+            f = b ^ c ^ d, g = (3 * i + 5) % 16;
+        else
+            f = c ^ (b | ~d), g = (7 * i) % 16;
+        f += a + md5_k[i] + m[g];
+        a = d;
+        d = c;
+        c = b;
+        b += (f << md5_shift[i]) | (f >> (32 - md5_shift[i]));
+    }
+    ctx.state[0] += a;
+    ctx.state[1] += b;
+    ctx.state[2] += c;
+    ctx.state[3] += d;
+}
+
+static void md5_update(Md5Context &ctx, const u8 *data, size_t size)
+{
+    size_t used = ctx.length % 64;
+    ctx.length += size;
+    if (used)
+    {
+        size_t n = min(size, 64 - used);
+        memcpy(ctx.block + used, data, n);
+        data += n;
+        size -= n;
+        if (used + n < 64)
+            return;
+        md5_block(ctx, ctx.block);
+    }
+    for (; size >= 64; data += 64, size -= 64)
+    {
+        md5_block(ctx, data);
+    }
+    memcpy(ctx.block, data, size);
+}
+
+static void md5_finish(Md5Context &ctx, u8 hash[16])
+{
+    u64 bits = ctx.length * 8;
+    u8 pad[72] = {0x80};
+    size_t pad_size = (ctx.length % 64 < 56 ? 56 : 120) - ctx.length % 64;
+    for (int i = 0; i < 8; i++)
+    {
+        pad[pad_size + i] = bits >> (i * 8);
+    }
+    md5_update(ctx, pad, pad_size + 8);
+    for (int i = 0; i < 16; i++)
+    {
+        hash[i] = ctx.state[i / 4] >> ((i % 4) * 8);
+    }
+}
+
+optional<string> file_md5(const string &path)
+{
+    FILE *fp = fopen(path.c_str(), "rb");
+    if (!fp)
+    {
+        return nullopt;
+    }
+    Md5Context ctx;
+    static thread_local char buf[64 * 1024];
+    size_t n;
+    while ((n = fread(buf, 1, sizeof(buf), fp)) > 0)
+    {
+        md5_update(ctx, (const u8 *)buf, n);
+    }
+    bool failed = ferror(fp);
+    fclose(fp);
+    if (failed)
+    {
+        return nullopt;
+    }
+
+    u8 hash[16];
+    md5_finish(ctx, hash);
+    return to_hex(hash, sizeof(hash));
+}
+
+string parse_oc_sha1(const char *checksums)
+{
+    if (!checksums)
+    {
+        return "";
+    }
+    // Space separated "ALGO:hex" tokens
+    const char *p = checksums;
+    while (*p)
+    {
+        while (*p == ' ')
+            p++;
+        const char *end = p;
+        while (*end && *end != ' ')
+            end++;
+        if (end - p > 5 && strncasecmp(p, "SHA1:", 5) == 0)
+        {
+            string hex(p + 5, end);
+            for (char &c : hex)
+                c = tolower(c);
+            return hex;
+        }
+        p = end;
+    }
+    return "";
+}
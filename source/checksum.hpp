@@ -0,0 +1,13 @@
+#pragma once
+
+#include <string>
+#include <optional>
+
+/// SHA1 of a local file as lowercase hex, or nullopt if it can't be read
+std::optional<std::string> file_sha1(const std::string &path);
+/// MD5 of a local file as lowercase hex, or nullopt if it can't be read.
+/// Only for protocols that insist on it, such as Nextcloud's bulk upload.
+std::optional<std::string> file_md5(const std::string &path);
+/// Extract the SHA1 from an ownCloud/Nextcloud checksum list such as
+/// "SHA1:abc MD5:def ADLER32:123", or "" if there is none
+std::string parse_oc_sha1(const char *checksums);
@@ -0,0 +1,258 @@
+#include "console.hpp"
+
+#include <stdio.h>
+#include <stdarg.h>
+#include <string.h>
+#include <atomic>
+#include <thread>
+#include <chrono>
+
+using namespace std;
+
+static mutex console_mutex;
+static mutex prompt_mutex;
+static bool multiplexed = false;
+static thread_local string profile;
+
+namespace
+{
+    /// Bounded lock-free multi-producer single-consumer queue of log chunks.
+    /// Workers never wait on the console; if it falls behind lines are dropped.
+    class LogRing
+    {
+    public:
+        static const size_t slots = 256;
+        static const size_t slot_size = 256;
+
+        LogRing() : head(0), tail(0), dropped(0)
+        {
+            for (size_t i = 0; i < slots; i++)
+                this->ring[i].seq = i;
+        }
+
+        void push(const char *text, size_t len)
+        {
+            size_t pos = this->head.load(memory_order_relaxed);
+            Slot *slot;
+            while (true)
+            {
+                slot = &this->ring[pos % slots];
+                size_t seq = slot->seq.load(memory_order_acquire);
+                intptr_t diff = (intptr_t)seq - (intptr_t)pos;
+                if (diff == 0 && this->head.compare_exchange_weak(pos, pos + 1, memory_order_relaxed))
+                    break;
+                if (diff < 0)
+                {
+                    this->dropped.fetch_add(1, memory_order_relaxed);
+                    return;
+                }
+                if (diff > 0)
+                    pos = this->head.load(memory_order_relaxed);
+            }
+            slot->len = min(len, slot_size);
+            memcpy(slot->text, text, slot->len);
+            slot->seq.store(pos + 1, memory_order_release);
+        }
+
+        /// Consumer only: append the next chunk to `out`, false if empty
+        bool pop(string &out)
+        {
+            Slot *slot = &this->ring[this->tail % slots];
+            if (slot->seq.load(memory_order_acquire) != this->tail + 1)
+                return false;
+            out.append(slot->text, slot->len);
+            slot->seq.store(this->tail + slots, memory_order_release);
+            this->tail++;
+            return true;
+        }
+
+        size_t take_dropped()
+        {
+            return this->dropped.exchange(0, memory_order_relaxed);
+        }
+
+    private:
+        struct Slot
+        {
+            atomic<size_t> seq;
+            size_t len;
+            char text[slot_size];
+        };
+        Slot ring[slots];
+        atomic<size_t> head;
+        size_t tail;
+        atomic<size_t> dropped;
+    };
+
+    LogRing log_ring;
+    atomic<bool> rendering(false);
+    atomic<bool> stop_requested(false);
+    thread renderer;
+    PrintConsole *render_console = NULL;
+    vector<TransferStatus *> render_statuses;
+
+    int status_rows()
+    {
+        // One line per profile, an aggregate line and a separator
+        return render_statuses.size() + 2;
+    }
+
+    void draw_status()
+    {
+        PrintConsole *c = render_console;
+        int width = c->consoleWidth;
+        int height = c->consoleHeight;
+        int log_x = c->cursorX, log_y = c->cursorY;
+        consoleSetWindow(c, 0, height - status_rows(), width, status_rows());
+
+        double rate = 0;
+        u64 remaining = 0;
+        string lines = string(width - 1, '-') + "\n";
+        for (TransferStatus *s : render_statuses)
+        {
+            string line = s->describe(width - 1);
+            rate += s->rate();
+            remaining += s->remaining();
+            lines += line + string(width - 1 - line.size(), ' ') + "\n";
+        }
+        char total[128];
+        snprintf(total, sizeof(total), "Total %s/s, %s left, ETA %s", format_bytes(rate).c_str(),
+                 format_bytes(remaining).c_str(), format_eta(rate > 0 ? remaining / rate : -1).c_str());
+        string line = string(total).substr(0, width - 1);
+        lines += CONSOLE_CYAN + line + string(width - 1 - line.size(), ' ') + CONSOLE_RESET;
+        fputs(lines.c_str(), stdout);
+
+        consoleSetWindow(c, 0, 0, width, height - status_rows());
+        c->cursorX = log_x;
+        c->cursorY = log_y;
+    }
+
+    void render_frame()
+    {
+        string pending;
+        while (log_ring.pop(pending))
+        {
+        }
+        size_t dropped = log_ring.take_dropped();
+        if (dropped)
+        {
+            pending += "(" + to_string(dropped) + " log lines dropped)\n";
+        }
+        lock_guard<mutex> lock(console_mutex);
+        fputs(pending.c_str(), stdout);
+        draw_status();
+        // The only framebuffer flush of the frame
+        consoleUpdate(render_console);
+    }
+
+    void render_loop(int fps)
+    {
+        auto frame = chrono::microseconds(1000000 / max(fps, 1));
+        while (!stop_requested)
+        {
+            auto start = chrono::steady_clock::now();
+            render_frame();
+            this_thread::sleep_until(start + frame);
+        }
+        render_frame();
+    }
+}
+
+void console_set_profile(string name)
+{
+    profile = name;
+}
+
+string console_profile()
+{
+    return profile;
+}
+
+void console_set_multiplexed(bool m)
+{
+    lock_guard<mutex> lock(console_mutex);
+    multiplexed = m;
+}
+
+void console_printf(const char *fmt, ...)
+{
+    char buf[1024];
+    va_list args;
+    va_start(args, fmt);
+    vsnprintf(buf, sizeof(buf), fmt, args);
+    va_end(args);
+
+    string text;
+    if (multiplexed && !profile.empty())
+    {
+        // Prefix every non-empty line so interleaved output stays attributable
+        const char *line = buf;
+        while (*line)
+        {
+            const char *end = strchr(line, '\n');
+            size_t len = end ? (size_t)(end - line + 1) : strlen(line);
+            if (len > 1 || *line != '\n')
+            {
+                text += CONSOLE_CYAN "[" + profile + "] " CONSOLE_RESET;
+            }
+            text.append(line, len);
+            line += len;
+        }
+    }
+    else
+    {
+        text = buf;
+    }
+
+    if (rendering)
+    {
+        for (size_t i = 0; i < text.size(); i += LogRing::slot_size)
+        {
+            log_ring.push(text.data() + i, min(LogRing::slot_size, text.size() - i));
+        }
+        return;
+    }
+    lock_guard<mutex> lock(console_mutex);
+    fputs(text.c_str(), stdout);
+    consoleUpdate(NULL);
+}
+
+mutex &console_prompt_lock()
+{
+    return prompt_mutex;
+}
+
+void console_start_renderer(PrintConsole *console, vector<TransferStatus *> statuses, int fps)
+{
+    if (rendering || !console)
+    {
+        return;
+    }
+    render_console = console;
+    render_statuses = statuses;
+    {
+        lock_guard<mutex> lock(console_mutex);
+        // Keep the log above the status area from now on
+        int x = console->cursorX, y = console->cursorY;
+        int rows = console->consoleHeight - status_rows();
+        consoleSetWindow(console, 0, 0, console->consoleWidth, rows);
+        console->cursorX = x;
+        console->cursorY = min(y, rows - 1);
+    }
+    stop_requested = false;
+    rendering = true;
+    renderer = thread(render_loop, fps);
+}
+
+void console_stop_renderer()
+{
+    if (!rendering)
+    {
+        return;
+    }
+    stop_requested = true;
+    renderer.join();
+    rendering = false;
+    // Anything queued between the last frame and now
+    render_frame();
+}
@@ -0,0 +1,26 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <mutex>
+#include <switch.h>
+
+#include "progress.hpp"
+
+/// Tag log lines printed from the calling thread with a profile name
+void console_set_profile(std::string name);
+/// Profile name of the calling thread, for handing on to helper threads
+std::string console_profile();
+/// Enable or disable the "[profile]" prefix on log lines
+void console_set_multiplexed(bool multiplexed);
+/// Thread-safe printf to the console. While the renderer runs this only
+/// queues the text, otherwise it is printed and flushed immediately.
+void console_printf(const char *fmt, ...) __attribute__((format(printf, 1, 2)));
+/// Lock held while a profile waits for user input, so prompts don't interleave
+std::mutex &console_prompt_lock();
+
+/// Start drawing queued log lines and a fixed status area with one line
+/// per transfer status at the bottom of the screen, at most `fps` times a second
+void console_start_renderer(PrintConsole *console, std::vector<TransferStatus *> statuses, int fps);
+/// Draw the last frame and stop. Later output goes straight to the log area.
+void console_stop_renderer();
@@ -0,0 +1,68 @@
+#include "content_index.hpp"
+
+using namespace std;
+
+string url_origin(const string &url)
+{
+    size_t scheme = url.find("://");
+    if (scheme == string::npos)
+    {
+        return "";
+    }
+    size_t path = url.find('/', scheme + 3);
+    return url.substr(0, path);
+}
+
+void ContentIndex::add(u64 size, const string &sha1, const string &url)
+{
+    if (sha1.empty())
+    {
+        return;
+    }
+    lock_guard<mutex> guard(this->lock);
+    auto old = this->contents.find(url);
+    if (old != this->contents.end())
+    {
+        this->urls[old->second].erase(url);
+    }
+    this->contents[url] = {size, sha1};
+    this->urls[{size, sha1}].insert(url);
+    this->sizes.insert(size);
+}
+
+void ContentIndex::forget(const string &url)
+{
+    lock_guard<mutex> guard(this->lock);
+    auto it = this->contents.find(url);
+    if (it != this->contents.end())
+    {
+        this->urls[it->second].erase(url);
+        this->contents.erase(it);
+    }
+}
+
+bool ContentIndex::has_size(u64 size)
+{
+    lock_guard<mutex> guard(this->lock);
+    return this->sizes.count(size);
+}
+
+optional<string> ContentIndex::find(u64 size, const string &sha1, const string &url)
+{
+    lock_guard<mutex> guard(this->lock);
+    auto it = this->urls.find({size, sha1});
+    if (it == this->urls.end())
+    {
+        return nullopt;
+    }
+    // COPY only works within one server
+    string origin = url_origin(url);
+    for (const string &candidate : it->second)
+    {
+        if (candidate != url && url_origin(candidate) == origin)
+        {
+            return candidate;
+        }
+    }
+    return nullopt;
+}
@@ -0,0 +1,33 @@
+#pragma once
+
+#include <string>
+#include <optional>
+#include <map>
+#include <set>
+#include <mutex>
+#include <switch.h>
+
+/// Content-addressed index of files known to exist on WebDAV servers,
+/// keyed by size and SHA1. One index is shared by all profiles so that
+/// content uploaded by one profile can be reused by another.
+class ContentIndex
+{
+public:
+    /// Record that `url` holds content with this size and SHA1
+    void add(u64 size, const std::string &sha1, const std::string &url);
+    /// Forget a URL, because it is about to be overwritten or a copy from it failed
+    void forget(const std::string &url);
+    /// Whether any indexed file has this size; lets callers skip hashing
+    bool has_size(u64 size);
+    /// A URL on the same server as `url` holding identical content
+    std::optional<std::string> find(u64 size, const std::string &sha1, const std::string &url);
+
+private:
+    std::mutex lock;
+    std::map<std::pair<u64, std::string>, std::set<std::string>> urls;
+    std::map<std::string, std::pair<u64, std::string>> contents;
+    std::set<u64> sizes;
+};
+
+/// "scheme://host[:port]" part of an URL
+std::string url_origin(const std::string &url);
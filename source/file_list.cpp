@@ -0,0 +1,370 @@
+#include "file_list.hpp"
+
+#include <string.h>
+
+using namespace std;
+
+static_assert(sizeof(FileList::Entry) == 32, "FileList::Entry should stay packed");
+
+FileList::FileList() : index(16, npos), index_used(0)
+{
+    this->entries.push_back(Entry{npos, 0, 0, Folder, 0, npos, 0, 0});
+}
+
+u32 FileList::size() const
+{
+    return this->entries.size();
+}
+
+const FileList::Entry &FileList::operator[](u32 i) const
+{
+    return this->entries[i];
+}
+
+bool FileList::folder(u32 i) const
+{
+    return this->entries[i].flags & Folder;
+}
+
+string_view FileList::name(u32 i) const
+{
+    const Entry &e = this->entries[i];
+    return string_view(this->arena.data() + e.name, e.name_len);
+}
+
+void FileList::append_path(u32 i, string &out) const
+{
+    if (i == root)
+    {
+        out += '/';
+        return;
+    }
+    // Collect the chain up to the root, then emit it top-down
+    u32 chain[64];
+    size_t depth = 0;
+    vector<u32> deep;
+    for (u32 p = i; p != root; p = this->entries[p].parent)
+    {
+        if (depth < 64)
+            chain[depth++] = p;
+        else
+            deep.push_back(p);
+    }
+    for (auto it = deep.rbegin(); it != deep.rend(); ++it)
+    {
+        out += '/';
+        out += this->name(*it);
+    }
+    while (depth > 0)
+    {
+        out += '/';
+        out += this->name(chain[--depth]);
+    }
+    if (this->folder(i))
+    {
+        out += '/';
+    }
+}
+
+string FileList::path(u32 i) const
+{
+    string out;
+    this->append_path(i, out);
+    return out;
+}
+
+FileEntry FileList::entry(u32 i) const
+{
+    const Entry &e = this->entries[i];
+    return FileEntry{this->path(i), (time_t)e.mtime, this->folder(i), e.size, this->checksum(i)};
+}
+
+u32 FileList::add(u32 parent, string_view name, bool folder, u64 size, time_t mtime)
+{
+    u32 existing = this->child(parent, name);
+    if (existing != npos)
+    {
+        Entry &e = this->entries[existing];
+        e.flags = (e.flags & ~Folder) | (folder ? Folder : 0);
+        e.size = size;
+        e.mtime = mtime;
+        return existing;
+    }
+    u32 i = this->entries.size();
+    this->entries.push_back(Entry{parent, (u32)this->arena.size(), (u16)name.size(), (u8)(folder ? Folder : 0), 0, npos, size, mtime});
+    this->arena.append(name);
+    this->index_insert(i);
+    return i;
+}
+
+u32 FileList::add_path(string_view path, bool folder, u64 size, time_t mtime)
+{
+    u32 parent = root;
+    size_t start = 0;
+    while (start < path.size())
+    {
+        size_t end = path.find('/', start);
+        if (end == string_view::npos)
+            end = path.size();
+        if (end > start)
+        {
+            string_view component = path.substr(start, end - start);
+            if (end >= path.size() - 1)
+            {
+                return this->add(parent, component, folder, size, mtime);
+            }
+            u32 next = this->child(parent, component);
+            parent = next != npos ? next : this->add(parent, component, true, 0, 0);
+        }
+        start = end + 1;
+    }
+    // The root itself
+    this->entries[root].mtime = mtime;
+    return root;
+}
+
+void FileList::set_mtime(u32 i, time_t mtime)
+{
+    this->entries[i].mtime = mtime;
+}
+
+static int hex_value(char c)
+{
+    if (c >= '0' && c <= '9')
+        return c - '0';
+    if (c >= 'a' && c <= 'f')
+        return c - 'a' + 10;
+    if (c >= 'A' && c <= 'F')
+        return c - 'A' + 10;
+    return -1;
+}
+
+void FileList::set_checksum(u32 i, string_view hex)
+{
+    if (hex.size() != 40)
+    {
+        this->entries[i].checksum = npos;
+        return;
+    }
+    u8 bytes[20];
+    for (int b = 0; b < 20; b++)
+    {
+        int hi = hex_value(hex[b * 2]), lo = hex_value(hex[b * 2 + 1]);
+        if (hi < 0 || lo < 0)
+            return;
+        bytes[b] = hi << 4 | lo;
+    }
+    Entry &e = this->entries[i];
+    if (e.checksum == npos)
+    {
+        e.checksum = this->checksums.size() / 20;
+        this->checksums.insert(this->checksums.end(), bytes, bytes + 20);
+    }
+    else
+    {
+        memcpy(&this->checksums[e.checksum * 20], bytes, 20);
+    }
+}
+
+string FileList::checksum(u32 i) const
+{
+    u32 c = this->entries[i].checksum;
+    if (c == npos)
+    {
+        return "";
+    }
+    static const char digits[] = "0123456789abcdef";
+    string hex(40, '0');
+    for (int b = 0; b < 20; b++)
+    {
+        u8 byte = this->checksums[c * 20 + b];
+        hex[b * 2] = digits[byte >> 4];
+        hex[b * 2 + 1] = digits[byte & 15];
+    }
+    return hex;
+}
+
+u32 FileList::find(string_view path) const
+{
+    u32 current = root;
+    size_t start = 0;
+    while (start < path.size())
+    {
+        size_t end = path.find('/', start);
+        if (end == string_view::npos)
+            end = path.size();
+        if (end > start)
+        {
+            current = this->child(current, path.substr(start, end - start));
+            if (current == npos || (this->entries[current].flags & Detached))
+                return npos;
+        }
+        start = end + 1;
+    }
+    return current;
+}
+
+u32 FileList::child(u32 parent, string_view name) const
+{
+    return this->index[this->slot_of(parent, name)];
+}
+
+bool FileList::within(u32 i, u32 dir) const
+{
+    for (u32 p = i; p != npos; p = this->entries[p].parent)
+    {
+        if (p == dir)
+            return true;
+    }
+    return false;
+}
+
+bool FileList::visible(u32 i) const
+{
+    for (u32 p = i; p != npos; p = this->entries[p].parent)
+    {
+        if (this->entries[p].flags & Detached)
+            return false;
+    }
+    return true;
+}
+
+void FileList::claim(u32 i)
+{
+    this->entries[i].flags |= Claimed;
+}
+
+bool FileList::claimed(u32 i) const
+{
+    return this->entries[i].flags & Claimed;
+}
+
+void FileList::detach(u32 i)
+{
+    this->entries[i].flags |= Detached;
+}
+
+void FileList::attach(u32 i)
+{
+    this->entries[i].flags &= ~Detached;
+}
+
+void FileList::rename(u32 i, string_view new_path)
+{
+    string_view trimmed = new_path;
+    while (trimmed.size() > 1 && trimmed.back() == '/')
+        trimmed.remove_suffix(1);
+    size_t slash = trimmed.rfind('/');
+    string_view parent_path = trimmed.substr(0, slash + 1);
+    string_view name = trimmed.substr(slash + 1);
+
+    u32 parent = root;
+    size_t start = 1;
+    while (start < parent_path.size())
+    {
+        size_t end = parent_path.find('/', start);
+        string_view component = parent_path.substr(start, end - start);
+        u32 next = this->child(parent, component);
+        if (next == npos)
+        {
+            next = this->add(parent, component, true, 0, 0);
+            this->claim(next);
+        }
+        parent = next;
+        start = end + 1;
+    }
+
+    this->index_erase(i);
+    u32 existing = this->child(parent, name);
+    if (existing != npos)
+    {
+        // Whatever was there is replaced, also for loops going by index
+        this->index_erase(existing);
+        this->detach(existing);
+        this->claim(existing);
+    }
+    Entry &e = this->entries[i];
+    e.parent = parent;
+    e.name = this->arena.size();
+    e.name_len = name.size();
+    this->arena.append(name);
+    this->index_insert(i);
+}
+
+size_t FileList::memory_usage() const
+{
+    return this->entries.capacity() * sizeof(Entry) + this->arena.capacity() + this->checksums.capacity() +
+           this->index.capacity() * sizeof(u32);
+}
+
+u64 FileList::hash(u32 parent, string_view name)
+{
+    // FNV-1a
+    u64 h = 14695981039346656037ull ^ parent;
+    for (char c : name)
+    {
+        h ^= (u8)c;
+        h *= 1099511628211ull;
+    }
+    return h;
+}
+
+u32 FileList::slot_of(u32 parent, string_view name) const
+{
+    u32 mask = this->index.size() - 1;
+    u32 s = hash(parent, name) & mask;
+    while (this->index[s] != npos)
+    {
+        const Entry &e = this->entries[this->index[s]];
+        if (e.parent == parent && this->name(this->index[s]) == name)
+            break;
+        s = (s + 1) & mask;
+    }
+    return s;
+}
+
+void FileList::index_insert(u32 i)
+{
+    if ((this->index_used + 1) * 2 > this->index.size())
+    {
+        this->grow_index();
+    }
+    this->index[this->slot_of(this->entries[i].parent, this->name(i))] = i;
+    this->index_used++;
+}
+
+void FileList::index_erase(u32 i)
+{
+    u32 mask = this->index.size() - 1;
+    u32 s = this->slot_of(this->entries[i].parent, this->name(i));
+    if (this->index[s] != i)
+    {
+        return;
+    }
+    // Backward shift deletion keeps probe chains intact without tombstones
+    this->index[s] = npos;
+    this->index_used--;
+    for (u32 j = (s + 1) & mask; this->index[j] != npos; j = (j + 1) & mask)
+    {
+        u32 k = hash(this->entries[this->index[j]].parent, this->name(this->index[j])) & mask;
+        bool movable = (j > s) ? (k <= s || k > j) : (k <= s && k > j);
+        if (movable)
+        {
+            this->index[s] = this->index[j];
+            this->index[j] = npos;
+            s = j;
+        }
+    }
+}
+
+void FileList::grow_index()
+{
+    vector<u32> old;
+    old.swap(this->index);
+    this->index.assign(old.size() * 2, npos);
+    for (u32 i : old)
+    {
+        if (i != npos)
+            this->index[this->slot_of(this->entries[i].parent, this->name(i))] = i;
+    }
+}
@@ -0,0 +1,112 @@
+#pragma once
+
+#include <string>
+#include <string_view>
+#include <vector>
+#include <ctime>
+#include <switch.h>
+
+struct FileEntry
+{
+    std::string path;
+    time_t last_modified;
+    bool folder;
+    u64 size;
+    std::string checksum; // SHA1 hex from oc:checksums, empty if unknown
+};
+
+/// Compact listing of a file tree.
+///
+/// Every entry stores only its own name, in a shared string arena, plus the
+/// index of its parent folder, so shared path prefixes are stored once.
+/// Entry 0 is the root folder "/". Parents are added before their children,
+/// but rename() can put an entry below a folder added after it, so index
+/// order is not a top-down traversal order.
+///
+/// Listings are large: they can be moved but not copied.
+class FileList
+{
+public:
+    static constexpr u32 npos = 0xffffffff;
+    static constexpr u32 root = 0;
+
+    enum Flags : u8
+    {
+        Folder = 1,
+        /// Already handled by the comparison
+        Claimed = 2,
+        /// Hidden with everything below it, e.g. while a move is pending
+        Detached = 4,
+    };
+
+    struct Entry
+    {
+        u32 parent;
+        u32 name;     // Offset into the arena
+        u16 name_len;
+        u8 flags;
+        u8 reserved;
+        u32 checksum; // Index into the checksums, or npos
+        u64 size;
+        s64 mtime;
+    };
+
+    FileList();
+    FileList(FileList &&) = default;
+    FileList &operator=(FileList &&) = default;
+    FileList(const FileList &) = delete;
+    FileList &operator=(const FileList &) = delete;
+
+    u32 size() const;
+    const Entry &operator[](u32 i) const;
+    bool folder(u32 i) const;
+    std::string_view name(u32 i) const;
+    /// Full relative path: "/" for the root, "/a/b/" for folders, "/a/b/c" for files
+    std::string path(u32 i) const;
+    void append_path(u32 i, std::string &out) const;
+    /// Copy of a single entry with its full path
+    FileEntry entry(u32 i) const;
+
+    u32 add(u32 parent, std::string_view name, bool folder, u64 size, time_t mtime);
+    /// Add by relative path, creating missing parent folders. Updates an existing entry.
+    u32 add_path(std::string_view path, bool folder, u64 size, time_t mtime);
+    void set_mtime(u32 i, time_t mtime);
+    void set_checksum(u32 i, std::string_view sha1_hex);
+    /// SHA1 as lowercase hex, empty if unknown
+    std::string checksum(u32 i) const;
+
+    /// Entry at a relative path, npos if missing or below a detached folder
+    u32 find(std::string_view path) const;
+    u32 child(u32 parent, std::string_view name) const;
+    /// Whether `i` is `dir` or below it
+    bool within(u32 i, u32 dir) const;
+    /// Whether neither `i` nor any folder above it is detached
+    bool visible(u32 i) const;
+
+    void claim(u32 i);
+    bool claimed(u32 i) const;
+    void detach(u32 i);
+    void attach(u32 i);
+    /// Move an entry, and implicitly everything below it, to a new path.
+    /// Missing parent folders are created as claimed. An entry already at
+    /// that path is replaced: it is detached and claimed, so neither lookups
+    /// nor index order loops see it again.
+    void rename(u32 i, std::string_view new_path);
+
+    /// Bytes held by this listing
+    size_t memory_usage() const;
+
+private:
+    std::vector<Entry> entries;
+    std::string arena;
+    std::vector<u8> checksums; // 20 bytes each
+    // Open addressing hash table of entry indices keyed by (parent, name)
+    std::vector<u32> index;
+    u32 index_used;
+
+    static u64 hash(u32 parent, std::string_view name);
+    u32 slot_of(u32 parent, std::string_view name) const;
+    void index_insert(u32 i);
+    void index_erase(u32 i);
+    void grow_index();
+};
@@ -0,0 +1,163 @@
+#include "local_dir.hpp"
+
+#include <string.h>
+#include <sys/stat.h>
+
+#ifndef __SWITCH__
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/syscall.h>
+#endif
+
+using namespace std;
+
+#ifdef __SWITCH__
+
+// Entries are 0x310 bytes, this keeps a batch around 25 KiB per open folder
+static const size_t batch_entries = 32;
+
+LocalDir::LocalDir(const string &path) : path(path), fs(NULL), open(false), count(0), pos(0)
+{
+    char translated[FS_MAX_PATH];
+    if (fsdevTranslatePath(path.c_str(), &this->fs, translated) == -1)
+    {
+        return;
+    }
+    this->fs_path = translated;
+    if (this->fs_path.empty() || this->fs_path.back() != '/')
+    {
+        this->fs_path += '/';
+    }
+    this->open = R_SUCCEEDED(fsFsOpenDirectory(this->fs, translated, FsDirOpenMode_ReadDirs | FsDirOpenMode_ReadFiles, &this->dir));
+    if (this->open)
+    {
+        this->batch.resize(batch_entries);
+    }
+}
+
+LocalDir::~LocalDir()
+{
+    if (this->open)
+    {
+        fsDirClose(&this->dir);
+    }
+}
+
+bool LocalDir::is_open() const
+{
+    return this->open;
+}
+
+LocalDir::Entry *LocalDir::next()
+{
+    if (this->pos == this->count)
+    {
+        this->pos = 0;
+        this->count = 0;
+        if (!this->open || R_FAILED(fsDirRead(&this->dir, &this->count, this->batch.size(), this->batch.data())) || this->count <= 0)
+        {
+            this->count = 0;
+            return NULL;
+        }
+    }
+    const FsDirectoryEntry &e = this->batch[this->pos++];
+    this->current = Entry{e.name, e.type == FsDirEntryType_Dir, (u64)e.file_size, 0};
+    return &this->current;
+}
+
+bool LocalDir::details(Entry &entry)
+{
+    // Type and size came with the listing, only the timestamps need a call
+    FsTimeStampRaw stamps;
+    string fs_path = this->fs_path + entry.name;
+    if (R_SUCCEEDED(fsFsGetFileTimeStampRaw(this->fs, fs_path.c_str(), &stamps)) && stamps.is_valid)
+    {
+        entry.mtime = stamps.modified;
+        return true;
+    }
+    struct stat attr;
+    if (stat((this->path + "/" + entry.name).c_str(), &attr) != 0)
+    {
+        return false;
+    }
+    entry.folder = S_ISDIR(attr.st_mode);
+    entry.size = entry.folder ? 0 : attr.st_size;
+    entry.mtime = attr.st_mtime;
+    return true;
+}
+
+#else
+
+struct linux_dirent64
+{
+    ino64_t d_ino;
+    off64_t d_off;
+    unsigned short d_reclen;
+    unsigned char d_type;
+    char d_name[];
+};
+
+static const size_t batch_bytes = 32 * 1024;
+
+LocalDir::LocalDir(const string &path) : path(path), fd(::open(path.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC)), count(0), pos(0)
+{
+    if (this->fd >= 0)
+    {
+        this->batch.resize(batch_bytes);
+    }
+}
+
+LocalDir::~LocalDir()
+{
+    if (this->fd >= 0)
+    {
+        close(this->fd);
+    }
+}
+
+bool LocalDir::is_open() const
+{
+    return this->fd >= 0;
+}
+
+LocalDir::Entry *LocalDir::next()
+{
+    while (true)
+    {
+        if (this->pos >= this->count)
+        {
+            this->pos = 0;
+            this->count = this->fd < 0 ? 0 : syscall(SYS_getdents64, this->fd, this->batch.data(), this->batch.size());
+            if (this->count <= 0)
+            {
+                this->count = 0;
+                return NULL;
+            }
+        }
+        linux_dirent64 *d = (linux_dirent64 *)(this->batch.data() + this->pos);
+        this->pos += d->d_reclen;
+        if (strcmp(d->d_name, ".") == 0 || strcmp(d->d_name, "..") == 0)
+        {
+            continue;
+        }
+        this->current = Entry{d->d_name, d->d_type == DT_DIR, 0, 0};
+        return &this->current;
+    }
+}
+
+bool LocalDir::details(Entry &entry)
+{
+    // Follows symlinks, like stat()
+    struct statx attr;
+    if (statx(this->fd, entry.name, AT_STATX_SYNC_AS_STAT, STATX_TYPE | STATX_SIZE | STATX_MTIME, &attr) != 0)
+    {
+        return false;
+    }
+    entry.folder = S_ISDIR(attr.stx_mode);
+    entry.size = entry.folder ? 0 : attr.stx_size;
+    entry.mtime = attr.stx_mtime.tv_sec;
+    return true;
+}
+
+#endif
@@ -0,0 +1,53 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <ctime>
+#include <switch.h>
+
+/// Batched listing of a local directory.
+///
+/// On the Switch entries are read straight from the FS service, many per
+/// IPC call and with their type and size, instead of newlib's one entry per
+/// readdir() plus several calls per stat(). Elsewhere it uses getdents64()
+/// and statx() relative to the open directory.
+class LocalDir
+{
+public:
+    struct Entry
+    {
+        const char *name;
+        bool folder; // Before details(), only a hint on some filesystems
+        u64 size;    // Only valid after details()
+        time_t mtime;
+    };
+
+    explicit LocalDir(const std::string &path);
+    ~LocalDir();
+    LocalDir(const LocalDir &) = delete;
+    LocalDir &operator=(const LocalDir &) = delete;
+
+    bool is_open() const;
+    /// Next entry, without "." and "..". NULL at the end. Invalidated by the next call.
+    Entry *next();
+    /// Fill in the size, type and mtime of the entry, false if it vanished
+    bool details(Entry &entry);
+
+private:
+    std::string path;
+    Entry current;
+#ifdef __SWITCH__
+    FsFileSystem *fs;
+    FsDir dir;
+    bool open;
+    std::string fs_path; // Path within the device, with a trailing '/'
+    std::vector<FsDirectoryEntry> batch;
+    s64 count;
+    s64 pos;
+#else
+    int fd;
+    std::vector<char> batch;
+    long count;
+    long pos;
+#endif
+};
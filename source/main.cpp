@@ -6,14 +6,45 @@
 #include <sstream>
 #include <iostream>
 #include <unistd.h>
+#include <sys/stat.h>
 // Include the main libnx system header, for Switch development
 #include <switch.h>
 // Include custom webdav libs
 #include "webdav.hpp"
+#include "profile_pool.hpp"
+#include "console.hpp"
+#include "poll_schedule.hpp"
+#include "rate_limit.hpp"
 #include <inih/cpp/INIReader.h>
 
 using namespace std;
 
+// Per-profile sync state lives next to the config file
+static const string state_dir = "/switch/NXDavSync";
+
+/// Wait before the next continuous sync. A syncs right away; returns false
+/// when + is pressed or the app has to close.
+static bool wait_for_next_cycle(PadState *pad, u64 delay_ms)
+{
+    u64 deadline = armTicksToNs(armGetSystemTick()) / 1000000 + delay_ms;
+    while (appletMainLoop())
+    {
+        padUpdate(pad);
+        u64 kDown = padGetButtonsDown(pad);
+        if (kDown & HidNpadButton_Plus)
+        {
+            return false;
+        }
+        if ((kDown & HidNpadButton_A) || armTicksToNs(armGetSystemTick()) / 1000000 >= deadline)
+        {
+            return true;
+        }
+        // Polling the pad is all there is to do, keep the CPU idle in between
+        svcSleepThread(100000000);
+    }
+    return false;
+}
+
 // Main program entrypoint
 int main(int argc, char *argv[])
 {
@@ -22,7 +53,7 @@ int main(int argc, char *argv[])
     //   take a look at the graphics/simplegfx example, which uses the libnx Framebuffer API instead.
     // If on the other hand you want to write an OpenGL based application,
     //   take a look at the graphics/opengl set of examples, which uses EGL instead.
-    consoleInit(NULL);
+    PrintConsole *console = consoleInit(NULL);
 
     // Configure our supported input layout: a single player with standard controller styles
     padConfigureInput(1, HidNpadStyleSet_NpadStandard);
@@ -31,7 +62,8 @@ int main(int argc, char *argv[])
     PadState pad;
     padInitializeDefault(&pad);
 
-    socketInitializeDefault();
+    // curl's global init isn't thread-safe, do it before any worker starts
+    curl_global_init(CURL_GLOBAL_DEFAULT);
 
     printf(CONSOLE_BLUE "Switch Nexcloud\n\nPress A to start.\n" CONSOLE_RESET);
     consoleUpdate(NULL);
@@ -47,7 +79,17 @@ int main(int argc, char *argv[])
 
     INIReader reader("/switch/NXDavSync.ini");
     vector<string> bad_config;
-    vector<pair<string, WebDavClient *>> clients;
+    vector<SyncProfile> clients;
+    vector<TransferStatus *> statuses;
+    // Shared, so content uploaded by one profile can be copied by another
+    ContentIndex content_index;
+    unsigned workers = 2;
+    bool write_report = true;
+    int status_fps = 15;
+    bool continuous = false;
+    u64 interval_ms = 0;
+    u64 max_interval_ms = 0;
+    SocketInitConfig sockets = *socketGetDefaultInitConfig();
     if (reader.ParseError() < 0)
     {
         printf("Error loading configuration file at /switch/NXDavSync.ini");
@@ -55,7 +97,60 @@ int main(int argc, char *argv[])
     }
     else
     {
+        mkdir(state_dir.c_str(), 0777);
         string enabled = reader.Get("General", "Enabled", "");
+        long worker_count = reader.GetInteger("General", "Workers", 2);
+        if (worker_count < 1)
+        {
+            bad_config.push_back("General");
+        }
+        workers = max(worker_count, 1L);
+        write_report = reader.GetBoolean("General", "Report", true);
+        status_fps = reader.GetInteger("General", "StatusFps", 15);
+        SyncMetrics::profiling = reader.GetBoolean("General", "Profile", false);
+        continuous = reader.GetBoolean("General", "Continuous", false);
+        long interval = reader.GetInteger("General", "Interval", 300);
+        long max_interval = reader.GetInteger("General", "MaxInterval", 3600);
+        // A negative wait would wrap around to forever
+        if (interval < 0 || max_interval < 0)
+        {
+            bad_config.push_back("General");
+        }
+        interval_ms = (u64)max(interval, 0L) * 1000;
+        max_interval_ms = (u64)max(max_interval, 0L) * 1000;
+        TransferLanes lanes;
+        optional<TransferOrder> order = parse_transfer_order(reader.Get("General", "TransferOrder", "shortest"));
+        if (order)
+        {
+            lanes.order = order.value();
+        }
+        else
+        {
+            bad_config.push_back("General");
+        }
+        lanes.small = reader.GetInteger("General", "SmallLanes", lanes.small);
+        lanes.large = reader.GetInteger("General", "LargeLanes", lanes.large);
+        lanes.large_size = (u64)reader.GetInteger("General", "LargeFileMB", lanes.large_size >> 20) << 20;
+        optional<RateSchedule> upload_limit = RateSchedule::parse(reader.Get("General", "UploadLimitKB", ""));
+        optional<RateSchedule> download_limit = RateSchedule::parse(reader.Get("General", "DownloadLimitKB", ""));
+        if (!upload_limit || !download_limit)
+        {
+            bad_config.push_back("General");
+        }
+        else
+        {
+            global_rate_limits().upload.set_schedule(upload_limit.value());
+            global_rate_limits().download.set_schedule(download_limit.value());
+        }
+        sockets.tcp_tx_buf_size = reader.GetInteger("General", "SocketTxBufKB", sockets.tcp_tx_buf_size >> 10) << 10;
+        sockets.tcp_rx_buf_size = reader.GetInteger("General", "SocketRxBufKB", sockets.tcp_rx_buf_size >> 10) << 10;
+        sockets.tcp_tx_buf_max_size = reader.GetInteger("General", "SocketTxBufMaxKB", sockets.tcp_tx_buf_max_size >> 10) << 10;
+        sockets.tcp_rx_buf_max_size = reader.GetInteger("General", "SocketRxBufMaxKB", sockets.tcp_rx_buf_max_size >> 10) << 10;
+        sockets.sb_efficiency = reader.GetInteger("General", "SocketEfficiency", sockets.sb_efficiency);
+        // "auto" sizes the buffers from the measured bandwidth-delay product
+        long buffer_size = reader.GetInteger("General", "BufferKB", 0) << 10;
+        long upload_buffer_size = reader.GetInteger("General", "UploadBufferKB", 0) << 10;
+        u32 socket_max = min(sockets.tcp_tx_buf_max_size, sockets.tcp_rx_buf_max_size);
         string buf;
         stringstream ss(enabled);
 
@@ -82,11 +177,82 @@ int main(int argc, char *argv[])
                     c->set_basic_auth(username, password);
                 }
                 c->set_pad_state(&pad);
-                clients.push_back(make_pair(buf, c));
+                c->set_transfer_status(new TransferStatus(buf));
+                c->set_state_file(state_dir + "/" + buf + ".tree");
+                c->set_move_detection(reader.GetBoolean(buf, "DetectMoves", true),
+                                      reader.GetBoolean(buf, "VerifyMoves", false));
+                long keep_versions = reader.GetInteger(buf, "KeepVersions", 0);
+                string versions_path = reader.Get(buf, "VersionsPath", "/.versions");
+                // Versions can't live in the web root itself, every snapshot would move a file into itself
+                if (keep_versions < 0 || (keep_versions > 0 && versions_path.find_first_not_of('/') == string::npos))
+                {
+                    bad_config.push_back(buf);
+                }
+                c->set_versioning(max(keep_versions, 0L), versions_path);
+                c->set_filter(reader.Get(buf, "Include", ""), reader.Get(buf, "Exclude", ""));
+                c->set_pipelining(reader.GetBoolean(buf, "Pipeline", false));
+                c->set_quick_scan(reader.GetBoolean(buf, "QuickScan", false));
+                c->set_capability_ttl(reader.GetInteger(buf, "CapabilityTtl", 24) * 3600);
+                c->set_bulk_upload((u64)reader.GetInteger(buf, "BulkUploadKB", 4096) * 1024);
+                if (reader.GetBoolean(buf, "DeltaUpload", false))
+                {
+                    c->set_delta_upload(reader.GetInteger(buf, "DeltaBlockKB", 64) * 1024,
+                                        (u64)reader.GetInteger(buf, "DeltaMinMB", 16) * 1024 * 1024);
+                }
+                optional<RateSchedule> upload_limit = RateSchedule::parse(reader.Get(buf, "UploadLimitKB", ""));
+                optional<RateSchedule> download_limit = RateSchedule::parse(reader.Get(buf, "DownloadLimitKB", ""));
+                if (!upload_limit || !download_limit)
+                {
+                    bad_config.push_back(buf);
+                }
+                else
+                {
+                    c->set_rate_limits(upload_limit.value(), download_limit.value());
+                }
+                // Nobody is there to answer in continuous mode
+                optional<ConfirmPolicy> confirm = parse_confirm_policy(reader.Get(buf, "Confirm", continuous ? "no" : "ask"));
+                if (!confirm)
+                {
+                    bad_config.push_back(buf);
+                }
+                else
+                {
+                    c->set_confirm_policy(confirm.value());
+                }
+                optional<SyncMode> mode = parse_sync_mode(reader.Get(buf, "Mode", "sync"));
+                if (!mode)
+                {
+                    bad_config.push_back(buf);
+                }
+                else
+                {
+                    c->set_mode(mode.value(), reader.Get(buf, "Archive", buf + ".tar.gz"));
+                }
+                c->set_transfer_lanes(lanes);
+                RetryPolicy retry;
+                retry.attempts = reader.GetInteger(buf, "Retries", retry.attempts);
+                retry.base_delay_ms = reader.GetInteger(buf, "RetryDelayMs", retry.base_delay_ms);
+                retry.max_delay_ms = reader.GetInteger(buf, "RetryMaxDelay", retry.max_delay_ms / 1000) * 1000;
+                retry.connect_timeout = reader.GetInteger(buf, "ConnectTimeout", retry.connect_timeout);
+                retry.low_speed_limit = reader.GetInteger(buf, "LowSpeedLimit", retry.low_speed_limit);
+                retry.low_speed_time = reader.GetInteger(buf, "LowSpeedTime", retry.low_speed_time);
+                retry.breaker_threshold = reader.GetInteger(buf, "BreakerThreshold", retry.breaker_threshold);
+                retry.breaker_cooldown_ms = reader.GetInteger(buf, "BreakerCooldown", retry.breaker_cooldown_ms / 1000) * 1000;
+                c->set_retry_policy(retry);
+                c->set_buffer_sizes(buffer_size, upload_buffer_size, socket_max);
+                if (reader.GetBoolean(buf, "Dedup", true))
+                {
+                    c->set_content_index(&content_index);
+                }
+                clients.push_back(SyncProfile{buf, url, local_path, c});
+                statuses.push_back(c->get_transfer_status());
             }
         }
     }
 
+    // Socket buffers are fixed once the socket service is up
+    socketInitialize(&sockets);
+
     if (!bad_config.empty())
     {
         for (auto name : bad_config)
@@ -97,45 +263,98 @@ int main(int argc, char *argv[])
     }
     else
     {
-        vector<pair<string, bool>> results;
-        for (auto [name, client] : clients)
+        PollSchedule schedule(interval_ms, max_interval_ms);
+        while (true)
         {
-            printf(CONSOLE_BLUE "\nSyncing %s\n", name.c_str());
-            printf(CONSOLE_RESET);
+            // Progress is drawn at a fixed rate instead of flushing on every log line
+            console_start_renderer(console, statuses, status_fps);
+            vector<bool> results = sync_profiles(clients, workers);
+            console_stop_renderer();
+            if (write_report)
+            {
+                vector<pair<string, SyncMetrics *>> metrics;
+                for (SyncProfile &p : clients)
+                {
+                    metrics.push_back(make_pair(p.name, &p.client->get_metrics()));
+                }
+                write_run_report(state_dir + "/report.json", metrics);
+            }
+            // Print summary
+            printf(CONSOLE_BLUE "\n\n===== Sync Summary =====\n\n" CONSOLE_RESET);
             consoleUpdate(NULL);
-            bool this_result = client->compareAndUpdate();
-            results.push_back(make_pair(name, this_result));
-        }
-        // Print summary
-        printf(CONSOLE_BLUE "\n\n===== Sync Summary =====\n\n" CONSOLE_RESET);
-        consoleUpdate(NULL);
-        for (auto [name, result] : results)
-        {
-            if (result)
+            for (size_t i = 0; i < clients.size(); i++)
             {
-                printf(CONSOLE_GREEN "SUCCESS " CONSOLE_RESET);
+                bool result = results[i];
+                const string &name = clients[i].name;
+                if (result)
+                {
+                    printf(CONSOLE_GREEN "SUCCESS " CONSOLE_RESET);
+                }
+                else
+                {
+                    printf(CONSOLE_RED "FAILED  " CONSOLE_RESET);
+                }
+                printf("%s\n", name.c_str());
+                if (SyncMetrics::profiling)
+                {
+                    for (auto &[phase, stats] : clients[i].client->get_metrics().phases())
+                    {
+                        printf("  %-10s %8.2fs  peak heap %.1f MB\n", phase.c_str(), stats.total_us / 1e6,
+                               stats.heap_peak / (1024.0 * 1024.0));
+                    }
+                }
+                consoleUpdate(NULL);
             }
-            else
+            if (SyncMetrics::profiling)
             {
-                printf(CONSOLE_RED "FAILED  " CONSOLE_RESET);
+                printf("Heap high water: %.1f MB\n", heap_high_water() / (1024.0 * 1024.0));
+                consoleUpdate(NULL);
+            }
+            if (!continuous)
+            {
+                break;
             }
-            printf("%s\n", name.c_str());
+            // Failures back off like idle cycles, the server may be down
+            bool changed = false;
+            for (size_t i = 0; i < clients.size(); i++)
+            {
+                changed = changed || (results[i] && clients[i].client->last_sync_changed());
+            }
+            u64 delay = schedule.next(changed);
+            printf(CONSOLE_BLUE "\nNext sync in %s. A: sync now, +: quit\n" CONSOLE_RESET, format_eta(delay / 1000.0).c_str());
             consoleUpdate(NULL);
+            if (!wait_for_next_cycle(&pad, delay))
+            {
+                break;
+            }
         }
     }
 
-    printf(CONSOLE_GREEN "\n Press A to exit.\n" CONSOLE_RESET);
-    consoleUpdate(NULL);
-    while (appletMainLoop())
+    // Quitting continuous mode already took a button press
+    if (!continuous || !bad_config.empty())
     {
-        padUpdate(&pad);
-        u64 kDown = padGetButtonsDown(&pad);
-        if (kDown & HidNpadButton_A)
+        printf(CONSOLE_GREEN "\n Press A to exit.\n" CONSOLE_RESET);
+        consoleUpdate(NULL);
+        while (appletMainLoop())
         {
-            break;
+            padUpdate(&pad);
+            u64 kDown = padGetButtonsDown(&pad);
+            if (kDown & HidNpadButton_A)
+            {
+                break;
+            }
         }
     }
 
+    for (SyncProfile &p : clients)
+    {
+        delete p.client;
+    }
+    for (TransferStatus *s : statuses)
+    {
+        delete s;
+    }
+    curl_global_cleanup();
     socketExit();
 
     // Deinitialize and clean up resources used by the console (important!)
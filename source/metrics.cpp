@@ -0,0 +1,247 @@
+#include "metrics.hpp"
+#include "console.hpp"
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <time.h>
+#include <malloc.h>
+
+using namespace std;
+
+RequestTiming RequestTiming::from_curl(CURL *curl, bool ok)
+{
+    RequestTiming t = {};
+    long connects = 0;
+    curl_easy_getinfo(curl, CURLINFO_NAMELOOKUP_TIME_T, &t.namelookup);
+    curl_easy_getinfo(curl, CURLINFO_CONNECT_TIME_T, &t.connect);
+    curl_easy_getinfo(curl, CURLINFO_APPCONNECT_TIME_T, &t.appconnect);
+    curl_easy_getinfo(curl, CURLINFO_STARTTRANSFER_TIME_T, &t.starttransfer);
+    curl_easy_getinfo(curl, CURLINFO_TOTAL_TIME_T, &t.total);
+    curl_easy_getinfo(curl, CURLINFO_SIZE_UPLOAD_T, &t.bytes_up);
+    curl_easy_getinfo(curl, CURLINFO_SIZE_DOWNLOAD_T, &t.bytes_down);
+    curl_easy_getinfo(curl, CURLINFO_NUM_CONNECTS, &connects);
+    curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &t.response_code);
+    t.reused = connects == 0;
+    t.ok = ok;
+    return t;
+}
+
+string RequestTiming::summary() const
+{
+    char buf[160];
+    snprintf(buf, sizeof(buf), "dns %.1fms, connect %.1fms, tls %.1fms, first byte %.1fms, total %.1fms%s",
+             this->namelookup / 1000.0, this->connect / 1000.0, this->appconnect / 1000.0,
+             this->starttransfer / 1000.0, this->total / 1000.0, this->reused ? " (reused)" : "");
+    return buf;
+}
+
+bool SyncMetrics::profiling = false;
+
+u64 heap_in_use()
+{
+    return mallinfo().uordblks;
+}
+
+u64 heap_high_water()
+{
+    return mallinfo().usmblks;
+}
+
+/// Innermost running phase of this thread
+static thread_local PhaseTimer *current_phase = NULL;
+
+PhaseTimer::PhaseTimer(SyncMetrics &m, const char *p) : metrics(m), phase(NULL), outer(NULL)
+{
+    this->start(p);
+}
+
+PhaseTimer::~PhaseTimer()
+{
+    this->stop();
+}
+
+void PhaseTimer::start(const char *p)
+{
+    if (!SyncMetrics::profiling)
+    {
+        return;
+    }
+    this->phase = p;
+    this->stats = SyncMetrics::PhaseStats();
+    this->stats.count = 1;
+    this->stats.heap_start = this->stats.heap_peak = heap_in_use();
+    this->outer = current_phase;
+    current_phase = this;
+    this->start_tick = armGetSystemTick();
+}
+
+void PhaseTimer::stop()
+{
+    if (!this->phase)
+    {
+        return;
+    }
+    this->stats.total_us = armTicksToNs(armGetSystemTick() - this->start_tick) / 1000;
+    this->stats.heap_end = heap_in_use();
+    sample();
+    current_phase = this->outer;
+    this->metrics.record_phase(this->phase, this->stats);
+    this->phase = NULL;
+}
+
+void PhaseTimer::next(const char *p)
+{
+    this->stop();
+    this->start(p);
+}
+
+void PhaseTimer::sample()
+{
+    if (!current_phase)
+    {
+        return;
+    }
+    u64 used = heap_in_use();
+    for (PhaseTimer *t = current_phase; t; t = t->outer)
+    {
+        t->stats.heap_peak = max(t->stats.heap_peak, used);
+    }
+}
+
+void SyncMetrics::record_phase(const string &phase, const PhaseStats &p)
+{
+    lock_guard<mutex> guard(this->lock);
+    for (auto &[name, s] : this->phase_stats)
+    {
+        if (name == phase)
+        {
+            s.count += p.count;
+            s.total_us += p.total_us;
+            s.heap_end = p.heap_end;
+            s.heap_peak = max(s.heap_peak, p.heap_peak);
+            return;
+        }
+    }
+    this->phase_stats.push_back(make_pair(phase, p));
+}
+
+vector<pair<string, SyncMetrics::PhaseStats>> SyncMetrics::phases()
+{
+    lock_guard<mutex> guard(this->lock);
+    return this->phase_stats;
+}
+
+/// Duration of a phase given the cumulative times around it, tolerating skipped phases
+static u64 phase(curl_off_t end, curl_off_t start)
+{
+    return end > start ? end - start : 0;
+}
+
+void SyncMetrics::record(const string &verb, const RequestTiming &t)
+{
+    lock_guard<mutex> guard(this->lock);
+    VerbStats &s = this->stats[verb];
+    s.count++;
+    s.failures += !t.ok;
+    s.reused += t.reused;
+    s.bytes_up += t.bytes_up;
+    s.bytes_down += t.bytes_down;
+    s.namelookup_us += t.namelookup;
+    // Phases that didn't happen (e.g. plain HTTP has no TLS) report 0
+    curl_off_t connected = max(t.connect, t.namelookup);
+    curl_off_t secured = max(t.appconnect, connected);
+    s.connect_us += phase(connected, t.namelookup);
+    s.tls_us += phase(secured, connected);
+    s.server_us += phase(t.starttransfer, secured);
+    s.transfer_us += phase(t.total, max(t.starttransfer, secured));
+    s.total_us += t.total;
+    s.max_total_us = max(s.max_total_us, (u64)t.total);
+
+    int bucket = 0;
+    for (u64 ms = t.total / 1000; ms > 0 && bucket < histogram_buckets - 1; ms >>= 1)
+    {
+        bucket++;
+    }
+    s.histogram[bucket]++;
+}
+
+void SyncMetrics::record_retry(const string &verb)
+{
+    lock_guard<mutex> guard(this->lock);
+    this->stats[verb].retries++;
+}
+
+void SyncMetrics::write_json(FILE *fp)
+{
+    lock_guard<mutex> guard(this->lock);
+    fprintf(fp, "{\"requests\": {");
+    bool first = true;
+    for (auto &[verb, s] : this->stats)
+    {
+        fprintf(fp, "%s\n      \"%s\": {\"count\": %" PRIu64 ", \"failures\": %" PRIu64 ", \"retries\": %" PRIu64
+                    ", \"reused\": %" PRIu64 ", \"bytes_up\": %" PRIu64 ", \"bytes_down\": %" PRIu64,
+                first ? "" : ",", verb.c_str(), s.count, s.failures, s.retries, s.reused, s.bytes_up, s.bytes_down);
+        fprintf(fp, ", \"us\": {\"dns\": %" PRIu64 ", \"connect\": %" PRIu64 ", \"tls\": %" PRIu64
+                    ", \"server\": %" PRIu64 ", \"transfer\": %" PRIu64 ", \"total\": %" PRIu64 ", \"max\": %" PRIu64 "}",
+                s.namelookup_us, s.connect_us, s.tls_us, s.server_us, s.transfer_us, s.total_us, s.max_total_us);
+        fprintf(fp, ", \"total_ms_log2_histogram\": [");
+        for (int i = 0; i < histogram_buckets; i++)
+        {
+            fprintf(fp, "%s%" PRIu64, i ? ", " : "", s.histogram[i]);
+        }
+        fprintf(fp, "]}");
+        first = false;
+    }
+    fprintf(fp, "%s}, \"phases\": [", first ? "" : "\n    ");
+    for (size_t i = 0; i < this->phase_stats.size(); i++)
+    {
+        const auto &[name, p] = this->phase_stats[i];
+        fprintf(fp, "%s\n      {\"name\": \"%s\", \"count\": %" PRIu64 ", \"us\": %" PRIu64
+                    ", \"heap_start\": %" PRIu64 ", \"heap_end\": %" PRIu64 ", \"heap_peak\": %" PRIu64 "}",
+                i ? "," : "", name.c_str(), p.count, p.total_us, p.heap_start, p.heap_end, p.heap_peak);
+    }
+    fprintf(fp, "%s]}", this->phase_stats.empty() ? "" : "\n    ");
+}
+
+/// Write `s` as a JSON string literal
+static void write_json_string(FILE *fp, const string &s)
+{
+    fputc('"', fp);
+    for (char c : s)
+    {
+        if (c == '"' || c == '\\')
+            fprintf(fp, "\\%c", c);
+        else if ((unsigned char)c < 0x20)
+            fprintf(fp, "\\u%04x", c);
+        else
+            fputc(c, fp);
+    }
+    fputc('"', fp);
+}
+
+bool write_run_report(const string &file, const vector<pair<string, SyncMetrics *>> &profiles)
+{
+    FILE *fp = fopen(file.c_str(), "w");
+    if (!fp)
+    {
+        console_printf("can't write run report %s: %s\n", file.c_str(), strerror(errno));
+        return false;
+    }
+    fprintf(fp, "{\n  \"time\": %lld,\n", (long long)time(NULL));
+    if (SyncMetrics::profiling)
+    {
+        fprintf(fp, "  \"heap_high_water\": %" PRIu64 ",\n", heap_high_water());
+    }
+    fprintf(fp, "  \"profiles\": {");
+    for (size_t i = 0; i < profiles.size(); i++)
+    {
+        fprintf(fp, "%s\n    ", i ? "," : "");
+        write_json_string(fp, profiles[i].first);
+        fprintf(fp, ": ");
+        profiles[i].second->write_json(fp);
+    }
+    fprintf(fp, "\n  }\n}\n");
+    return fclose(fp) == 0;
+}
@@ -0,0 +1,115 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <map>
+#include <mutex>
+#include <switch.h>
+
+#include <curl/curl.h>
+
+/// Where the time and bytes of one request went, as reported by curl
+struct RequestTiming
+{
+    // Microseconds from the start of the request until each phase completed
+    curl_off_t namelookup;
+    curl_off_t connect;
+    curl_off_t appconnect;
+    curl_off_t starttransfer;
+    curl_off_t total;
+    curl_off_t bytes_up;
+    curl_off_t bytes_down;
+    bool reused; // No new connection had to be opened
+    long response_code;
+    bool ok;
+
+    /// Read the timings of the last transfer made with `curl`
+    static RequestTiming from_curl(CURL *curl, bool ok);
+    /// One line human readable summary
+    std::string summary() const;
+};
+
+/// Request statistics of one profile, aggregated per HTTP verb
+class SyncMetrics
+{
+public:
+    /// Total time histogram buckets: [0, 1ms), [1, 2ms), [2, 4ms) ... [2^(n-2)ms, inf)
+    static const int histogram_buckets = 18;
+
+    struct VerbStats
+    {
+        u64 count = 0;
+        u64 failures = 0;
+        u64 retries = 0;
+        u64 reused = 0;
+        u64 bytes_up = 0;
+        u64 bytes_down = 0;
+        // Sums of the time spent in each phase, in microseconds
+        u64 namelookup_us = 0;
+        u64 connect_us = 0;
+        u64 tls_us = 0;
+        u64 server_us = 0; // Request sent until first response byte
+        u64 transfer_us = 0;
+        u64 total_us = 0;
+        u64 max_total_us = 0;
+        u64 histogram[histogram_buckets] = {};
+    };
+
+    struct PhaseStats
+    {
+        u64 count = 0;
+        u64 total_us = 0;
+        // Heap in use, in bytes, sampled while the phase ran
+        u64 heap_start = 0;
+        u64 heap_end = 0;
+        u64 heap_peak = 0;
+    };
+
+    /// Phase timing and heap sampling is off unless enabled, as sampling walks the heap
+    static bool profiling;
+
+    void record(const std::string &verb, const RequestTiming &timing);
+    /// Count a failed request that is about to be tried again
+    void record_retry(const std::string &verb);
+    void record_phase(const std::string &phase, const PhaseStats &stats);
+    /// Phases in the order they first ran
+    std::vector<std::pair<std::string, PhaseStats>> phases();
+    /// Append this profile's statistics as a JSON object
+    void write_json(FILE *fp);
+
+private:
+    std::mutex lock;
+    std::map<std::string, VerbStats> stats;
+    std::vector<std::pair<std::string, PhaseStats>> phase_stats;
+};
+
+/// Times a phase of a sync and tracks heap usage while it runs.
+/// Does nothing unless SyncMetrics::profiling is set.
+class PhaseTimer
+{
+public:
+    PhaseTimer(SyncMetrics &metrics, const char *phase);
+    ~PhaseTimer();
+    /// End the current phase and start the next one
+    void next(const char *phase);
+    /// Finish the phase early
+    void stop();
+    /// Update the heap peak of the phases running on this thread
+    static void sample();
+
+private:
+    SyncMetrics &metrics;
+    const char *phase;
+    u64 start_tick;
+    SyncMetrics::PhaseStats stats;
+    PhaseTimer *outer;
+    void start(const char *phase);
+};
+
+/// Bytes currently allocated from the heap
+u64 heap_in_use();
+/// Most bytes the heap ever took from the system
+u64 heap_high_water();
+
+/// Write the report of a whole run, one entry per profile
+bool write_run_report(const std::string &file, const std::vector<std::pair<std::string, SyncMetrics *>> &profiles);
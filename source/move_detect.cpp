@@ -0,0 +1,229 @@
+#include "move_detect.hpp"
+#include "checksum.hpp"
+
+#include <set>
+#include <unordered_map>
+#include <functional>
+
+using namespace std;
+
+namespace
+{
+    /// A vanished or appeared entry, with the mtime of the side it was seen on
+    struct Candidate
+    {
+        string path;
+        bool folder;
+        u64 size;
+        time_t mtime;
+        string checksum;
+        size_t signature; // Folders only, 0 if it holds no files
+    };
+
+    /// Contribution of one entry below a folder to the folder's signature
+    size_t entry_hash(string_view rel, bool folder, u64 size, time_t mtime)
+    {
+        string key(rel);
+        if (!folder)
+            key += "\t" + to_string(size) + "\t" + to_string(mtime);
+        return hash<string>()(key);
+    }
+
+    /// Signatures of folders in the previous tree: sum over everything below, so order doesn't matter
+    void previous_signatures(vector<Candidate> &candidates, const map<string, const TreeRecord *> &prev, bool local_side)
+    {
+        for (Candidate &c : candidates)
+        {
+            if (!c.folder)
+                continue;
+            size_t sig = 0;
+            bool has_file = false;
+            for (auto it = prev.upper_bound(c.path); it != prev.end() && it->first.compare(0, c.path.size(), c.path) == 0; ++it)
+            {
+                const TreeRecord *r = it->second;
+                sig += entry_hash(string_view(it->first).substr(c.path.size()), r->folder, r->size, local_side ? r->local_mtime : r->remote_mtime);
+                has_file |= !r->folder;
+            }
+            c.signature = has_file ? sig : 0;
+        }
+    }
+
+    /// Signatures of folders in a listing, in a single pass over it
+    void listing_signatures(vector<Candidate> &candidates, const vector<u32> &indices, const FileList &list)
+    {
+        unordered_map<u32, size_t> folders; // listing index -> candidate
+        for (size_t c = 0; c < candidates.size(); c++)
+        {
+            if (candidates[c].folder)
+                folders[indices[c]] = c;
+        }
+        if (folders.empty())
+            return;
+        vector<bool> has_file(candidates.size(), false);
+        for (u32 i = 1; i < list.size(); i++)
+        {
+            string path;
+            for (u32 p = list[i].parent; p != FileList::npos; p = list[p].parent)
+            {
+                auto f = folders.find(p);
+                if (f == folders.end())
+                    continue;
+                Candidate &c = candidates[f->second];
+                if (path.empty())
+                    path = list.path(i);
+                c.signature += entry_hash(string_view(path).substr(c.path.size()), list.folder(i), list[i].size, list[i].mtime);
+                has_file[f->second] = has_file[f->second] || !list.folder(i);
+            }
+        }
+        for (size_t c = 0; c < candidates.size(); c++)
+        {
+            if (!has_file[c])
+                candidates[c].signature = 0;
+        }
+    }
+
+    bool under(const string &path, const set<string> &dirs)
+    {
+        for (const string &d : dirs)
+        {
+            if (path.size() > d.size() && path.compare(0, d.size(), d) == 0)
+                return true;
+        }
+        return false;
+    }
+
+    /// Pair up gone and appeared entries
+    void match(const vector<Candidate> &gone, const vector<Candidate> &appeared,
+               function<bool(const Candidate &, const Candidate &)> verify,
+               map<string, string> &out)
+    {
+        // Folders first: one folder move replaces a move per file inside it
+        map<size_t, vector<const Candidate *>> gone_dirs, new_dirs;
+        for (const Candidate &c : gone)
+        {
+            if (c.folder && c.signature)
+                gone_dirs[c.signature].push_back(&c);
+        }
+        for (const Candidate &c : appeared)
+        {
+            if (c.folder && c.signature)
+                new_dirs[c.signature].push_back(&c);
+        }
+        set<string> moved_from, moved_to;
+        // Candidates are sorted by path, so parents are matched before their children
+        for (const Candidate &c : gone)
+        {
+            if (!c.folder || !c.signature || under(c.path, moved_from))
+                continue;
+            auto g = gone_dirs.find(c.signature);
+            auto n = new_dirs.find(c.signature);
+            if (n == new_dirs.end() || g->second.size() != 1 || n->second.size() != 1)
+                continue;
+            const Candidate *target = n->second[0];
+            if (under(target->path, moved_to))
+                continue;
+            out[target->path] = c.path;
+            moved_from.insert(c.path);
+            moved_to.insert(target->path);
+        }
+
+        // Then single files, keyed by size and mtime
+        map<pair<u64, time_t>, vector<const Candidate *>> gone_files, new_files;
+        for (const Candidate &c : gone)
+        {
+            if (!c.folder && !under(c.path, moved_from))
+                gone_files[{c.size, c.mtime}].push_back(&c);
+        }
+        for (const Candidate &c : appeared)
+        {
+            if (!c.folder && !under(c.path, moved_to))
+                new_files[{c.size, c.mtime}].push_back(&c);
+        }
+        for (auto &[key, sources] : gone_files)
+        {
+            auto n = new_files.find(key);
+            if (sources.size() != 1 || n == new_files.end() || n->second.size() != 1)
+                continue;
+            if (verify(*sources[0], *n->second[0]))
+                out[n->second[0]->path] = sources[0]->path;
+        }
+    }
+}
+
+MovePlan plan_moves(const vector<TreeRecord> &previous,
+                    const FileList &local,
+                    const FileList &remote,
+                    const string &local_root,
+                    bool verify_hash)
+{
+    MovePlan plan;
+    if (previous.empty())
+    {
+        return plan;
+    }
+
+    map<string, const TreeRecord *> prev_map;
+    for (const TreeRecord &r : previous)
+        prev_map[r.path] = &r;
+
+    // Gone locally but still on the server / still local but gone from the server
+    vector<Candidate> gone_local, gone_remote;
+    for (auto &[path, r] : prev_map)
+    {
+        if (path == "/")
+            continue;
+        bool in_local = local.find(path) != FileList::npos, in_remote = remote.find(path) != FileList::npos;
+        if (!in_local && in_remote)
+            gone_local.push_back(Candidate{path, r->folder, r->size, r->local_mtime, r->checksum, 0});
+        else if (in_local && !in_remote)
+            gone_remote.push_back(Candidate{path, r->folder, r->size, r->remote_mtime, r->checksum, 0});
+    }
+    if (gone_local.empty() && gone_remote.empty())
+    {
+        return plan;
+    }
+
+    // New on one side and unknown to both the other side and the previous sync
+    auto appeared = [&](const FileList &list, const FileList &other, vector<Candidate> &out, vector<u32> &indices)
+    {
+        for (u32 i = 1; i < list.size(); i++)
+        {
+            string path = list.path(i);
+            if (other.find(path) == FileList::npos && !prev_map.count(path))
+            {
+                out.push_back(Candidate{path, list.folder(i), list[i].size, (time_t)list[i].mtime, list.checksum(i), 0});
+                indices.push_back(i);
+            }
+        }
+    };
+    vector<Candidate> new_local, new_remote;
+    vector<u32> new_local_indices, new_remote_indices;
+    if (!gone_local.empty())
+        appeared(local, remote, new_local, new_local_indices);
+    if (!gone_remote.empty())
+        appeared(remote, local, new_remote, new_remote_indices);
+
+    previous_signatures(gone_local, prev_map, true);
+    previous_signatures(gone_remote, prev_map, false);
+    listing_signatures(new_local, new_local_indices, local);
+    listing_signatures(new_remote, new_remote_indices, remote);
+
+    match(gone_local, new_local,
+          [&](const Candidate &from, const Candidate &to)
+          {
+              if (!verify_hash)
+                  return true;
+              if (from.checksum.empty())
+                  return false;
+              optional<string> sha1 = file_sha1(local_root + to.path);
+              return sha1 && *sha1 == from.checksum;
+          },
+          plan.remote_moves);
+    match(gone_remote, new_remote,
+          [&](const Candidate &from, const Candidate &to)
+          {
+              return !verify_hash || (!from.checksum.empty() && from.checksum == to.checksum);
+          },
+          plan.local_moves);
+    return plan;
+}
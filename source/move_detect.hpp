@@ -0,0 +1,29 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <map>
+
+#include "file_list.hpp"
+#include "tree_state.hpp"
+
+/// Renames found by comparing both sides against the previous sync.
+/// Keys are the new relative paths, values the old ones. Folder paths
+/// keep their trailing '/', and a folder move covers everything below it.
+struct MovePlan
+{
+    /// Renamed locally: replay on the server with MOVE
+    std::map<std::string, std::string> remote_moves;
+    /// Renamed on the server: replay locally with rename()
+    std::map<std::string, std::string> local_moves;
+};
+
+/// Match entries that vanished from one side since the last sync against
+/// entries that newly appeared on the same side. A match needs identical
+/// size and mtime (for folders: identical contents), must be unambiguous,
+/// and with verify_hash also needs a matching SHA1.
+MovePlan plan_moves(const std::vector<TreeRecord> &previous,
+                    const FileList &local,
+                    const FileList &remote,
+                    const std::string &local_root,
+                    bool verify_hash);
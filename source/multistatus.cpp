@@ -0,0 +1,223 @@
+#include "multistatus.hpp"
+#include "console.hpp"
+#include "checksum.hpp"
+#include "metrics.hpp"
+#include "webdav.hpp"
+
+#include <cstring>
+#include <cstdlib>
+
+using namespace std;
+using namespace tinyxml2;
+
+static const char response_open[] = "<d:response";
+static const char response_close[] = "</d:response>";
+
+MultistatusParser::MultistatusParser(CURL *curl, PathFilter *filter, Callback on_entry) : curl(curl), filter(filter), on_entry(on_entry), first(true), error(false), handed_out(false)
+{
+}
+
+size_t MultistatusParser::write_callback(char *ptr, size_t size, size_t nmemb, void *parser)
+{
+    // Anything short of the full length makes curl abort the transfer
+    return static_cast<MultistatusParser *>(parser)->feed(ptr, size * nmemb) ? size * nmemb : 0;
+}
+
+bool MultistatusParser::failed() const
+{
+    return this->error;
+}
+
+bool MultistatusParser::feed(const char *data, size_t len)
+{
+    if (this->error)
+    {
+        return false;
+    }
+    this->pending.append(data, len);
+
+    size_t start = 0;
+    while (true)
+    {
+        size_t open = this->pending.find(response_open, start);
+        if (open == string::npos)
+        {
+            // Keep a possibly split opening tag for the next chunk
+            if (this->pending.size() > start + sizeof(response_open))
+                start = this->pending.size() - sizeof(response_open);
+            break;
+        }
+        start = open;
+        // Not <d:responsedescription>
+        char next = start + sizeof(response_open) - 1 < this->pending.size() ? this->pending[start + sizeof(response_open) - 1] : '\0';
+        if (next == '\0')
+        {
+            break;
+        }
+        if (!strchr("> \t\r\n", next))
+        {
+            start += sizeof(response_open) - 1;
+            continue;
+        }
+        size_t end = this->pending.find(response_close, start);
+        if (end == string::npos)
+        {
+            break;
+        }
+        end += sizeof(response_close) - 1;
+        if (!this->parse_response(this->pending.data() + start, end - start))
+        {
+            this->error = true;
+            return false;
+        }
+        start = end;
+    }
+    this->pending.erase(0, start);
+    return true;
+}
+
+bool MultistatusParser::restart()
+{
+    if (this->handed_out)
+    {
+        return false;
+    }
+    this->files = FileList();
+    this->pending.clear();
+    this->list_root.clear();
+    this->first = true;
+    this->error = false;
+    return true;
+}
+
+optional<FileList> MultistatusParser::finish()
+{
+    if (this->error)
+    {
+        return nullopt;
+    }
+    if (this->first)
+    {
+        console_printf("malformed WebDAV response: no d:response in PROPFIND\n");
+        return nullopt;
+    }
+    string().swap(this->pending);
+    PhaseTimer::sample();
+    return std::move(this->files);
+}
+
+bool MultistatusParser::parse_response(const char *xml, size_t len)
+{
+    XMLError parse_res = this->doc.Parse(xml, len);
+    if (parse_res != tinyxml2::XML_SUCCESS)
+    {
+        console_printf("malformed XML response: %d\n", parse_res);
+        return false;
+    }
+    XMLElement *e = this->doc.RootElement();
+
+    string path;
+    time_t time;
+    bool folder = false;
+    u64 size;
+    string checksum;
+    // Get file path
+    if (e->FirstChildElement("d:href") && e->FirstChildElement("d:href")->GetText())
+    {
+        const char *text = e->FirstChildElement("d:href")->GetText();
+        // The path here is escaped. Convert them back to unescaped form
+        char *decoded = curl_easy_unescape(this->curl, text, 0, NULL);
+        path = string(decoded);
+        curl_free(decoded);
+    }
+    else
+    {
+        console_printf("malformed WebDAV response: missing d:href in PROPFIND\n");
+        return false;
+    }
+    if (this->first)
+    {
+        this->list_root = path;
+        if (!this->list_root.empty() && this->list_root.back() == '/')
+        {
+            this->list_root.pop_back();
+        }
+        path = "/";
+    }
+    else if (path.size() > this->list_root.size() + 1 && path.compare(0, this->list_root.size(), this->list_root) == 0 && path[this->list_root.size()] == '/')
+    {
+        path.erase(0, this->list_root.size());
+        if (this->filter && this->filter->skip_tree(path, path.back() == '/'))
+        {
+            return true;
+        }
+    }
+    else
+    {
+        // Not below the collection we asked for
+        return true;
+    }
+    if (e->FirstChildElement("d:propstat"))
+    {
+        if (e->FirstChildElement("d:propstat")->FirstChildElement("d:prop"))
+        {
+            XMLElement *prop = e->FirstChildElement("d:propstat")->FirstChildElement("d:prop");
+            if (prop->FirstChildElement("d:getlastmodified") && prop->FirstChildElement("d:getlastmodified")->GetText())
+            {
+                time = curl_getdate(prop->FirstChildElement("d:getlastmodified")->GetText(), NULL);
+            }
+            else
+            {
+                console_printf("malformed WebDAV response: missing d:getlastmodified in PROPFIND\n");
+                return false;
+            }
+            if (prop->FirstChildElement("d:getcontentlength") && prop->FirstChildElement("d:getcontentlength")->GetText())
+            {
+                size = strtoull(prop->FirstChildElement("d:getcontentlength")->GetText(), NULL, 10);
+            }
+            else
+            {
+                size = 0;
+            }
+            if (prop->FirstChildElement("d:resourcetype") && prop->FirstChildElement("d:resourcetype")->FirstChildElement("d:collection"))
+            {
+                folder = true;
+            }
+            if (prop->FirstChildElement("oc:checksums") && prop->FirstChildElement("oc:checksums")->FirstChildElement("oc:checksum"))
+            {
+                checksum = parse_oc_sha1(prop->FirstChildElement("oc:checksums")->FirstChildElement("oc:checksum")->GetText());
+            }
+        }
+        else
+        {
+            console_printf("malformed WebDAV response: missing d:prop in PROPFIND\n");
+            return false;
+        }
+    }
+    else
+    {
+        console_printf("malformed WebDAV response: missing d:propstat in PROPFIND\n");
+        return false;
+    }
+
+    u32 i = FileList::root;
+    if (this->first)
+    {
+        this->files.set_mtime(i, time);
+        this->first = false;
+    }
+    else
+    {
+        i = this->files.add_path(path, folder, size, time);
+    }
+    if (!checksum.empty())
+    {
+        this->files.set_checksum(i, checksum);
+    }
+    if (this->on_entry && i != FileList::root)
+    {
+        this->on_entry(FileEntry{path, time, folder, size, checksum});
+        this->handed_out = true;
+    }
+    return true;
+}
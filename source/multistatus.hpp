@@ -0,0 +1,53 @@
+#pragma once
+
+#include <string>
+#include <optional>
+#include <functional>
+#include <curl/curl.h>
+#include <tinyxml2.h>
+
+#include "file_list.hpp"
+#include "path_filter.hpp"
+
+/// Incremental parser for PROPFIND multistatus bodies.
+///
+/// Fed straight from the curl write callback, after curl has undone any
+/// content encoding. Every <d:response> is parsed and added to the listing
+/// as soon as it is complete, so the document is never held in full.
+class MultistatusParser
+{
+public:
+    /// Called with every entry below the collection as soon as it was parsed
+    typedef std::function<void(const FileEntry &)> Callback;
+
+    /// Entries below the listed collection are dropped if `filter` skips them
+    MultistatusParser(CURL *curl, PathFilter *filter, Callback on_entry = nullptr);
+
+    /// Consume a chunk of the body. False once the body turned out malformed.
+    bool feed(const char *data, size_t len);
+    bool failed() const;
+    /// Forget everything parsed, to parse a resent response. False if entries
+    /// were already handed out, those can't be taken back.
+    bool restart();
+    /// The listing, once the whole body was fed. nullopt if nothing usable arrived.
+    std::optional<FileList> finish();
+
+    /// For CURLOPT_WRITEFUNCTION, with the parser as CURLOPT_WRITEDATA
+    static size_t write_callback(char *ptr, size_t size, size_t nmemb, void *parser);
+
+private:
+    CURL *curl;
+    PathFilter *filter;
+    Callback on_entry;
+    FileList files;
+    // Received bytes not yet parsed; starts at the earliest incomplete response
+    std::string pending;
+    // Relative paths are taken from hrefs below this, the first response's own
+    std::string list_root;
+    bool first;
+    bool error;
+    bool handed_out;
+    tinyxml2::XMLDocument doc;
+
+    bool parse_response(const char *xml, size_t len);
+};
@@ -0,0 +1,132 @@
+#include "net_tuning.hpp"
+
+#include <algorithm>
+#include <sys/socket.h>
+
+using namespace std;
+
+// Transfers shorter than this are dominated by latency and say nothing about bandwidth
+static const curl_off_t min_sample_bytes = 64 * 1024;
+
+BufferTuner::BufferTuner()
+    : fixed_download(0), fixed_upload(0), socket_max(0), rtt_us(0), bandwidth(0)
+{
+}
+
+void BufferTuner::configure(long download, long upload, u32 socket_max)
+{
+    lock_guard<mutex> guard(this->lock);
+    this->fixed_download = download;
+    this->fixed_upload = upload;
+    this->socket_max = socket_max;
+}
+
+void BufferTuner::observe(const RequestTiming &t)
+{
+    lock_guard<mutex> guard(this->lock);
+    if (!t.reused && t.connect > t.namelookup)
+    {
+        // The TCP handshake takes exactly one round trip
+        curl_off_t rtt = t.connect - t.namelookup;
+        this->rtt_us = this->rtt_us ? min(this->rtt_us, rtt) : rtt;
+    }
+    curl_off_t ready = max(t.appconnect, t.connect);
+    if (t.ok && t.bytes_down >= min_sample_bytes && t.total > t.starttransfer)
+    {
+        this->bandwidth = max(this->bandwidth, t.bytes_down * 1e6 / (t.total - t.starttransfer));
+    }
+    if (t.ok && t.bytes_up >= min_sample_bytes && t.starttransfer > ready)
+    {
+        // The response starts once the body is through
+        this->bandwidth = max(this->bandwidth, t.bytes_up * 1e6 / (t.starttransfer - ready));
+    }
+}
+
+u64 BufferTuner::bdp()
+{
+    if (!this->rtt_us || this->bandwidth <= 0)
+    {
+        return 0;
+    }
+    return (u64)(this->bandwidth * this->rtt_us / 1e6);
+}
+
+/// Twice the bandwidth-delay product, so one buffer can drain while the other fills
+static u64 tuned(u64 bdp, u64 lowest, u64 highest)
+{
+    u64 size = lowest;
+    while (size < 2 * bdp && size < highest)
+    {
+        size *= 2;
+    }
+    return min(size, highest);
+}
+
+long BufferTuner::download_buffer()
+{
+    lock_guard<mutex> guard(this->lock);
+    if (this->fixed_download)
+    {
+        return this->fixed_download;
+    }
+    u64 bdp = this->bdp();
+    // curl's receive buffer: 16 KiB by default, 512 KiB at most
+    return bdp ? tuned(bdp, 16 * 1024, 512 * 1024) : 0;
+}
+
+long BufferTuner::upload_buffer()
+{
+    lock_guard<mutex> guard(this->lock);
+    if (this->fixed_upload)
+    {
+        return this->fixed_upload;
+    }
+    u64 bdp = this->bdp();
+    // curl's upload buffer: 64 KiB by default, 2 MiB at most
+    return bdp ? tuned(bdp, 64 * 1024, 2 * 1024 * 1024) : 0;
+}
+
+int BufferTuner::socket_buffer()
+{
+    lock_guard<mutex> guard(this->lock);
+    u64 bdp = this->bdp();
+    if (!bdp || !this->socket_max)
+    {
+        return 0;
+    }
+    return (int)tuned(bdp, 16 * 1024, this->socket_max);
+}
+
+static int set_socket_buffers(void *clientp, curl_socket_t fd, curlsocktype purpose)
+{
+    int size = (int)(intptr_t)clientp;
+    if (purpose == CURLSOCKTYPE_IPCXN)
+    {
+        // Best effort, the stack clamps to its configured maximum
+        setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size));
+        setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &size, sizeof(size));
+    }
+    return CURL_SOCKOPT_OK;
+}
+
+void BufferTuner::apply(CURL *curl)
+{
+    curl_easy_setopt(curl, CURLOPT_TCP_NODELAY, 1L);
+    long download = this->download_buffer();
+    if (download)
+    {
+        curl_easy_setopt(curl, CURLOPT_BUFFERSIZE, download);
+    }
+    long upload = this->upload_buffer();
+    if (upload)
+    {
+        curl_easy_setopt(curl, CURLOPT_UPLOAD_BUFFERSIZE, upload);
+    }
+    int socket = this->socket_buffer();
+    if (socket)
+    {
+        // Only affects new connections
+        curl_easy_setopt(curl, CURLOPT_SOCKOPTFUNCTION, set_socket_buffers);
+        curl_easy_setopt(curl, CURLOPT_SOCKOPTDATA, (void *)(intptr_t)socket);
+    }
+}
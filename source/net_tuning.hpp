@@ -0,0 +1,44 @@
+#pragma once
+
+#include <mutex>
+#include <curl/curl.h>
+#include <switch.h>
+
+#include "metrics.hpp"
+
+/// curl and socket buffer sizes for one server. Fixed sizes come from the
+/// config. Sizes left at 0 are tuned from the bandwidth-delay product. The
+/// round trip time comes from TCP connects, and the bandwidth from the
+/// fastest large transfer seen so far, so listings and the first files
+/// serve as the probe.
+class BufferTuner
+{
+public:
+    BufferTuner();
+
+    /// Sizes in bytes, 0 to tune automatically. `socket_max` caps the socket
+    /// buffers, it should match the socket init config.
+    void configure(long download, long upload, u32 socket_max);
+
+    /// Learn from a finished request
+    void observe(const RequestTiming &timing);
+    /// Set the current sizes and TCP_NODELAY on a handle
+    void apply(CURL *curl);
+
+    long download_buffer();
+    long upload_buffer();
+    int socket_buffer();
+
+private:
+    std::mutex lock;
+    long fixed_download;
+    long fixed_upload;
+    u32 socket_max;
+    // Smallest connect time seen, in microseconds
+    curl_off_t rtt_us;
+    // Fastest transfer seen, in bytes per second
+    double bandwidth;
+
+    /// Bandwidth-delay product, 0 until both were measured
+    u64 bdp();
+};
@@ -0,0 +1,152 @@
+#include "op_queue.hpp"
+#include "console.hpp"
+
+#include <string.h>
+#include <inttypes.h>
+#include <unistd.h>
+#include <set>
+
+using namespace std;
+
+static const char *header = "NXDavSync-queue 1\n";
+
+/// Push everything written so far to the SD card
+static bool sync_file(FILE *fp)
+{
+    return fflush(fp) == 0 && fsync(fileno(fp)) == 0;
+}
+
+OpQueue::OpQueue() : fp(NULL)
+{
+}
+
+OpQueue::~OpQueue()
+{
+    if (this->fp)
+    {
+        fclose(this->fp);
+    }
+}
+
+bool OpQueue::begin(const string &file, const vector<QueuedOp> &ops)
+{
+    this->finish();
+    string tmp = file + ".tmp";
+    FILE *fp = fopen(tmp.c_str(), "w");
+    if (!fp)
+    {
+        console_printf("can't write operation queue %s: %s\n", tmp.c_str(), strerror(errno));
+        return false;
+    }
+    fputs(header, fp);
+    for (const QueuedOp &op : ops)
+    {
+        // Q <kind> <size> <mtime> <remote size> <remote mtime> <checksum or -> <path>
+        fprintf(fp, "Q\t%c\t%" PRIu64 "\t%lld\t%" PRIu64 "\t%lld\t%s\t%s\n", (char)op.kind, op.size, (long long)op.mtime,
+                op.remote_size, (long long)op.remote_mtime, op.checksum.empty() ? "-" : op.checksum.c_str(), op.path.c_str());
+    }
+    bool ok = sync_file(fp);
+    ok = fclose(fp) == 0 && ok;
+    // The previous queue stays until this one is completely on disk
+    if (!ok)
+    {
+        console_printf("can't save operation queue %s\n", file.c_str());
+        remove(tmp.c_str());
+        return false;
+    }
+    remove(file.c_str());
+    if (rename(tmp.c_str(), file.c_str()) != 0)
+    {
+        console_printf("can't save operation queue %s\n", file.c_str());
+        return false;
+    }
+    // Completions are appended from here on
+    this->fp = fopen(file.c_str(), "a");
+    this->file = file;
+    lock_guard<mutex> guard(this->lock);
+    for (const QueuedOp &op : ops)
+    {
+        this->open.insert(op.path);
+    }
+    return this->fp != NULL;
+}
+
+void OpQueue::complete(const string &path)
+{
+    lock_guard<mutex> guard(this->lock);
+    // Folders and files that needed no transfer are recorded too, without costing an fsync each
+    if (this->fp && this->open.erase(path))
+    {
+        fprintf(this->fp, "X\t%s\n", path.c_str());
+        sync_file(this->fp);
+    }
+}
+
+void OpQueue::finish()
+{
+    lock_guard<mutex> guard(this->lock);
+    if (this->fp)
+    {
+        fclose(this->fp);
+        this->fp = NULL;
+        remove(this->file.c_str());
+    }
+    this->open.clear();
+}
+
+void OpQueue::discard(const string &file)
+{
+    remove(file.c_str());
+}
+
+optional<vector<QueuedOp>> OpQueue::pending(const string &file)
+{
+    FILE *fp = fopen(file.c_str(), "r");
+    if (!fp)
+    {
+        return nullopt;
+    }
+    vector<QueuedOp> ops;
+    set<string> done;
+    char line[1024];
+    if (!fgets(line, sizeof(line), fp) || strcmp(line, header) != 0)
+    {
+        fclose(fp);
+        return ops;
+    }
+    while (fgets(line, sizeof(line), fp))
+    {
+        size_t len = strlen(line);
+        if (len == 0 || line[len - 1] != '\n')
+        {
+            // Torn by the interruption
+            continue;
+        }
+        line[len - 1] = '\0';
+        if (strncmp(line, "X\t", 2) == 0)
+        {
+            done.insert(line + 2);
+            continue;
+        }
+        char kind;
+        u64 size, remote_size;
+        long long mtime, remote_mtime;
+        char checksum[64];
+        int offset = 0;
+        if (sscanf(line, "Q\t%c\t%" SCNu64 "\t%lld\t%" SCNu64 "\t%lld\t%63s\t%n", &kind, &size, &mtime, &remote_size, &remote_mtime, checksum, &offset) < 6 ||
+            offset == 0 || !strchr("UMD", kind))
+        {
+            continue;
+        }
+        ops.push_back(QueuedOp{(QueuedOp::Kind)kind, line + offset, size, (time_t)mtime, remote_size, (time_t)remote_mtime,
+                               strcmp(checksum, "-") == 0 ? "" : checksum});
+    }
+    fclose(fp);
+    vector<QueuedOp> left;
+    for (QueuedOp &op : ops)
+    {
+        if (!done.count(op.path))
+            left.push_back(std::move(op));
+    }
+    return left;
+}
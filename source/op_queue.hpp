@@ -0,0 +1,60 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <set>
+#include <optional>
+#include <mutex>
+#include <ctime>
+#include <stdio.h>
+#include <switch.h>
+
+/// A transfer planned by a sync, as kept in the operation queue
+struct QueuedOp
+{
+    enum Kind : char
+    {
+        Upload = 'U',  // New file, the server must not have it yet
+        Replace = 'M', // Newer local version of a remote file
+        Download = 'D',
+    };
+    Kind kind;
+    std::string path;
+    u64 size;     // Of the version being sent
+    time_t mtime; // Of the version being sent
+    // Replace: the remote file being replaced
+    u64 remote_size;
+    time_t remote_mtime;
+    std::string checksum; // SHA1 hex of the remote file, empty if unknown
+};
+
+/// Journal of the transfers of one sync. The plan is written before the
+/// first transfer starts and a line is appended as each one completes, so
+/// a sync cut short by sleep or a crash can pick up where it stopped.
+class OpQueue
+{
+public:
+    OpQueue();
+    ~OpQueue();
+    OpQueue(const OpQueue &) = delete;
+    OpQueue &operator=(const OpQueue &) = delete;
+
+    /// Durably write `ops` to `file`, replacing any previous queue
+    bool begin(const std::string &file, const std::vector<QueuedOp> &ops);
+    /// Checkpoint the operation on `path` as done. Thread safe, ignores other paths.
+    void complete(const std::string &path);
+    /// Remove the queue, the sync ran to its end
+    void finish();
+
+    /// Operations an interrupted sync left undone, nullopt if there was none
+    static std::optional<std::vector<QueuedOp>> pending(const std::string &file);
+    /// Delete a queue that is no longer needed
+    static void discard(const std::string &file);
+
+private:
+    std::string file;
+    FILE *fp;
+    std::mutex lock;
+    // Planned paths not checkpointed yet
+    std::set<std::string> open;
+};
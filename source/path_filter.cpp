@@ -0,0 +1,235 @@
+#include "path_filter.hpp"
+
+#include <sstream>
+
+using namespace std;
+
+/// Split "/a/b/" into {"a", "b"}
+static vector<string_view> split_path(string_view path)
+{
+    vector<string_view> components;
+    size_t start = 0;
+    while (start < path.size())
+    {
+        size_t end = path.find('/', start);
+        if (end == string_view::npos)
+            end = path.size();
+        if (end > start)
+            components.push_back(path.substr(start, end - start));
+        start = end + 1;
+    }
+    return components;
+}
+
+static bool has_wildcard(string_view s)
+{
+    return s.find_first_of("*?") != string_view::npos;
+}
+
+/// Match one path component against a pattern with '*' and '?'
+static bool glob(string_view pattern, string_view text)
+{
+    size_t p = 0, t = 0, star = string_view::npos, resume = 0;
+    while (t < text.size())
+    {
+        if (p < pattern.size() && (pattern[p] == '?' || pattern[p] == text[t]))
+        {
+            p++;
+            t++;
+        }
+        else if (p < pattern.size() && pattern[p] == '*')
+        {
+            star = p++;
+            resume = t;
+        }
+        else if (star != string_view::npos)
+        {
+            p = star + 1;
+            t = ++resume;
+        }
+        else
+        {
+            return false;
+        }
+    }
+    while (p < pattern.size() && pattern[p] == '*')
+        p++;
+    return p == pattern.size();
+}
+
+/// Match path components against pattern components, '**' spanning any number of them.
+/// With `prefix`, also succeed if the components could be the start of a match.
+static bool match_parts(const vector<string> &pattern, size_t pi, const vector<string_view> &components, size_t ci, bool prefix)
+{
+    if (ci == components.size() && prefix)
+        return true;
+    if (pi == pattern.size())
+        return ci == components.size();
+    if (pattern[pi] == "**")
+    {
+        for (size_t k = ci; k <= components.size(); k++)
+        {
+            if (match_parts(pattern, pi + 1, components, k, prefix))
+                return true;
+        }
+        return false;
+    }
+    if (ci == components.size())
+        return false;
+    return glob(pattern[pi], components[ci]) && match_parts(pattern, pi + 1, components, ci + 1, prefix);
+}
+
+void PathFilter::compile(RuleSet &set, const string &pattern)
+{
+    if (pattern.empty())
+        return;
+    bool anchored = pattern.front() == '/';
+    bool dir_only = pattern.back() == '/';
+    vector<string_view> parts = split_path(pattern);
+    if (parts.empty())
+        return;
+
+    if (!anchored && parts.size() == 1)
+    {
+        string_view name = parts[0];
+        if (!has_wildcard(name))
+        {
+            (dir_only ? set.dir_names : set.names).insert(string(name));
+            return;
+        }
+        if (!dir_only && name.size() > 2 && name[0] == '*' && name[1] == '.' && !has_wildcard(name.substr(1)))
+        {
+            set.extensions.insert(string(name.substr(2)));
+            return;
+        }
+    }
+
+    Rule rule{{}, dir_only};
+    if (!anchored)
+    {
+        // "a/b" matches at any depth, just like "/**/a/b"
+        rule.parts.push_back("**");
+    }
+    for (string_view part : parts)
+    {
+        rule.parts.push_back(string(part));
+    }
+    set.rules.push_back(rule);
+}
+
+bool PathFilter::RuleSet::empty() const
+{
+    return names.empty() && dir_names.empty() && extensions.empty() && rules.empty();
+}
+
+bool PathFilter::RuleSet::matches(const vector<string_view> &components, bool folder) const
+{
+    if (components.empty())
+        return false;
+    string name(components.back());
+    if (names.count(name) || (folder && dir_names.count(name)))
+        return true;
+    size_t dot = name.rfind('.');
+    if (!folder && dot != string::npos && extensions.count(name.substr(dot + 1)))
+        return true;
+    for (const Rule &rule : rules)
+    {
+        if ((folder || !rule.dir_only) && match_parts(rule.parts, 0, components, 0, false))
+            return true;
+    }
+    return false;
+}
+
+void PathFilter::add_include(const string &pattern)
+{
+    compile(this->includes, pattern);
+}
+
+void PathFilter::add_exclude(const string &pattern)
+{
+    compile(this->excludes, pattern);
+}
+
+void PathFilter::add_includes(const string &patterns)
+{
+    stringstream ss(patterns);
+    string pattern;
+    while (ss >> pattern)
+    {
+        this->add_include(pattern);
+    }
+}
+
+void PathFilter::add_excludes(const string &patterns)
+{
+    stringstream ss(patterns);
+    string pattern;
+    while (ss >> pattern)
+    {
+        this->add_exclude(pattern);
+    }
+}
+
+bool PathFilter::empty() const
+{
+    return this->includes.empty() && this->excludes.empty();
+}
+
+bool PathFilter::included(const vector<string_view> &components, bool folder) const
+{
+    if (this->includes.empty())
+        return true;
+    // Everything below an included folder is included
+    for (size_t n = components.size(); n > 0; n--)
+    {
+        vector<string_view> head(components.begin(), components.begin() + n);
+        if (this->includes.matches(head, folder || n < components.size()))
+            return true;
+    }
+    return false;
+}
+
+bool PathFilter::may_contain_included(const vector<string_view> &components) const
+{
+    // Only multi-component rules can rule out a folder, a plain name may match anywhere below
+    if (!this->includes.names.empty() || !this->includes.dir_names.empty() || !this->includes.extensions.empty())
+        return true;
+    for (const Rule &rule : this->includes.rules)
+    {
+        if (match_parts(rule.parts, 0, components, 0, true))
+            return true;
+    }
+    return false;
+}
+
+bool PathFilter::skip(const string &path, bool folder) const
+{
+    vector<string_view> components = split_path(path);
+    if (components.empty())
+        return false; // The root itself
+    if (this->excludes.matches(components, folder))
+        return true;
+    if (folder)
+        return !this->included(components, true) && !this->may_contain_included(components);
+    return !this->included(components, false);
+}
+
+bool PathFilter::skip_tree(const string &path, bool folder)
+{
+    if (this->empty())
+        return false;
+    size_t end = path.size() - (path.size() > 1 && path.back() == '/' ? 1 : 0);
+    size_t slash = path.rfind('/', end - 1);
+    if (slash != string::npos && slash > 0)
+    {
+        string parent = path.substr(0, slash + 1);
+        if (parent != this->cached_dir)
+        {
+            this->cached_dir_skipped = this->skip_tree(parent, true);
+            this->cached_dir = parent;
+        }
+        if (this->cached_dir_skipped)
+            return true;
+    }
+    return this->skip(path, folder);
+}
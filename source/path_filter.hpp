@@ -0,0 +1,58 @@
+#pragma once
+
+#include <string>
+#include <string_view>
+#include <vector>
+#include <unordered_set>
+
+/// Include/exclude rules on paths relative to a profile root.
+///
+/// Patterns use '*' and '?' within a path component and '**' across
+/// components. A pattern starting with '/' is anchored to the root, others
+/// match at any depth. A trailing '/' restricts the pattern to folders.
+/// Excluded folders are pruned with everything below them. If any include
+/// pattern is given, only files matching one (or below a folder matching
+/// one) are synced, and folders that can't lead to a match are pruned.
+class PathFilter
+{
+public:
+    void add_include(const std::string &pattern);
+    void add_exclude(const std::string &pattern);
+    /// Add every whitespace separated pattern in `patterns`
+    void add_includes(const std::string &patterns);
+    void add_excludes(const std::string &patterns);
+    bool empty() const;
+
+    /// Whether a path should be skipped, assuming its parent was not.
+    /// Use this while walking a tree, it never looks at ancestors.
+    bool skip(const std::string &path, bool folder) const;
+    /// Like skip(), but also checks every ancestor folder.
+    /// Use this on flat listings where parents may have been skipped.
+    bool skip_tree(const std::string &path, bool folder);
+
+private:
+    struct Rule
+    {
+        std::vector<std::string> parts;
+        bool dir_only;
+    };
+    struct RuleSet
+    {
+        // Fast paths for single component patterns matching anywhere
+        std::unordered_set<std::string> names;
+        std::unordered_set<std::string> dir_names;
+        std::unordered_set<std::string> extensions; // "*.ext"
+        std::vector<Rule> rules;
+        bool empty() const;
+        bool matches(const std::vector<std::string_view> &components, bool folder) const;
+    };
+    RuleSet includes;
+    RuleSet excludes;
+    // Result for the last folder checked by skip_tree(); listings are grouped by folder
+    std::string cached_dir;
+    bool cached_dir_skipped = false;
+
+    static void compile(RuleSet &set, const std::string &pattern);
+    bool included(const std::vector<std::string_view> &components, bool folder) const;
+    bool may_contain_included(const std::vector<std::string_view> &components) const;
+};
@@ -0,0 +1,23 @@
+#include "poll_schedule.hpp"
+
+#include <algorithm>
+
+using namespace std;
+
+PollSchedule::PollSchedule(uint64_t interval_ms, uint64_t max_interval_ms)
+    : interval_ms(max<uint64_t>(interval_ms, 1000)), max_interval_ms(max(max_interval_ms, this->interval_ms)),
+      current_ms(this->interval_ms)
+{
+}
+
+uint64_t PollSchedule::next(bool changed)
+{
+    if (changed)
+    {
+        this->current_ms = this->interval_ms;
+        return this->current_ms;
+    }
+    uint64_t delay = this->current_ms;
+    this->current_ms = min(this->current_ms * 2, this->max_interval_ms);
+    return delay;
+}
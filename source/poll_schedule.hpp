@@ -0,0 +1,19 @@
+#pragma once
+
+#include <cstdint>
+
+/// Pacing of continuous mode. Cycles that find nothing to do back off
+/// towards the maximum interval, so an idle profile costs ever fewer
+/// requests; any change goes straight back to the base interval.
+class PollSchedule
+{
+public:
+    PollSchedule(uint64_t interval_ms, uint64_t max_interval_ms);
+    /// Delay before the next cycle, given whether this one changed anything
+    uint64_t next(bool changed);
+
+private:
+    uint64_t interval_ms;
+    uint64_t max_interval_ms;
+    uint64_t current_ms;
+};
@@ -0,0 +1,106 @@
+#include "profile_pool.hpp"
+#include "console.hpp"
+
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+
+using namespace std;
+
+/// Whether one path is the other, or one of its ancestors
+static bool paths_overlap(string a, string b)
+{
+    while (!a.empty() && a.back() == '/')
+        a.pop_back();
+    while (!b.empty() && b.back() == '/')
+        b.pop_back();
+    if (a.size() > b.size())
+        swap(a, b);
+    return b.compare(0, a.size(), a) == 0 && (b.size() == a.size() || b[a.size()] == '/');
+}
+
+static bool profiles_conflict(const SyncProfile &a, const SyncProfile &b)
+{
+    return paths_overlap(a.local_path, b.local_path) || paths_overlap(a.url, b.url);
+}
+
+vector<bool> sync_profiles(const vector<SyncProfile> &profiles, unsigned workers)
+{
+    enum State
+    {
+        Pending,
+        Running,
+        Done
+    };
+    vector<State> states(profiles.size(), Pending);
+    vector<bool> results(profiles.size(), false);
+    mutex m;
+    condition_variable cv;
+
+    if (workers < 1)
+        workers = 1;
+    if (workers > profiles.size())
+        workers = profiles.size();
+    console_set_multiplexed(workers > 1);
+
+    // Pick the first pending profile that doesn't overlap a running one.
+    // Returns profiles.size() when nothing is left to do.
+    auto next_job = [&](unique_lock<mutex> &lock) -> size_t
+    {
+        while (true)
+        {
+            bool pending = false;
+            for (size_t i = 0; i < profiles.size(); i++)
+            {
+                if (states[i] != Pending)
+                    continue;
+                pending = true;
+                bool blocked = false;
+                for (size_t j = 0; j < profiles.size() && !blocked; j++)
+                {
+                    blocked = states[j] == Running && profiles_conflict(profiles[i], profiles[j]);
+                }
+                if (!blocked)
+                {
+                    states[i] = Running;
+                    return i;
+                }
+            }
+            if (!pending)
+                return profiles.size();
+            cv.wait(lock);
+        }
+    };
+
+    auto worker = [&]()
+    {
+        unique_lock<mutex> lock(m);
+        for (size_t i = next_job(lock); i < profiles.size(); i = next_job(lock))
+        {
+            lock.unlock();
+            console_set_profile(profiles[i].name);
+            console_printf(CONSOLE_BLUE "\nSyncing %s\n" CONSOLE_RESET, profiles[i].name.c_str());
+            bool result = profiles[i].client->compareAndUpdate();
+            console_printf("%s finished\n", profiles[i].name.c_str());
+            lock.lock();
+            results[i] = result;
+            states[i] = Done;
+            cv.notify_all();
+        }
+    };
+
+    vector<thread> threads;
+    for (unsigned i = 1; i < workers; i++)
+    {
+        threads.emplace_back(worker);
+    }
+    // The calling thread works too, so a single worker needs no extra thread
+    worker();
+    for (thread &t : threads)
+    {
+        t.join();
+    }
+    console_set_profile("");
+    console_set_multiplexed(false);
+    return results;
+}
@@ -0,0 +1,19 @@
+#pragma once
+
+#include <string>
+#include <vector>
+
+#include "webdav.hpp"
+
+struct SyncProfile
+{
+    std::string name;
+    std::string url;
+    std::string local_path;
+    WebDavClient *client;
+};
+
+/// Sync every profile, running up to `workers` independent profiles at once.
+/// Profiles whose local or remote roots overlap are never run concurrently.
+/// Returns one result per profile, in the same order as `profiles`.
+std::vector<bool> sync_profiles(const std::vector<SyncProfile> &profiles, unsigned workers);
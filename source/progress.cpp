@@ -0,0 +1,203 @@
+#include "progress.hpp"
+
+#include <stdio.h>
+
+using namespace std;
+
+TransferStatus::TransferStatus(string n)
+    : name(n), total(0), completed(0), done(false),
+      last_tick(0), last_bytes(0), smoothed_rate(0), last_remaining(0)
+{
+}
+
+void TransferStatus::reset()
+{
+    this->total = 0;
+    this->completed = 0;
+    this->done = false;
+}
+
+void TransferStatus::plan(u64 total_bytes)
+{
+    this->total = total_bytes;
+    this->done = false;
+}
+
+int TransferStatus::begin_file(const string &path, u64 size)
+{
+    lock_guard<mutex> lock(this->file_lock);
+    for (int i = 0; i < max_files; i++)
+    {
+        Slot &s = this->slots[i];
+        if (!s.used)
+        {
+            s.used = true;
+            s.file = path;
+            s.size = size;
+            s.current = 0;
+            return i;
+        }
+    }
+    return -1;
+}
+
+void TransferStatus::update(int slot, u64 now)
+{
+    this->slots[slot].current.store(now, memory_order_relaxed);
+}
+
+void TransferStatus::end_file(int slot, u64 moved)
+{
+    // Count the bytes before the slot stops showing them, so the total never dips
+    this->completed += moved;
+    if (slot < 0)
+    {
+        return;
+    }
+    Slot &s = this->slots[slot];
+    lock_guard<mutex> lock(this->file_lock);
+    s.current = 0;
+    s.size = 0;
+    s.used = false;
+    s.file.clear();
+}
+
+FileProgress::FileProgress(TransferStatus *status, const string &path, u64 size)
+    : status(status), slot(status ? status->begin_file(path, size) : -1), offset(0), moved(0)
+{
+}
+
+FileProgress::~FileProgress()
+{
+    if (this->status)
+    {
+        this->status->end_file(this->slot, this->moved);
+    }
+}
+
+void FileProgress::update(u64 now)
+{
+    this->moved = this->offset + now;
+    if (this->slot >= 0)
+    {
+        this->status->update(this->slot, this->moved);
+    }
+}
+
+void FileProgress::restart_at(u64 offset)
+{
+    this->offset = offset;
+    this->update(0);
+}
+
+void TransferStatus::finish()
+{
+    this->done = true;
+}
+
+double TransferStatus::rate() const
+{
+    return this->smoothed_rate;
+}
+
+u64 TransferStatus::remaining() const
+{
+    return this->last_remaining;
+}
+
+string TransferStatus::describe(int width)
+{
+    u64 now_tick = armGetSystemTick();
+    // Files in flight; the largest one is shown
+    u64 current = 0, size = 0, largest_current = 0;
+    int active = 0;
+    string file;
+    {
+        lock_guard<mutex> lock(this->file_lock);
+        for (Slot &s : this->slots)
+        {
+            if (!s.used)
+                continue;
+            u64 c = s.current.load(memory_order_relaxed);
+            current += c;
+            active++;
+            if (file.empty() || s.size > size)
+            {
+                file = s.file;
+                size = s.size;
+                largest_current = c;
+            }
+        }
+    }
+    u64 moved = this->completed + current;
+    if (this->last_tick && now_tick > this->last_tick)
+    {
+        // Exponential moving average over frames, so the rate doesn't flicker
+        double seconds = armTicksToNs(now_tick - this->last_tick) / 1e9;
+        double instant = (moved >= this->last_bytes ? moved - this->last_bytes : 0) / seconds;
+        this->smoothed_rate = this->smoothed_rate * 0.8 + instant * 0.2;
+    }
+    this->last_tick = now_tick;
+    this->last_bytes = moved;
+    u64 total = max((u64)this->total, moved);
+    this->last_remaining = this->done ? 0 : total - moved;
+
+    char buf[256];
+    if (this->done)
+    {
+        snprintf(buf, sizeof(buf), "%-10.10s done, %s moved", this->name.c_str(), format_bytes(moved).c_str());
+    }
+    else
+    {
+        double rate = this->smoothed_rate;
+        int written = snprintf(buf, sizeof(buf), "%-10.10s %s/%s %s/s ETA %s", this->name.c_str(),
+                               format_bytes(moved).c_str(), format_bytes(total).c_str(), format_bytes(rate).c_str(),
+                               format_eta(rate > 0 ? this->last_remaining / rate : -1).c_str());
+        if (!file.empty() && written > 0 && written < (int)sizeof(buf))
+        {
+            int percent = size ? (int)(largest_current * 100 / size) : 0;
+            char others[16] = "";
+            if (active > 1)
+            {
+                snprintf(others, sizeof(others), "+%d ", active - 1);
+            }
+            snprintf(buf + written, sizeof(buf) - written, " | %3d%% %s %s%s", percent,
+                     format_eta(rate > 0 && size >= largest_current ? (size - largest_current) / rate : -1).c_str(), others, file.c_str());
+        }
+    }
+    string line(buf);
+    if ((int)line.size() > width)
+    {
+        line.resize(width);
+    }
+    return line;
+}
+
+string format_bytes(double bytes)
+{
+    const char *units[] = {"B", "KB", "MB", "GB", "TB"};
+    int unit = 0;
+    while (bytes >= 1024 && unit < 4)
+    {
+        bytes /= 1024;
+        unit++;
+    }
+    char buf[32];
+    snprintf(buf, sizeof(buf), unit ? "%.1f %s" : "%.0f %s", bytes, units[unit]);
+    return buf;
+}
+
+string format_eta(double seconds)
+{
+    if (seconds < 0 || seconds > 360000)
+    {
+        return "--:--";
+    }
+    long s = (long)seconds;
+    char buf[32];
+    if (s >= 3600)
+        snprintf(buf, sizeof(buf), "%ld:%02ld:%02ld", s / 3600, s / 60 % 60, s % 60);
+    else
+        snprintf(buf, sizeof(buf), "%ld:%02ld", s / 60, s % 60);
+    return buf;
+}
@@ -0,0 +1,83 @@
+#pragma once
+
+#include <string>
+#include <atomic>
+#include <mutex>
+#include <switch.h>
+
+/// Transfer progress of one profile. Transfers update it lock-free from
+/// curl's progress callback; the console renderer reads it once per frame.
+class TransferStatus
+{
+public:
+    /// Files tracked individually at the same time; more are only counted when done
+    static const int max_files = 8;
+
+    explicit TransferStatus(std::string name = "");
+    /// Forget the previous run's volume. Only while nothing is transferring.
+    void reset();
+    /// Expected transfer volume of this run, including what was already moved, for the overall ETA
+    void plan(u64 total_bytes);
+    /// Start tracking a file, returns its slot or -1 if all are taken
+    int begin_file(const std::string &path, u64 size);
+    /// Bytes of the file in `slot` moved so far
+    void update(int slot, u64 now);
+    /// Count a file as done after `moved` bytes, freeing its slot
+    void end_file(int slot, u64 moved);
+    void finish();
+
+    /// Status line of at most `width` characters. Render thread only.
+    std::string describe(int width);
+    /// Smoothed bytes per second, as of the last describe()
+    double rate() const;
+    /// Bytes still to move in this run, as of the last describe()
+    u64 remaining() const;
+
+private:
+    struct Slot
+    {
+        std::atomic<u64> current{0};
+        std::atomic<u64> size{0};
+        // Guarded by file_lock
+        bool used = false;
+        std::string file;
+    };
+
+    std::string name;
+    std::atomic<u64> total;
+    std::atomic<u64> completed;
+    std::atomic<bool> done;
+    std::mutex file_lock;
+    Slot slots[max_files];
+    // Render thread state
+    u64 last_tick;
+    u64 last_bytes;
+    double smoothed_rate;
+    u64 last_remaining;
+};
+
+/// One file transfer, registered with a TransferStatus for as long as it
+/// lives. Does nothing without a status.
+class FileProgress
+{
+public:
+    FileProgress(TransferStatus *status, const std::string &path, u64 size);
+    ~FileProgress();
+    FileProgress(const FileProgress &) = delete;
+    FileProgress &operator=(const FileProgress &) = delete;
+    /// Bytes moved so far, from curl's progress callback
+    void update(u64 now);
+    /// A new attempt starts at `offset`, curl counts from there
+    void restart_at(u64 offset);
+
+private:
+    TransferStatus *status;
+    int slot;
+    u64 offset;
+    u64 moved;
+};
+
+/// "1.5 MB" style size
+std::string format_bytes(double bytes);
+/// "1:02:03" / "2:03" style duration, "--:--" if unknown
+std::string format_eta(double seconds);
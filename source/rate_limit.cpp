@@ -0,0 +1,146 @@
+#include "rate_limit.hpp"
+
+#include <thread>
+#include <algorithm>
+#include <stdio.h>
+#include <stdlib.h>
+
+using namespace std;
+
+static string trim(const string &s)
+{
+    size_t first = s.find_first_not_of(" \t");
+    if (first == string::npos)
+    {
+        return "";
+    }
+    return s.substr(first, s.find_last_not_of(" \t") - first + 1);
+}
+
+optional<RateSchedule> RateSchedule::parse(const string &spec)
+{
+    RateSchedule schedule;
+    size_t start = 0;
+    while (start <= spec.size())
+    {
+        size_t end = spec.find(',', start);
+        if (end == string::npos)
+        {
+            end = spec.size();
+        }
+        string entry = trim(spec.substr(start, end - start));
+        start = end + 1;
+        if (entry.empty())
+        {
+            continue;
+        }
+        int h1, m1, h2, m2, used = -1;
+        unsigned long long kb;
+        if (sscanf(entry.c_str(), "%d:%d-%d:%d %llu%n", &h1, &m1, &h2, &m2, &kb, &used) == 5)
+        {
+            if (used != (int)entry.size() || h1 < 0 || h2 < 0 || m1 < 0 || m1 > 59 || m2 < 0 || m2 > 59 ||
+                h1 * 60 + m1 > 24 * 60 || h2 * 60 + m2 > 24 * 60)
+            {
+                return nullopt;
+            }
+            schedule.windows.push_back(Window{h1 * 60 + m1, h2 * 60 + m2, (u64)kb * 1024});
+        }
+        else
+        {
+            char *rest;
+            kb = strtoull(entry.c_str(), &rest, 10);
+            if (*rest || entry[0] == '-')
+            {
+                return nullopt;
+            }
+            schedule.fallback = (u64)kb * 1024;
+        }
+    }
+    return schedule;
+}
+
+u64 RateSchedule::rate(time_t now) const
+{
+    if (this->windows.empty())
+    {
+        return this->fallback;
+    }
+    struct tm local;
+    localtime_r(&now, &local);
+    int minute = local.tm_hour * 60 + local.tm_min;
+    for (const Window &w : this->windows)
+    {
+        bool inside = w.start <= w.end ? minute >= w.start && minute < w.end : minute >= w.start || minute < w.end;
+        if (inside)
+        {
+            return w.rate;
+        }
+    }
+    return this->fallback;
+}
+
+TokenBucket::TokenBucket() : tokens(0), last_refill(chrono::steady_clock::now())
+{
+}
+
+void TokenBucket::set_schedule(const RateSchedule &schedule)
+{
+    lock_guard<mutex> guard(this->lock);
+    this->schedule = schedule;
+}
+
+u64 TokenBucket::rate()
+{
+    lock_guard<mutex> guard(this->lock);
+    return this->schedule.rate(time(NULL));
+}
+
+u64 TokenBucket::take(u64 bytes)
+{
+    lock_guard<mutex> guard(this->lock);
+    u64 rate = this->schedule.rate(time(NULL));
+    auto now = chrono::steady_clock::now();
+    double elapsed = chrono::duration<double>(now - this->last_refill).count();
+    this->last_refill = now;
+    if (rate == 0)
+    {
+        this->tokens = 0;
+        return 0;
+    }
+    // A quarter second of burst, so idle time doesn't turn into a flood later
+    this->tokens = min(this->tokens + elapsed * rate, rate / 4.0);
+    this->tokens -= bytes;
+    if (this->tokens >= 0)
+    {
+        return 0;
+    }
+    return (u64)(-this->tokens * 1000 / rate);
+}
+
+RateLimits &global_rate_limits()
+{
+    static RateLimits limits;
+    return limits;
+}
+
+void throttle(RateLimits &profile, u64 uploaded, u64 downloaded)
+{
+    if (uploaded == 0 && downloaded == 0)
+    {
+        return;
+    }
+    RateLimits &global = global_rate_limits();
+    u64 wait = 0;
+    if (uploaded > 0)
+    {
+        wait = max(profile.upload.take(uploaded), global.upload.take(uploaded));
+    }
+    if (downloaded > 0)
+    {
+        wait = max(wait, max(profile.download.take(downloaded), global.download.take(downloaded)));
+    }
+    if (wait > 0)
+    {
+        this_thread::sleep_for(chrono::milliseconds(wait));
+    }
+}
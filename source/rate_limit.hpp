@@ -0,0 +1,65 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <mutex>
+#include <chrono>
+#include <optional>
+#include <ctime>
+#include <switch.h>
+
+/// A rate limit that may depend on the time of day
+class RateSchedule
+{
+public:
+    /// Comma separated "<KB/s>" and "HH:MM-HH:MM <KB/s>" entries. The first window
+    /// containing the local time applies, the plain value outside all of them.
+    /// 0 or nothing is unlimited. nullopt if malformed.
+    static std::optional<RateSchedule> parse(const std::string &spec);
+    /// Bytes per second at `now`, 0 for unlimited
+    u64 rate(time_t now) const;
+
+private:
+    struct Window
+    {
+        int start; // Minutes since midnight
+        int end;   // Before start if the window spans midnight
+        u64 rate;
+    };
+    std::vector<Window> windows;
+    u64 fallback = 0;
+};
+
+/// A token bucket shared by every transfer it limits. Transfers take what they
+/// moved, and sleep off whatever exceeds the budget. As each one waits for all
+/// the debt taken before it, concurrent transfers get their turns in order and
+/// split the rate evenly.
+class TokenBucket
+{
+public:
+    TokenBucket();
+    void set_schedule(const RateSchedule &schedule);
+    /// Bytes per second now, 0 for unlimited
+    u64 rate();
+    /// Account for `bytes` just moved, returns the milliseconds to wait
+    u64 take(u64 bytes);
+
+private:
+    std::mutex lock;
+    RateSchedule schedule;
+    double tokens; // Negative while in debt
+    std::chrono::steady_clock::time_point last_refill;
+};
+
+/// Upload and download budgets
+struct RateLimits
+{
+    TokenBucket upload;
+    TokenBucket download;
+};
+
+/// The budgets all profiles share
+RateLimits &global_rate_limits();
+/// Charge bytes moved to a profile's budgets and the global ones, then wait
+/// as long as the tighter of them requires
+void throttle(RateLimits &profile, u64 uploaded, u64 downloaded);
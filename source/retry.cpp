@@ -0,0 +1,107 @@
+#include "retry.hpp"
+
+#include <map>
+#include <mutex>
+#include <chrono>
+#include <random>
+#include <thread>
+#include <algorithm>
+
+using namespace std;
+
+bool is_transient(CURLcode res, long response_code)
+{
+    switch (res)
+    {
+    case CURLE_COULDNT_RESOLVE_HOST:
+    case CURLE_COULDNT_CONNECT:
+    case CURLE_OPERATION_TIMEDOUT:
+    case CURLE_SEND_ERROR:
+    case CURLE_RECV_ERROR:
+    case CURLE_GOT_NOTHING:
+    case CURLE_PARTIAL_FILE:
+    case CURLE_SSL_CONNECT_ERROR:
+    case CURLE_HTTP2:
+    case CURLE_HTTP2_STREAM:
+        return true;
+    case CURLE_HTTP_RETURNED_ERROR:
+        // Timeouts, throttling and overloaded or restarting servers
+        return response_code == 408 || response_code == 425 || response_code == 429 ||
+               response_code == 500 || response_code == 502 || response_code == 503 || response_code == 504;
+    default:
+        return false;
+    }
+}
+
+u64 retry_delay_ms(const RetryPolicy &policy, unsigned retry, curl_off_t retry_after)
+{
+    static thread_local minstd_rand rng(chrono::steady_clock::now().time_since_epoch().count() ^
+                                        hash<thread::id>()(this_thread::get_id()));
+    u64 delay = (u64)policy.base_delay_ms << min(retry, 20u);
+    delay = min(delay, (u64)policy.max_delay_ms);
+    // Half fixed, half random, so clients that failed together don't retry together
+    delay = delay / 2 + uniform_int_distribution<u64>(0, delay / 2)(rng);
+    if (retry_after > 0)
+    {
+        delay = max(delay, (u64)retry_after * 1000);
+    }
+    return min(delay, (u64)policy.max_delay_ms);
+}
+
+namespace
+{
+    struct Circuit
+    {
+        unsigned failures = 0;
+        chrono::steady_clock::time_point open_until;
+        bool probing = false;
+    };
+
+    mutex circuits_lock;
+    map<string, Circuit> circuits;
+}
+
+bool circuit_allows(const string &host, const RetryPolicy &policy)
+{
+    if (!policy.breaker_threshold)
+    {
+        return true;
+    }
+    lock_guard<mutex> guard(circuits_lock);
+    Circuit &c = circuits[host];
+    if (c.failures < policy.breaker_threshold)
+    {
+        return true;
+    }
+    if (chrono::steady_clock::now() < c.open_until || c.probing)
+    {
+        return false;
+    }
+    c.probing = true;
+    return true;
+}
+
+bool circuit_record(const string &host, bool healthy, const RetryPolicy &policy)
+{
+    if (!policy.breaker_threshold)
+    {
+        return false;
+    }
+    lock_guard<mutex> guard(circuits_lock);
+    Circuit &c = circuits[host];
+    bool was_open = c.failures >= policy.breaker_threshold;
+    c.probing = false;
+    if (healthy)
+    {
+        c.failures = 0;
+        return false;
+    }
+    c.failures++;
+    if (c.failures < policy.breaker_threshold)
+    {
+        return false;
+    }
+    // A failed probe keeps it open for another cooldown
+    c.open_until = chrono::steady_clock::now() + chrono::milliseconds(policy.breaker_cooldown_ms);
+    return !was_open;
+}
@@ -0,0 +1,37 @@
+#pragma once
+
+#include <string>
+#include <curl/curl.h>
+#include <switch.h>
+
+/// When and how often failed requests are tried again
+struct RetryPolicy
+{
+    /// Retries after the first attempt, 0 disables retrying
+    unsigned attempts = 4;
+    /// Delay before the first retry; doubles with every further one, with random jitter
+    u32 base_delay_ms = 500;
+    /// Longest delay between attempts, also caps what Retry-After may ask for
+    u32 max_delay_ms = 60000;
+    /// Abort transfers slower than low_speed_limit bytes/s for low_speed_time seconds (0 disables)
+    long low_speed_limit = 1024;
+    long low_speed_time = 30;
+    long connect_timeout = 20;
+    /// Consecutive transient failures on a host that make its requests fail
+    /// without being tried for breaker_cooldown_ms. 0 disables the breaker.
+    unsigned breaker_threshold = 8;
+    u32 breaker_cooldown_ms = 60000;
+};
+
+/// Whether a failed request may succeed when simply tried again
+bool is_transient(CURLcode res, long response_code);
+/// How long to wait before retry number `retry` (from 0). At least
+/// `retry_after` seconds if the server sent that, at most max_delay_ms.
+u64 retry_delay_ms(const RetryPolicy &policy, unsigned retry, curl_off_t retry_after);
+
+/// Whether a request to `host` may be made now. Shared by all clients, so
+/// profiles on the same server back off together. Once the cooldown of an
+/// open circuit is over, one request at a time is let through to probe it.
+bool circuit_allows(const std::string &host, const RetryPolicy &policy);
+/// Report the outcome of a request. Returns true if this opened the circuit.
+bool circuit_record(const std::string &host, bool healthy, const RetryPolicy &policy);
@@ -0,0 +1,98 @@
+#include "transfer_queue.hpp"
+
+#include <algorithm>
+#include <thread>
+#include <mutex>
+
+using namespace std;
+
+optional<TransferOrder> parse_transfer_order(const string &name)
+{
+    if (name == "shortest")
+        return TransferOrder::Shortest;
+    if (name == "path")
+        return TransferOrder::Path;
+    if (name == "newest")
+        return TransferOrder::Newest;
+    return nullopt;
+}
+
+static void sort_jobs(vector<TransferJob *> &queue, TransferOrder order)
+{
+    // Stable, so ties keep listing order
+    stable_sort(queue.begin(), queue.end(), [order](const TransferJob *a, const TransferJob *b)
+                {
+                    switch (order)
+                    {
+                    case TransferOrder::Shortest:
+                        return a->size < b->size;
+                    case TransferOrder::Newest:
+                        return a->mtime > b->mtime;
+                    default:
+                        return a->path < b->path;
+                    }
+                });
+}
+
+void run_transfers(vector<TransferJob> &jobs, const TransferLanes &lanes,
+                   function<bool()> open_lane, function<void()> close_lane)
+{
+    if (jobs.empty())
+    {
+        return;
+    }
+    vector<TransferJob *> small, large;
+    for (TransferJob &job : jobs)
+    {
+        (job.size < lanes.large_size ? small : large).push_back(&job);
+    }
+    sort_jobs(small, lanes.order);
+    sort_jobs(large, lanes.order);
+
+    mutex lock;
+    size_t next_small = 0, next_large = 0;
+    auto lane = [&](bool is_large)
+    {
+        while (true)
+        {
+            TransferJob *job = NULL;
+            {
+                lock_guard<mutex> guard(lock);
+                if (is_large && next_large < large.size())
+                    job = large[next_large++];
+                else if (next_small < small.size())
+                    job = small[next_small++];
+            }
+            if (!job)
+                return;
+            job->run();
+        }
+    };
+
+    // The calling thread takes the small lane, or the large one if there is nothing small
+    bool caller_large = small.empty();
+    size_t small_lanes = min<size_t>(max(lanes.small, 1u), small.size());
+    size_t large_lanes = min<size_t>(max(lanes.large, 1u), large.size());
+    if (caller_large)
+        large_lanes--;
+    else
+        small_lanes--;
+
+    vector<thread> threads;
+    for (size_t i = 0; i < small_lanes + large_lanes; i++)
+    {
+        bool is_large = i >= small_lanes;
+        threads.emplace_back([&, is_large]()
+                             {
+                                 if (!open_lane())
+                                     return;
+                                 lane(is_large);
+                                 close_lane();
+                             });
+    }
+    lane(caller_large);
+    for (thread &t : threads)
+    {
+        t.join();
+    }
+}
@@ -0,0 +1,48 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <optional>
+#include <functional>
+#include <ctime>
+#include <switch.h>
+
+/// Order in which queued transfers start within a lane
+enum class TransferOrder
+{
+    Shortest,
+    Path,
+    Newest,
+};
+
+/// Parse "shortest", "path" or "newest"
+std::optional<TransferOrder> parse_transfer_order(const std::string &name);
+
+/// A file transfer waiting to run. `run` reports its own outcome.
+struct TransferJob
+{
+    std::string path;
+    u64 size;
+    time_t mtime;
+    std::function<void()> run;
+};
+
+/// How queued transfers are spread over connections
+struct TransferLanes
+{
+    TransferOrder order = TransferOrder::Shortest;
+    /// Files below large_size run on this many connections at once, hiding per-request latency
+    unsigned small = 4;
+    /// Larger files stream on at most this many connections
+    unsigned large = 1;
+    u64 large_size = 8 * 1024 * 1024;
+};
+
+/// Run every job and return once all are done. Each lane is a thread;
+/// the calling thread is one of them. An idle large lane helps out with
+/// small files, but small lanes never start large ones, so a big file
+/// can't hold back a queue of small ones.
+/// `open_lane` runs first on every other lane's thread, which stays idle if
+/// it fails; `close_lane` runs when its work is done.
+void run_transfers(std::vector<TransferJob> &jobs, const TransferLanes &lanes,
+                   std::function<bool()> open_lane, std::function<void()> close_lane);
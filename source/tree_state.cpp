@@ -0,0 +1,145 @@
+#include "tree_state.hpp"
+#include "console.hpp"
+
+#include <stdio.h>
+#include <inttypes.h>
+#include <algorithm>
+#include <functional>
+
+using namespace std;
+
+static const char *header = "NXDavSync-tree 1\n";
+
+void TreeSummary::add(string_view path, bool folder, u64 size, time_t mtime)
+{
+    this->count++;
+    if (folder)
+    {
+        this->digest += hash<string_view>()(path);
+        return;
+    }
+    this->size += size;
+    this->max_mtime = max(this->max_mtime, mtime);
+    string key(path);
+    key += '\t';
+    key += to_string(size);
+    key += '\t';
+    key += to_string((long long)mtime);
+    this->digest += hash<string>()(key);
+}
+
+bool TreeSummary::operator==(const TreeSummary &other) const
+{
+    return this->count == other.count && this->size == other.size && this->max_mtime == other.max_mtime &&
+           this->digest == other.digest;
+}
+
+TreeSummary summarize(const vector<TreeRecord> &records)
+{
+    TreeSummary summary;
+    for (const TreeRecord &r : records)
+    {
+        if (r.path != "/")
+            summary.add(r.path, r.folder, r.size, r.local_mtime);
+    }
+    return summary;
+}
+
+TreeSummary summarize(const FileList &files)
+{
+    TreeSummary summary;
+    string path;
+    for (u32 i = FileList::root + 1; i < files.size(); i++)
+    {
+        path.clear();
+        files.append_path(i, path);
+        summary.add(path, files.folder(i), files[i].size, files[i].mtime);
+    }
+    return summary;
+}
+
+vector<TreeRecord> load_tree_state(const string &file, TreeStamp *stamp)
+{
+    vector<TreeRecord> records;
+    FILE *fp = fopen(file.c_str(), "r");
+    if (!fp)
+    {
+        return records;
+    }
+
+    char line[1024];
+    if (!fgets(line, sizeof(line), fp) || strcmp(line, header) != 0)
+    {
+        fclose(fp);
+        return records;
+    }
+    while (fgets(line, sizeof(line), fp))
+    {
+        // R <config hash> <remote version>
+        unsigned long long config;
+        int version = 0;
+        if (line[0] == 'R' && sscanf(line, "R\t%llx\t%n", &config, &version) == 1 && version > 0)
+        {
+            if (stamp)
+            {
+                stamp->config = config;
+                stamp->remote_version = line + version;
+                if (!stamp->remote_version.empty() && stamp->remote_version.back() == '\n')
+                    stamp->remote_version.pop_back();
+            }
+            continue;
+        }
+        // <F|D> <size> <local mtime> <remote mtime> <checksum or -> <path>
+        char type;
+        u64 size;
+        long long local_mtime, remote_mtime;
+        char checksum[64];
+        int offset = 0;
+        if (sscanf(line, "%c\t%" SCNu64 "\t%lld\t%lld\t%63s\t%n", &type, &size, &local_mtime, &remote_mtime, checksum, &offset) < 5 || offset == 0)
+        {
+            continue;
+        }
+        string path = line + offset;
+        if (!path.empty() && path.back() == '\n')
+        {
+            path.pop_back();
+        }
+        records.push_back(TreeRecord{path, type == 'D', size, (time_t)local_mtime, (time_t)remote_mtime,
+                                     strcmp(checksum, "-") == 0 ? "" : checksum});
+    }
+    fclose(fp);
+    return records;
+}
+
+bool save_tree_state(const string &file, const vector<TreeRecord> &records, const TreeStamp &stamp)
+{
+    string tmp = file + ".tmp";
+    FILE *fp = fopen(tmp.c_str(), "w");
+    if (!fp)
+    {
+        console_printf("can't write sync state %s: %s\n", tmp.c_str(), strerror(errno));
+        return false;
+    }
+    fputs(header, fp);
+    fprintf(fp, "R\t%llx\t%s\n", (unsigned long long)stamp.config, stamp.remote_version.c_str());
+    for (const TreeRecord &r : records)
+    {
+        fprintf(fp, "%c\t%" PRIu64 "\t%lld\t%lld\t%s\t%s\n", r.folder ? 'D' : 'F', r.size,
+                (long long)r.local_mtime, (long long)r.remote_mtime,
+                r.checksum.empty() ? "-" : r.checksum.c_str(), r.path.c_str());
+    }
+    // Replace the old state only once the new one is completely on disk
+    if (fclose(fp) != 0)
+    {
+        console_printf("can't save sync state %s\n", file.c_str());
+        remove(tmp.c_str());
+        return false;
+    }
+    remove(file.c_str());
+    if (rename(tmp.c_str(), file.c_str()) != 0)
+    {
+        console_printf("can't save sync state %s\n", file.c_str());
+        return false;
+    }
+    return true;
+}
@@ -0,0 +1,52 @@
+#pragma once
+
+#include <string>
+#include <string_view>
+#include <vector>
+#include <ctime>
+#include <switch.h>
+
+#include "file_list.hpp"
+
+/// What a path looked like on both sides at the end of the previous sync
+struct TreeRecord
+{
+    std::string path;
+    bool folder;
+    u64 size;
+    time_t local_mtime;
+    time_t remote_mtime;
+    std::string checksum; // SHA1 hex, empty if unknown
+};
+
+/// What the records were made from
+struct TreeStamp
+{
+    size_t config = 0;          // Hash of the filter settings
+    std::string remote_version; // Root ETag the remote side of the records matches, empty if unknown
+};
+
+/// Aggregate of a whole subtree, Merkle style: any change below a folder
+/// changes the folder's summary. Folder mtimes are left out, they change
+/// whenever a sync writes into the folder.
+struct TreeSummary
+{
+    u32 count = 0;
+    u64 size = 0;
+    time_t max_mtime = 0;
+    size_t digest = 0; // Order independent sum of every entry's hash
+
+    void add(std::string_view path, bool folder, u64 size, time_t mtime);
+    bool operator==(const TreeSummary &other) const;
+};
+
+/// Summary of the local side of the records below the root
+TreeSummary summarize(const std::vector<TreeRecord> &records);
+/// Summary of a listing below the root
+TreeSummary summarize(const FileList &files);
+
+/// Load the records saved by the previous run. A missing or unreadable
+/// file yields an empty list, which simply disables move detection.
+std::vector<TreeRecord> load_tree_state(const std::string &file, TreeStamp *stamp = NULL);
+/// Atomically replace the saved records
+bool save_tree_state(const std::string &file, const std::vector<TreeRecord> &records, const TreeStamp &stamp = TreeStamp());
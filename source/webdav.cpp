@@ -1,19 +1,40 @@
 #include "webdav.hpp"
+#include "console.hpp"
+#include "checksum.hpp"
+#include "tree_state.hpp"
+#include "move_detect.hpp"
+#include "multistatus.hpp"
+#include "transfer_queue.hpp"
+#include "retry.hpp"
+#include "local_dir.hpp"
 
 #include <sys/stat.h>
-#include <dirent.h>
+#include <sys/statvfs.h>
 #include <regex>
+#include <map>
+#include <algorithm>
+#include <unordered_map>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <deque>
+#include <atomic>
+#include <chrono>
+#include <cassert>
+#include <unistd.h>
+#include <string.h>
 #include "curl/curl.h"
 #include "curl/easy.h"
-#include <tinyxml2.h>
 
 using namespace std;
-using namespace tinyxml2;
 
-WebDavClient::WebDavClient(string w, string l) : web_root(w), local_root(l)
+WebDavClient::WebDavClient(string w, string l) : pad(NULL), web_root(w), local_root(l), use_basic_auth(false), detect_moves(true), verify_move_hash(false), content_index(NULL), keep_versions(0), pipelined(false), quick_scan(false), confirm_policy(ConfirmPolicy::Ask), mode(SyncMode::Sync), capability_ttl(86400), bulk_limit(4 * 1024 * 1024), delta_block(0), delta_min(0), changed(false), status(NULL)
 {
     curl = curl_easy_init();
-    reset();
+    configure(curl);
+    depth_infinity.append("Depth: infinity");
+    depth_one.append("Depth: 1");
+    depth_zero.append("Depth: 0");
 }
 
 WebDavClient::~WebDavClient()
@@ -21,31 +42,176 @@ WebDavClient::~WebDavClient()
     curl_easy_cleanup(this->curl);
 }
 
-void WebDavClient::reset()
+/// Connection of the calling thread, if it opened one; see handle()
+static thread_local CURL *thread_curl = NULL;
+/// Timing of the calling thread's last request
+static thread_local RequestTiming last_timing;
+
+CURL *WebDavClient::handle()
+{
+    return thread_curl ? thread_curl : this->curl;
+}
+
+bool WebDavClient::open_thread_connection()
+{
+    thread_curl = curl_easy_init();
+    if (!thread_curl)
+    {
+        console_printf("can't initalize curl!\n");
+        return false;
+    }
+    this->configure(thread_curl);
+    return true;
+}
+
+void WebDavClient::close_thread_connection()
+{
+    curl_easy_cleanup(thread_curl);
+    thread_curl = NULL;
+}
+
+HeaderList::HeaderList() : list(NULL)
+{
+}
+
+HeaderList::~HeaderList()
+{
+    curl_slist_free_all(this->list);
+}
+
+void HeaderList::append(const string &header)
+{
+    this->list = curl_slist_append(this->list, header.c_str());
+}
+
+curl_slist *HeaderList::get() const
 {
-    curl_easy_reset(this->curl);
-    curl_easy_setopt(this->curl, CURLOPT_USERAGENT, "3DavSync 0.1.0");
-    curl_easy_setopt(this->curl, CURLOPT_CONNECTTIMEOUT, 50L);
-    curl_easy_setopt(this->curl, CURLOPT_FOLLOWLOCATION, 1L);
-    curl_easy_setopt(this->curl, CURLOPT_FAILONERROR, 1L);
-    curl_easy_setopt(this->curl, CURLOPT_NOPROGRESS, 1L);
-    curl_easy_setopt(this->curl, CURLOPT_SSL_VERIFYPEER, 0L);
-    curl_easy_setopt(this->curl, CURLOPT_PIPEWAIT, 1L);
-    // curl_easy_setopt(this->curl, CURLOPT_VERBOSE, 1L);
+    return this->list;
+}
+
+void WebDavClient::configure(CURL *handle)
+{
+    curl_easy_reset(handle);
+    curl_easy_setopt(handle, CURLOPT_USERAGENT, "3DavSync 0.1.0");
+    curl_easy_setopt(handle, CURLOPT_CONNECTTIMEOUT, this->retry.connect_timeout);
+    curl_easy_setopt(handle, CURLOPT_FOLLOWLOCATION, 1L);
+    curl_easy_setopt(handle, CURLOPT_FAILONERROR, 1L);
+    curl_easy_setopt(handle, CURLOPT_SSL_VERIFYPEER, 0L);
+    curl_easy_setopt(handle, CURLOPT_PIPEWAIT, 1L);
+    // curl_easy_setopt(handle, CURLOPT_VERBOSE, 1L);
     if (this->use_basic_auth)
     {
-        curl_easy_setopt(this->curl, CURLOPT_USERNAME, this->username.c_str());
-        curl_easy_setopt(this->curl, CURLOPT_PASSWORD, this->password.c_str());
-        curl_easy_setopt(this->curl, CURLOPT_HTTPAUTH, CURLAUTH_BASIC);
+        curl_easy_setopt(handle, CURLOPT_USERNAME, this->username.c_str());
+        curl_easy_setopt(handle, CURLOPT_PASSWORD, this->password.c_str());
+        curl_easy_setopt(handle, CURLOPT_HTTPAUTH, CURLAUTH_BASIC);
+    }
+    this->reset(handle);
+}
+
+void WebDavClient::reset()
+{
+    this->reset(this->handle());
+}
+
+void WebDavClient::reset(CURL *handle)
+{
+    // Everything any request sets, back to curl's defaults. Keep in sync with the request methods.
+    curl_easy_setopt(handle, CURLOPT_HTTPGET, 1L);
+    curl_easy_setopt(handle, CURLOPT_CUSTOMREQUEST, NULL);
+    curl_easy_setopt(handle, CURLOPT_NOBODY, 0L);
+    curl_easy_setopt(handle, CURLOPT_UPLOAD, 0L);
+    curl_easy_setopt(handle, CURLOPT_INFILESIZE_LARGE, (curl_off_t)-1);
+    curl_easy_setopt(handle, CURLOPT_POSTFIELDS, NULL);
+    curl_easy_setopt(handle, CURLOPT_HTTPHEADER, NULL);
+    curl_easy_setopt(handle, CURLOPT_ACCEPT_ENCODING, NULL);
+    curl_easy_setopt(handle, CURLOPT_WRITEFUNCTION, NULL);
+    curl_easy_setopt(handle, CURLOPT_WRITEDATA, stdout);
+    curl_easy_setopt(handle, CURLOPT_HEADERFUNCTION, NULL);
+    curl_easy_setopt(handle, CURLOPT_HEADERDATA, NULL);
+    curl_easy_setopt(handle, CURLOPT_RESUME_FROM_LARGE, (curl_off_t)0);
+    curl_easy_setopt(handle, CURLOPT_READFUNCTION, NULL);
+    curl_easy_setopt(handle, CURLOPT_READDATA, stdin);
+    curl_easy_setopt(handle, CURLOPT_SEEKFUNCTION, NULL);
+    curl_easy_setopt(handle, CURLOPT_NOPROGRESS, 1L);
+    curl_easy_setopt(handle, CURLOPT_XFERINFOFUNCTION, NULL);
+    curl_easy_setopt(handle, CURLOPT_LOW_SPEED_LIMIT, 0L);
+    curl_easy_setopt(handle, CURLOPT_LOW_SPEED_TIME, 0L);
+    // curl paces each transfer, the buckets split the budget between them. Picks up schedule changes between requests.
+    curl_easy_setopt(handle, CURLOPT_MAX_SEND_SPEED_LARGE, (curl_off_t)this->send_cap());
+    curl_easy_setopt(handle, CURLOPT_MAX_RECV_SPEED_LARGE, (curl_off_t)this->receive_cap());
+    // Sizes follow the measurements as they come in
+    this->buffers.apply(handle);
+}
+
+SyncMetrics &WebDavClient::get_metrics()
+{
+    return this->metrics;
+}
+
+/// Perform the configured request, recording how long each phase took
+/// Requests that can be sent again as they are, if whatever they write to is cleared. Others, like MOVE
+/// or DELETE, may have succeeded with only the response lost, and would fail when repeated.
+static bool idempotent(const char *verb)
+{
+    return strcmp(verb, "GET") == 0 || strcmp(verb, "HEAD") == 0 || strcmp(verb, "OPTIONS") == 0 ||
+           strcmp(verb, "PROPFIND") == 0 || strcmp(verb, "PROPPATCH") == 0;
+}
+
+CURLcode WebDavClient::perform(const char *verb, const function<bool()> &restart)
+{
+    string host = url_origin(this->web_root);
+    // Without a way to rewind, only requests that can simply be repeated are
+    bool repeatable = restart || idempotent(verb);
+    for (unsigned retry = 0;; retry++)
+    {
+        if (!circuit_allows(host, this->retry))
+        {
+            // Don't wait for yet another timeout, the host has been failing for a while
+            last_timing = RequestTiming{};
+            return CURLE_COULDNT_CONNECT;
+        }
+        CURLcode res = curl_easy_perform(this->handle());
+        last_timing = RequestTiming::from_curl(this->handle(), res == CURLE_OK);
+        this->metrics.record(verb, last_timing);
+        this->buffers.observe(last_timing);
+        PhaseTimer::sample();
+
+        bool transient = res != CURLE_OK && is_transient(res, last_timing.response_code);
+        if (circuit_record(host, !transient, this->retry))
+        {
+            console_printf(CONSOLE_RED "%s keeps failing, pausing requests to it for %us\n" CONSOLE_RESET,
+                           host.c_str(), this->retry.breaker_cooldown_ms / 1000);
+        }
+        if (!transient || !repeatable || retry >= this->retry.attempts || (restart && !restart()))
+        {
+            return res;
+        }
+        curl_off_t retry_after = 0;
+        curl_easy_getinfo(this->handle(), CURLINFO_RETRY_AFTER, &retry_after);
+        u64 delay = retry_delay_ms(this->retry, retry, retry_after);
+        if (res == CURLE_HTTP_RETURNED_ERROR)
+            console_printf(CONSOLE_YELLOW "%s: HTTP %ld, retrying in %.1fs\n" CONSOLE_RESET, verb, last_timing.response_code, delay / 1000.0);
+        else
+            console_printf(CONSOLE_YELLOW "%s: %s, retrying in %.1fs\n" CONSOLE_RESET, verb, curl_easy_strerror(res), delay / 1000.0);
+        this->metrics.record_retry(verb);
+        this_thread::sleep_for(chrono::milliseconds(delay));
     }
 }
 
+/// Explain the last failed request
+void WebDavClient::print_request_details(const string &url)
+{
+    console_printf("Location: %s\n", url.c_str());
+    console_printf("Response code: %ld\n", last_timing.response_code);
+    console_printf("Timing: %s\n", last_timing.summary().c_str());
+}
+
 void WebDavClient::set_basic_auth(std::string username, std::string password)
 {
     this->username = username;
     this->password = password;
     this->use_basic_auth = true;
-    this->reset();
+    this->configure(this->curl);
 }
 
 void WebDavClient::set_pad_state(PadState *pad)
@@ -53,7 +219,248 @@ void WebDavClient::set_pad_state(PadState *pad)
     this->pad = pad;
 }
 
-string formulate_actual_url(string &root, string &rel_path)
+/// Write the curl response to a std::string
+size_t curl_write_to_string(void *ptr, size_t size, size_t nmemb,
+                            string *s)
+{
+    s->append(static_cast<char *>(ptr), size * nmemb);
+    return size * nmemb;
+}
+
+void WebDavClient::set_state_file(std::string path)
+{
+    this->state_file = path;
+    this->block_maps.set_file(path + ".blocks");
+}
+
+void WebDavClient::set_move_detection(bool enabled, bool verify_hash)
+{
+    this->detect_moves = enabled;
+    this->verify_move_hash = verify_hash;
+}
+
+void WebDavClient::set_content_index(ContentIndex *index)
+{
+    this->content_index = index;
+}
+
+void WebDavClient::set_versioning(unsigned keep, std::string versions_path)
+{
+    while (!versions_path.empty() && versions_path.back() == '/')
+    {
+        versions_path.pop_back();
+    }
+    if (!versions_path.empty() && versions_path.front() != '/')
+    {
+        versions_path = "/" + versions_path;
+    }
+    this->keep_versions = keep;
+    this->versions_path = versions_path;
+    if (keep > 0 && !versions_path.empty())
+    {
+        // Old versions are never synced themselves. Without versioning the folder is just a folder.
+        this->filter.add_exclude(versions_path + "/");
+        this->filter_config += "\n-" + versions_path + "/";
+    }
+}
+
+void WebDavClient::set_retry_policy(RetryPolicy policy)
+{
+    this->retry = policy;
+    this->configure(this->curl);
+}
+
+void WebDavClient::set_buffer_sizes(long download, long upload, u32 socket_max)
+{
+    this->buffers.configure(download, upload, socket_max);
+    this->configure(this->curl);
+}
+
+void WebDavClient::set_transfer_lanes(TransferLanes lanes)
+{
+    // Every running transfer needs its own progress slot
+    lanes.small = max(1u, min(lanes.small, (unsigned)TransferStatus::max_files - 1));
+    lanes.large = max(1u, min(lanes.large, (unsigned)TransferStatus::max_files - lanes.small));
+    this->lanes = lanes;
+}
+
+void WebDavClient::set_pipelining(bool enabled)
+{
+    this->pipelined = enabled;
+}
+
+void WebDavClient::set_transfer_status(TransferStatus *status)
+{
+    this->status = status;
+}
+
+TransferStatus *WebDavClient::get_transfer_status()
+{
+    return this->status;
+}
+
+/// What the calling thread's transfer reports its progress to
+struct TransferMeter
+{
+    FileProgress *progress;
+    RateLimits *limits;
+    curl_off_t downloaded;
+    curl_off_t uploaded;
+};
+static thread_local TransferMeter transfer_meter;
+
+/// curl progress callback feeding a TransferStatus and the rate limits
+static int progress_callback(void *clientp, curl_off_t dltotal, curl_off_t dlnow, curl_off_t ultotal, curl_off_t ulnow)
+{
+    TransferMeter *meter = (TransferMeter *)clientp;
+    if (meter->progress)
+    {
+        meter->progress->update(dlnow + ulnow);
+    }
+    // A retry counts from 0 again
+    u64 downloaded = dlnow >= meter->downloaded ? dlnow - meter->downloaded : dlnow;
+    u64 uploaded = ulnow >= meter->uploaded ? ulnow - meter->uploaded : ulnow;
+    meter->downloaded = dlnow;
+    meter->uploaded = ulnow;
+    throttle(*meter->limits, uploaded, downloaded);
+    return 0;
+}
+
+/// The tighter of two limits, where 0 is none
+static u64 tighter(u64 a, u64 b)
+{
+    return a == 0 ? b : b == 0 ? a : min(a, b);
+}
+
+u64 WebDavClient::send_cap()
+{
+    return tighter(this->limits.upload.rate(), global_rate_limits().upload.rate());
+}
+
+u64 WebDavClient::receive_cap()
+{
+    return tighter(this->limits.download.rate(), global_rate_limits().download.rate());
+}
+
+void WebDavClient::set_rate_limits(const RateSchedule &upload, const RateSchedule &download)
+{
+    this->limits.upload.set_schedule(upload);
+    this->limits.download.set_schedule(download);
+    this->reset(this->curl);
+}
+
+/// Report the next request's progress to a file's tracker
+void WebDavClient::limit_stalls()
+{
+    // Only for file transfers: metadata requests may legitimately wait long for the server
+    if (this->retry.low_speed_limit > 0)
+    {
+        // Lanes sharing a tight limit must not look stalled. Other profiles may share the global one
+        // too, so this is a guess.
+        u64 cap = tighter(this->send_cap(), this->receive_cap());
+        long low_speed_limit = this->retry.low_speed_limit;
+        if (cap > 0)
+        {
+            low_speed_limit = min(low_speed_limit, max(1L, (long)(cap / (2 * (this->lanes.small + this->lanes.large)))));
+        }
+        curl_easy_setopt(this->handle(), CURLOPT_LOW_SPEED_LIMIT, low_speed_limit);
+        curl_easy_setopt(this->handle(), CURLOPT_LOW_SPEED_TIME, this->retry.low_speed_time);
+    }
+}
+
+void WebDavClient::track_progress(FileProgress &progress)
+{
+    this->meter(this->status ? &progress : NULL);
+}
+
+void WebDavClient::meter(FileProgress *progress)
+{
+    if (!progress && this->send_cap() == 0 && this->receive_cap() == 0)
+    {
+        return;
+    }
+    transfer_meter = TransferMeter{progress, &this->limits, 0, 0};
+    curl_easy_setopt(this->handle(), CURLOPT_NOPROGRESS, 0L);
+    curl_easy_setopt(this->handle(), CURLOPT_XFERINFOFUNCTION, progress_callback);
+    curl_easy_setopt(this->handle(), CURLOPT_XFERINFODATA, &transfer_meter);
+}
+
+void WebDavClient::set_filter(std::string includes, std::string excludes)
+{
+    this->filter.add_includes(includes);
+    this->filter.add_excludes(excludes);
+    this->filter_config += "\n+" + includes + "\n-" + excludes;
+}
+
+void WebDavClient::set_quick_scan(bool enabled)
+{
+    this->quick_scan = enabled;
+}
+
+optional<ConfirmPolicy> parse_confirm_policy(const string &name)
+{
+    if (name == "ask")
+        return ConfirmPolicy::Ask;
+    if (name == "yes")
+        return ConfirmPolicy::Yes;
+    if (name == "no")
+        return ConfirmPolicy::No;
+    return nullopt;
+}
+
+void WebDavClient::set_confirm_policy(ConfirmPolicy policy)
+{
+    this->confirm_policy = policy;
+}
+
+optional<SyncMode> parse_sync_mode(const string &name)
+{
+    if (name == "sync")
+        return SyncMode::Sync;
+    if (name == "archive")
+        return SyncMode::Archive;
+    if (name == "restore")
+        return SyncMode::Restore;
+    return nullopt;
+}
+
+void WebDavClient::set_mode(SyncMode mode, std::string archive_name)
+{
+    this->mode = mode;
+    this->archive_name = archive_name;
+}
+
+void WebDavClient::set_capability_ttl(time_t ttl)
+{
+    this->capability_ttl = ttl;
+}
+
+void WebDavClient::set_bulk_upload(u64 batch_bytes)
+{
+    this->bulk_limit = batch_bytes;
+}
+
+/// Where delta uploads assemble the new version before it replaces the old one
+static const char *delta_staging = "/.nxdelta";
+
+void WebDavClient::set_delta_upload(u32 block_size, u64 min_size)
+{
+    this->delta_block = block_size;
+    this->delta_min = min_size;
+    if (block_size > 0)
+    {
+        // Leftovers of interrupted uploads must not be synced
+        this->filter.add_exclude(string(delta_staging) + "/");
+        this->filter_config += "\n-" + string(delta_staging) + "/";
+    }
+}
+
+bool WebDavClient::last_sync_changed() const
+{
+    return this->changed;
+}
+
+string formulate_actual_url(const string &root, const string &rel_path)
 {
     if (!rel_path.empty())
     {
@@ -72,9 +479,9 @@ bool WebDavClient::mkcol(string web_rel_path, optional<u64> mtime)
 {
     string actual_url = formulate_actual_url(this->web_root, web_rel_path);
     // Test if directory existed already
-    curl_easy_setopt(this->curl, CURLOPT_URL, actual_url.c_str());
-    curl_easy_setopt(this->curl, CURLOPT_NOBODY, 1L);
-    CURLcode head_res = curl_easy_perform(this->curl);
+    curl_easy_setopt(this->handle(), CURLOPT_URL, actual_url.c_str());
+    curl_easy_setopt(this->handle(), CURLOPT_NOBODY, 1L);
+    CURLcode head_res = this->perform("HEAD");
     if (head_res == CURLE_OK)
     {
         this->reset();
@@ -82,26 +489,20 @@ bool WebDavClient::mkcol(string web_rel_path, optional<u64> mtime)
     }
 
     this->reset();
-    curl_easy_setopt(this->curl, CURLOPT_CUSTOMREQUEST, "MKCOL");
-    curl_easy_setopt(this->curl, CURLOPT_URL, actual_url.c_str());
-    if (mtime)
+    curl_easy_setopt(this->handle(), CURLOPT_CUSTOMREQUEST, "MKCOL");
+    curl_easy_setopt(this->handle(), CURLOPT_URL, actual_url.c_str());
+    HeaderList headers;
+    if (mtime && this->caps.oc_properties)
     {
-        u64 actual_mtime = mtime.value();
-        struct curl_slist *list = NULL;
-        string oc_mtime = string("X-OC-Mtime: " + to_string(actual_mtime)).c_str();
-        list = curl_slist_append(list, oc_mtime.c_str());
-        curl_easy_setopt(this->curl, CURLOPT_HTTPHEADER, list);
+        headers.append("X-OC-Mtime: " + to_string(mtime.value()));
+        curl_easy_setopt(this->handle(), CURLOPT_HTTPHEADER, headers.get());
     }
 
-    CURLcode curl_res = curl_easy_perform(this->curl);
+    CURLcode curl_res = this->perform("MKCOL");
     if (curl_res != CURLE_OK)
     {
-        long response_code;
-        curl_easy_getinfo(this->curl, CURLINFO_RESPONSE_CODE, &response_code);
-        printf("curl MKCOL failed: %s (%d)\n", curl_easy_strerror(curl_res), curl_res);
-        printf("Location: %s\n", actual_url.c_str());
-        printf("Response code: %ld\n", response_code);
-        consoleUpdate(NULL);
+        console_printf("curl MKCOL failed: %s (%d)\n", curl_easy_strerror(curl_res), curl_res);
+        this->print_request_details(actual_url);
         this->reset();
         return false;
     }
@@ -112,44 +513,129 @@ bool WebDavClient::mkcol(string web_rel_path, optional<u64> mtime)
     }
 }
 
-bool WebDavClient::pull(string path, string web_rel_path)
+bool WebDavClient::relocate(const char *verb, string from_url, string to_url, bool overwrite)
+{
+    curl_easy_setopt(this->handle(), CURLOPT_CUSTOMREQUEST, verb);
+    curl_easy_setopt(this->handle(), CURLOPT_URL, from_url.c_str());
+    HeaderList headers;
+    headers.append("Destination: " + to_url);
+    headers.append(overwrite ? "Overwrite: T" : "Overwrite: F");
+    curl_easy_setopt(this->handle(), CURLOPT_HTTPHEADER, headers.get());
+
+    CURLcode curl_res = this->perform(verb);
+    if (curl_res != CURLE_OK)
+    {
+        console_printf("curl %s failed: %s (%d)\n", verb, curl_easy_strerror(curl_res), curl_res);
+        this->print_request_details(from_url);
+        this->reset();
+        return false;
+    }
+    this->reset();
+    return true;
+}
+
+bool WebDavClient::move(string from_web_rel_path, string to_web_rel_path)
+{
+    // Never clobber something that appeared at the destination meanwhile
+    return this->relocate("MOVE", formulate_actual_url(this->web_root, from_web_rel_path),
+                          formulate_actual_url(this->web_root, to_web_rel_path), false);
+}
+
+bool WebDavClient::copy(string from_url, string to_web_rel_path, bool overwrite)
+{
+    return this->relocate("COPY", from_url, formulate_actual_url(this->web_root, to_web_rel_path), overwrite);
+}
+
+bool WebDavClient::remove(string web_rel_path)
+{
+    string actual_url = formulate_actual_url(this->web_root, web_rel_path);
+    curl_easy_setopt(this->handle(), CURLOPT_URL, actual_url.c_str());
+    curl_easy_setopt(this->handle(), CURLOPT_CUSTOMREQUEST, "DELETE");
+    CURLcode curl_res = this->perform("DELETE");
+    if (curl_res != CURLE_OK)
+    {
+        console_printf("curl DELETE failed: %s (%d)\n", curl_easy_strerror(curl_res), curl_res);
+        this->print_request_details(actual_url);
+        this->reset();
+        return false;
+    }
+    this->reset();
+    return true;
+}
+
+bool WebDavClient::set_remote_mtime(string web_rel_path, u64 mtime)
+{
+    // Nextcloud/ownCloud accept a unix timestamp for DAV:lastmodified
+    string body = "<?xml version=\"1.0\"?>\n"
+                  "<d:propertyupdate xmlns:d=\"DAV:\"><d:set><d:prop><d:lastmodified>" +
+                  to_string(mtime) +
+                  "</d:lastmodified></d:prop></d:set></d:propertyupdate>";
+    string actual_url = formulate_actual_url(this->web_root, web_rel_path);
+    string response;
+    curl_easy_setopt(this->handle(), CURLOPT_URL, actual_url.c_str());
+    curl_easy_setopt(this->handle(), CURLOPT_CUSTOMREQUEST, "PROPPATCH");
+    curl_easy_setopt(this->handle(), CURLOPT_ACCEPT_ENCODING, "");
+    curl_easy_setopt(this->handle(), CURLOPT_POSTFIELDS, body.c_str());
+    curl_easy_setopt(this->handle(), CURLOPT_WRITEFUNCTION, curl_write_to_string);
+    curl_easy_setopt(this->handle(), CURLOPT_WRITEDATA, &response);
+    CURLcode curl_res = this->perform("PROPPATCH", [&]()
+                                      {
+                                          response.clear();
+                                          return true;
+                                      });
+    this->reset();
+    return curl_res == CURLE_OK;
+}
+
+bool WebDavClient::pull(string path, string web_rel_path, u64 size)
 {
     const char *c_path = path.c_str();
-    if (this->curl)
+    if (this->handle())
     {
         // Formulate and fill actual url
         string actual_url = formulate_actual_url(this->web_root, web_rel_path);
-        curl_easy_setopt(curl, CURLOPT_URL, actual_url.c_str());
+        curl_easy_setopt(this->handle(), CURLOPT_URL, actual_url.c_str());
 
         // Open a file at that path, overwrite if exists
         FILE *fp = fopen(c_path, "w");
         if (fp)
         {
-            curl_easy_setopt(this->curl, CURLOPT_WRITEDATA, fp);
-            CURLcode res = curl_easy_perform(curl);
+            curl_easy_setopt(this->handle(), CURLOPT_WRITEDATA, fp);
+            FileProgress progress(this->status, web_rel_path, size);
+            this->track_progress(progress);
+            this->limit_stalls();
+            // A retry continues where the last attempt stopped if the server
+            // serves ranges, otherwise it starts over with an empty file
+            CURLcode res = this->perform("GET", [&]()
+                                         {
+                                             fflush(fp);
+                                             if (this->caps.ranges)
+                                             {
+                                                 long offset = ftell(fp);
+                                                 curl_easy_setopt(this->handle(), CURLOPT_RESUME_FROM_LARGE, (curl_off_t)offset);
+                                                 progress.restart_at(offset);
+                                                 return offset >= 0;
+                                             }
+                                             progress.restart_at(0);
+                                             return ftruncate(fileno(fp), 0) == 0 && fseek(fp, 0, SEEK_SET) == 0;
+                                         });
             fclose(fp);
             if (res != 0)
             {
-                long response_code;
-                curl_easy_getinfo(this->curl, CURLINFO_RESPONSE_CODE, &response_code);
-                printf("error getting file %s: %s\n", c_path, curl_easy_strerror(res));
-                printf("Location: %s\n", actual_url.c_str());
-                printf("Response code: %ld\n", response_code);
-                consoleUpdate(NULL);
+                console_printf("error getting file %s: %s\n", c_path, curl_easy_strerror(res));
+                this->print_request_details(actual_url);
                 this->reset();
                 return false;
             }
         }
         else
         {
-            printf("can't open %s for writing: %s\n", c_path, strerror(errno));
-            consoleUpdate(NULL);
+            console_printf("can't open %s for writing: %s\n", c_path, strerror(errno));
         }
     }
     else
     {
-        printf("can't initalize curl!\n");
-        consoleUpdate(NULL);
+        console_printf("can't initalize curl!\n");
     }
     this->reset();
     return true;
@@ -166,14 +652,14 @@ static int seek_helper(void *userp, curl_off_t offset, int origin)
     return CURL_SEEKFUNC_OK; /* success! */
 }
 
-bool WebDavClient::push(string path, string web_rel_path)
+bool WebDavClient::push(string path, string web_rel_path, string checksum, bool create_only)
 {
     const char *c_path = path.c_str();
-    if (this->curl)
+    if (this->handle())
     {
         // Formulate and fill actual url
         string actual_url = formulate_actual_url(this->web_root, web_rel_path);
-        curl_easy_setopt(curl, CURLOPT_URL, actual_url.c_str());
+        curl_easy_setopt(this->handle(), CURLOPT_URL, actual_url.c_str());
 
         // Open a file at that path to read
         FILE *fp = fopen(c_path, "r");
@@ -183,8 +669,8 @@ bool WebDavClient::push(string path, string web_rel_path)
             struct stat file_info;
             fstat(fileno(fp), &file_info);
             // Set curl reading stuff
-            curl_easy_setopt(this->curl, CURLOPT_READDATA, fp);
-            curl_easy_setopt(this->curl, CURLOPT_SEEKFUNCTION, seek_helper);
+            curl_easy_setopt(this->handle(), CURLOPT_READDATA, fp);
+            curl_easy_setopt(this->handle(), CURLOPT_SEEKFUNCTION, seek_helper);
             // Prepare the headers
             // For Nextcloud/ownCloud, we can ask the server to use our mtime
             u64 mtime;
@@ -192,87 +678,66 @@ bool WebDavClient::push(string path, string web_rel_path)
             stat(path.c_str(), &attr);
             mtime = attr.st_mtime;
 
-            struct curl_slist *list = NULL;
-            string t = string("X-OC-Mtime: " + to_string(mtime)).c_str();
-            list = curl_slist_append(list, t.c_str());
-            curl_easy_setopt(this->curl, CURLOPT_HTTPHEADER, list);
+            HeaderList headers;
+            if (this->caps.oc_properties)
+            {
+                headers.append("X-OC-Mtime: " + to_string(mtime));
+            }
+            if (!checksum.empty() && this->caps.oc_properties)
+            {
+                // Lets the server report it in oc:checksums for later deduplication
+                headers.append("OC-Checksum: SHA1:" + checksum);
+            }
+            if (create_only)
+            {
+                // 412 if anything exists at this URL
+                headers.append("If-None-Match: *");
+            }
+            curl_easy_setopt(this->handle(), CURLOPT_HTTPHEADER, headers.get());
             // We are uploading!
-            curl_easy_setopt(this->curl, CURLOPT_UPLOAD, 1L);
-            curl_easy_setopt(this->curl, CURLOPT_INFILESIZE, (curl_off_t)file_info.st_size);
-            CURLcode res = curl_easy_perform(curl);
+            curl_easy_setopt(this->handle(), CURLOPT_UPLOAD, 1L);
+            curl_easy_setopt(this->handle(), CURLOPT_INFILESIZE_LARGE, (curl_off_t)file_info.st_size);
+            FileProgress progress(this->status, web_rel_path, file_info.st_size);
+            this->track_progress(progress);
+            this->limit_stalls();
+            CURLcode res = this->perform("PUT", [&]()
+                                         {
+                                             progress.update(0);
+                                             return fseek(fp, 0, SEEK_SET) == 0;
+                                         });
             fclose(fp);
             if (res != CURLE_OK)
             {
-                long response_code;
-                curl_easy_getinfo(this->curl, CURLINFO_RESPONSE_CODE, &response_code);
-                printf("error pushing file %s: %s\n", c_path, curl_easy_strerror(res));
-                printf("Location: %s\n", actual_url.c_str());
-                printf("Response code: %ld\n", response_code);
-                consoleUpdate(NULL);
+                // A refused create-only upload is an expected outcome, not an error
+                if (!create_only || last_timing.response_code != 412)
+                {
+                    console_printf("error pushing file %s: %s\n", c_path, curl_easy_strerror(res));
+                    this->print_request_details(actual_url);
+                }
                 this->reset();
                 return false;
             }
+            if (!this->caps.oc_properties)
+            {
+                // X-OC-Mtime isn't understood here, try the standard property instead
+                this->reset();
+                this->set_remote_mtime(web_rel_path, mtime);
+            }
         }
         else
         {
-            printf("can't open %s for writing: %s\n", c_path, strerror(errno));
-            consoleUpdate(NULL);
+            console_printf("can't open %s for writing: %s\n", c_path, strerror(errno));
         }
     }
     else
     {
-        printf("can't initalize curl!\n");
-        consoleUpdate(NULL);
+        console_printf("can't initalize curl!\n");
     }
 
     this->reset();
     return true;
 }
 
-/// Write the curl response to a std::string
-size_t curl_write_to_string(void *ptr, size_t size, size_t nmemb,
-                            string *s)
-{
-    s->append(static_cast<char *>(ptr), size * nmemb);
-    return size * nmemb;
-}
-
-optional<vector<FileEntry>> normalize_filelist(optional<vector<FileEntry>> i)
-{
-    if (i)
-    {
-        auto files = i.value();
-        if (files.empty())
-        {
-            return nullopt;
-        }
-        else if (files.size() == 1)
-        {
-            // Only contains the root directory, we don't care about that
-            files.erase(files.begin());
-        }
-        else if (files.size() > 1)
-        {
-            // Seems to be a query on collection
-            // Get root first
-            if (files[0].path.back() == '/')
-            {
-                string root = files[0].path.c_str();
-                root.pop_back();
-                for (FileEntry &file : files)
-                {
-                    file.path.erase(0, root.length());
-                }
-            }
-        }
-        return files;
-    }
-    else
-    {
-        return nullopt;
-    }
-}
-
 const char *query = R"(<?xml version="1.0"?>
 <d:propfind  xmlns:d="DAV:" xmlns:oc="http://owncloud.org/ns" xmlns:nc="http://nextcloud.org/ns">
  <d:prop>
@@ -283,197 +748,1492 @@ const char *query = R"(<?xml version="1.0"?>
  </d:prop>
 </d:propfind>)";
 
-/// Read the timestamp from WebDAV server
-optional<vector<FileEntry>> WebDavClient::get_remote_files()
+// For servers without ownCloud properties. Unknown ones would come back in a second propstat.
+const char *plain_query = R"(<?xml version="1.0"?>
+<d:propfind  xmlns:d="DAV:">
+ <d:prop>
+  <d:getlastmodified />
+  <d:getcontentlength />
+  <d:resourcetype />
+ </d:prop>
+</d:propfind>)";
+
+const char *quota_query = R"(<?xml version="1.0"?>
+<d:propfind xmlns:d="DAV:">
+ <d:prop>
+  <d:quota-available-bytes />
+ </d:prop>
+</d:propfind>)";
+
+optional<u64> WebDavClient::remote_free_space()
 {
+    string response;
+    curl_easy_setopt(this->handle(), CURLOPT_URL, this->web_root.c_str());
+    curl_easy_setopt(this->handle(), CURLOPT_CUSTOMREQUEST, "PROPFIND");
+    curl_easy_setopt(this->handle(), CURLOPT_POSTFIELDS, quota_query);
+    curl_easy_setopt(this->handle(), CURLOPT_HTTPHEADER, this->depth_zero.get());
+    curl_easy_setopt(this->handle(), CURLOPT_WRITEFUNCTION, curl_write_to_string);
+    curl_easy_setopt(this->handle(), CURLOPT_WRITEDATA, &response);
+    CURLcode curl_res = this->perform("PROPFIND", [&]()
+                                      {
+                                          response.clear();
+                                          return true;
+                                      });
+    this->reset();
+    tinyxml2::XMLDocument doc;
+    if (curl_res != CURLE_OK || doc.Parse(response.data(), response.size()) != tinyxml2::XML_SUCCESS || !doc.RootElement())
+    {
+        return nullopt;
+    }
+    tinyxml2::XMLElement *response_element = doc.RootElement()->FirstChildElement("d:response");
+    for (tinyxml2::XMLElement *propstat = response_element ? response_element->FirstChildElement("d:propstat") : NULL; propstat;
+         propstat = propstat->NextSiblingElement("d:propstat"))
+    {
+        tinyxml2::XMLElement *prop = propstat->FirstChildElement("d:prop");
+        tinyxml2::XMLElement *quota = prop ? prop->FirstChildElement("d:quota-available-bytes") : NULL;
+        if (quota && quota->GetText())
+        {
+            // Nextcloud reports unlimited and unknown quotas as negative numbers
+            long long available = strtoll(quota->GetText(), NULL, 10);
+            return available >= 0 ? optional<u64>(available) : nullopt;
+        }
+    }
+    return nullopt;
+}
+
+/// Free bytes on the filesystem holding `path`, nullopt if unknown
+static optional<u64> local_free_space(const string &path)
+{
+    struct statvfs fs;
+    if (statvfs(path.c_str(), &fs) != 0)
+    {
+        return nullopt;
+    }
+    return (u64)fs.f_bavail * fs.f_frsize;
+}
+
+/// Keep as many transfers as fit into `budget`, smallest first, so many small
+/// files (saves) win over a few big ones (ROMs). Marks the rest in `dropped`.
+static void fit_side(const vector<u64> &growth, const vector<size_t> &side, u64 budget, vector<bool> &dropped)
+{
+    vector<size_t> order = side;
+    stable_sort(order.begin(), order.end(), [&](size_t a, size_t b)
+                {
+                    return growth[a] < growth[b];
+                });
+    u64 used = 0;
+    for (size_t i : order)
+    {
+        if (used + growth[i] <= budget)
+            used += growth[i];
+        else
+            dropped[i] = true;
+    }
+}
+
+void WebDavClient::fit_transfers(vector<TransferJob> &transfers, vector<QueuedOp> &ops)
+{
+    // How much each transfer adds on its receiving side
+    vector<u64> growth(ops.size());
+    vector<size_t> uploads, downloads;
+    u64 upload_volume = 0, download_volume = 0;
+    for (size_t i = 0; i < ops.size(); i++)
+    {
+        const QueuedOp &op = ops[i];
+        if (op.kind == QueuedOp::Download)
+        {
+            struct stat attr;
+            u64 existing = stat((this->local_root + op.path).c_str(), &attr) == 0 ? attr.st_size : 0;
+            growth[i] = op.size > existing ? op.size - existing : 0;
+            downloads.push_back(i);
+            download_volume += growth[i];
+        }
+        else
+        {
+            // Kept versions still count against the quota
+            u64 freed = op.kind == QueuedOp::Replace && this->keep_versions == 0 ? op.remote_size : 0;
+            growth[i] = op.size > freed ? op.size - freed : 0;
+            uploads.push_back(i);
+            upload_volume += growth[i];
+        }
+    }
+
+    vector<bool> dropped(ops.size(), false);
+    optional<u64> remote_free = upload_volume ? this->remote_free_space() : nullopt;
+    if (remote_free && upload_volume > remote_free.value())
+    {
+        console_printf(CONSOLE_RED "Uploads need %s but the server quota only has %s left.\n" CONSOLE_RESET,
+                       format_bytes(upload_volume).c_str(), format_bytes(remote_free.value()).c_str());
+        fit_side(growth, uploads, remote_free.value(), dropped);
+    }
+    // Leave some room for the filesystem itself
+    const u64 reserve = 16 << 20;
+    optional<u64> local_free = download_volume ? local_free_space(this->local_root) : nullopt;
+    if (local_free && download_volume + reserve > local_free.value())
+    {
+        u64 budget = local_free.value() > reserve ? local_free.value() - reserve : 0;
+        console_printf(CONSOLE_RED "Downloads need %s but the SD card only has %s free.\n" CONSOLE_RESET,
+                       format_bytes(download_volume).c_str(), format_bytes(budget).c_str());
+        fit_side(growth, downloads, budget, dropped);
+    }
+
+    if (find(dropped.begin(), dropped.end(), true) == dropped.end())
+    {
+        return;
+    }
+    size_t kept = 0;
+    for (size_t i = 0; i < ops.size(); i++)
+    {
+        if (dropped[i])
+        {
+            console_printf(CONSOLE_RED "%s: not enough space, skipped.\n" CONSOLE_RESET, ops[i].path.c_str());
+            continue;
+        }
+        // Moving onto itself would leave the strings empty
+        if (kept != i)
+        {
+            transfers[kept] = std::move(transfers[i]);
+            ops[kept] = std::move(ops[i]);
+        }
+        // The queue journal and bulk uploads go by these paths
+        assert(!ops[kept].path.empty() && !transfers[kept].path.empty());
+        kept++;
+    }
+    transfers.resize(kept);
+    ops.resize(kept);
+}
+
+const char *capability_query = R"(<?xml version="1.0"?>
+<d:propfind xmlns:d="DAV:" xmlns:oc="http://owncloud.org/ns">
+ <d:prop>
+  <oc:fileid />
+  <d:supported-report-set />
+ </d:prop>
+</d:propfind>)";
+
+void WebDavClient::discover_capabilities()
+{
+    string file = this->state_file.empty() ? "" : this->state_file + ".caps";
+    if (!file.empty() && this->capability_ttl > 0)
+    {
+        optional<ServerCapabilities> cached = load_capabilities(file, this->capability_ttl);
+        if (cached)
+        {
+            this->caps = cached.value();
+            return;
+        }
+    }
+
+    ServerCapabilities caps;
+    string headers, body;
+    curl_easy_setopt(this->handle(), CURLOPT_URL, this->web_root.c_str());
+    curl_easy_setopt(this->handle(), CURLOPT_CUSTOMREQUEST, "OPTIONS");
+    curl_easy_setopt(this->handle(), CURLOPT_HEADERFUNCTION, curl_write_to_string);
+    curl_easy_setopt(this->handle(), CURLOPT_HEADERDATA, &headers);
+    curl_easy_setopt(this->handle(), CURLOPT_WRITEFUNCTION, curl_write_to_string);
+    curl_easy_setopt(this->handle(), CURLOPT_WRITEDATA, &body);
+    bool reachable = this->perform("OPTIONS", [&]()
+                                   {
+                                       headers.clear();
+                                       body.clear();
+                                       return true;
+                                   }) == CURLE_OK;
+    // Without a listing the server's properties are unknown, then nothing is cached
+    bool listed = false;
+    if (reachable)
+    {
+        long version = 0;
+        curl_easy_getinfo(this->handle(), CURLINFO_HTTP_VERSION, &version);
+        caps.http2 = version >= CURL_HTTP_VERSION_2_0;
+        transform(headers.begin(), headers.end(), headers.begin(), ::tolower);
+        caps.ranges = headers.find("accept-ranges: bytes") != string::npos;
+        // Listed in the DAV header along with the compliance classes
+        caps.partial_update = headers.find("sabredav-partialupdate") != string::npos;
+    }
+    this->reset();
+
+    body.clear();
+    curl_easy_setopt(this->handle(), CURLOPT_URL, this->web_root.c_str());
+    curl_easy_setopt(this->handle(), CURLOPT_CUSTOMREQUEST, "PROPFIND");
+    curl_easy_setopt(this->handle(), CURLOPT_POSTFIELDS, capability_query);
+    curl_easy_setopt(this->handle(), CURLOPT_HTTPHEADER, this->depth_zero.get());
+    curl_easy_setopt(this->handle(), CURLOPT_WRITEFUNCTION, curl_write_to_string);
+    curl_easy_setopt(this->handle(), CURLOPT_WRITEDATA, &body);
+    if (this->perform("PROPFIND", [&]()
+                      {
+                          body.clear();
+                          return true;
+                      }) == CURLE_OK)
+    {
+        reachable = true;
+        listed = true;
+        caps.oc_properties = false;
+        tinyxml2::XMLDocument doc;
+        tinyxml2::XMLElement *response = doc.Parse(body.data(), body.size()) == tinyxml2::XML_SUCCESS && doc.RootElement()
+                                             ? doc.RootElement()->FirstChildElement("d:response")
+                                             : NULL;
+        for (tinyxml2::XMLElement *propstat = response ? response->FirstChildElement("d:propstat") : NULL; propstat;
+             propstat = propstat->NextSiblingElement("d:propstat"))
+        {
+            // Unsupported properties are listed too, under a 404 status
+            tinyxml2::XMLElement *status = propstat->FirstChildElement("d:status");
+            tinyxml2::XMLElement *prop = propstat->FirstChildElement("d:prop");
+            if (!status || !status->GetText() || !strstr(status->GetText(), " 200") || !prop)
+                continue;
+            caps.oc_properties = caps.oc_properties || prop->FirstChildElement("oc:fileid");
+        }
+        // Only a supported report set names any report, unsupported properties come back empty
+        caps.sync_collection = body.find("sync-collection") != string::npos;
+        // SabreDAV, which both are built on, serves ranges on files even if OPTIONS doesn't say so
+        caps.ranges = caps.ranges || caps.oc_properties;
+    }
+    this->reset();
+
+    optional<BulkEndpoint> bulk = bulk_endpoint(this->web_root);
+    if (caps.oc_properties && bulk)
+    {
+        // Only Nextcloud's capability list tells whether the endpoint exists
+        body.clear();
+        HeaderList ocs;
+        ocs.append("OCS-APIRequest: true");
+        curl_easy_setopt(this->handle(), CURLOPT_URL, bulk->capabilities.c_str());
+        curl_easy_setopt(this->handle(), CURLOPT_HTTPHEADER, ocs.get());
+        curl_easy_setopt(this->handle(), CURLOPT_WRITEFUNCTION, curl_write_to_string);
+        curl_easy_setopt(this->handle(), CURLOPT_WRITEDATA, &body);
+        if (this->perform("GET", [&]()
+                          {
+                              body.clear();
+                              return true;
+                          }) == CURLE_OK)
+        {
+            caps.bulk_upload = body.find("\"bulkupload\"") != string::npos;
+        }
+        this->reset();
+    }
+
+    if (!reachable)
+    {
+        // Assume the usual until the server can be asked
+        return;
+    }
+    caps.probed = time(NULL);
+    this->caps = caps;
+    console_printf("Server: %s\n", caps.summary().c_str());
+    if (!file.empty() && listed)
+    {
+        save_capabilities(file, caps);
+    }
+}
+
+/// Read the timestamp from WebDAV server
+optional<FileList> WebDavClient::get_remote_files()
+{
+    if (this->caps.infinite_depth)
+    {
+        optional<FileList> files = this->propfind(this->web_root, "infinity", &this->filter);
+        if (files || last_timing.response_code != 403)
+        {
+            return files;
+        }
+        // RFC 4918 lets servers refuse infinite depth with a 403
+        console_printf("Server refuses Depth: infinity, listing folder by folder.\n");
+        this->caps.infinite_depth = false;
+        if (!this->state_file.empty())
+        {
+            save_capabilities(this->state_file + ".caps", this->caps);
+        }
+    }
+    return this->list_by_folder();
+}
+
+optional<FileList> WebDavClient::list_by_folder()
+{
+    FileList files;
+    vector<string> folders{"/"};
+    while (!folders.empty())
+    {
+        string dir = std::move(folders.back());
+        folders.pop_back();
+        optional<FileList> level = this->propfind(dir == "/" ? this->web_root : formulate_actual_url(this->web_root, dir), "1");
+        if (!level)
+        {
+            return nullopt;
+        }
+        if (dir == "/")
+        {
+            files.set_mtime(FileList::root, (*level)[FileList::root].mtime);
+        }
+        // Parents are listed before their contents, keeping the listing parent-first
+        for (u32 i = FileList::root + 1; i < level->size(); i++)
+        {
+            string path = dir + level->path(i).substr(1);
+            bool folder = level->folder(i);
+            if (this->filter.skip_tree(path, folder))
+                continue;
+            u32 j = files.add_path(path, folder, (*level)[i].size, (*level)[i].mtime);
+            if (!level->checksum(i).empty())
+                files.set_checksum(j, level->checksum(i));
+            if (folder)
+                folders.push_back(path);
+        }
+    }
+    return files;
+}
+
+const char *version_query = R"(<?xml version="1.0"?>
+<d:propfind xmlns:d="DAV:">
+ <d:prop>
+  <d:getetag />
+  <d:getlastmodified />
+ </d:prop>
+</d:propfind>)";
+
+optional<string> WebDavClient::root_version()
+{
+    string response;
+    curl_easy_setopt(this->handle(), CURLOPT_URL, this->web_root.c_str());
+    curl_easy_setopt(this->handle(), CURLOPT_CUSTOMREQUEST, "PROPFIND");
+    curl_easy_setopt(this->handle(), CURLOPT_POSTFIELDS, version_query);
+    curl_easy_setopt(this->handle(), CURLOPT_HTTPHEADER, this->depth_zero.get());
+    curl_easy_setopt(this->handle(), CURLOPT_WRITEFUNCTION, curl_write_to_string);
+    curl_easy_setopt(this->handle(), CURLOPT_WRITEDATA, &response);
+    CURLcode curl_res = this->perform("PROPFIND", [&]()
+                                      {
+                                          response.clear();
+                                          return true;
+                                      });
+    this->reset();
+    if (curl_res != CURLE_OK)
+    {
+        return nullopt;
+    }
+    tinyxml2::XMLDocument doc;
+    if (doc.Parse(response.data(), response.size()) != tinyxml2::XML_SUCCESS || !doc.RootElement())
+    {
+        return nullopt;
+    }
+    tinyxml2::XMLElement *prop = doc.RootElement()->FirstChildElement("d:response");
+    prop = prop ? prop->FirstChildElement("d:propstat") : NULL;
+    prop = prop ? prop->FirstChildElement("d:prop") : NULL;
+    if (!prop)
+    {
+        return nullopt;
+    }
+    for (const char *name : {"d:getetag", "d:getlastmodified"})
+    {
+        // Nextcloud and ownCloud propagate both up to the root on every change
+        tinyxml2::XMLElement *e = prop->FirstChildElement(name);
+        if (e && e->GetText() && *e->GetText())
+        {
+            return string(e->GetText());
+        }
+    }
+    return nullopt;
+}
+
+optional<FileList> WebDavClient::propfind(string url, const char *depth, PathFilter *filter, MultistatusParser::Callback on_entry)
+{
+    CURL *handle = this->handle();
     // Use PROPFIND to fetch file metadata
-    if (this->curl)
+    if (handle)
     {
-        string response = "";
+        MultistatusParser parser(handle, filter, on_entry);
         // Formulate and fill url
-        curl_easy_setopt(curl, CURLOPT_URL, this->web_root.c_str());
-        // Read XML content
-        curl_easy_setopt(this->curl, CURLOPT_CUSTOMREQUEST, "PROPFIND");
-        curl_easy_setopt(this->curl, CURLOPT_WRITEFUNCTION, curl_write_to_string);
-        curl_easy_setopt(this->curl, CURLOPT_WRITEDATA, &response);
-        curl_easy_setopt(this->curl, CURLOPT_POSTFIELDS, query);
-        struct curl_slist *list = NULL;
-        list = curl_slist_append(list, "Depth: infinity");
-        curl_easy_setopt(this->curl, CURLOPT_HTTPHEADER, list);
-
-        CURLcode curl_res = curl_easy_perform(this->curl);
+        curl_easy_setopt(handle, CURLOPT_URL, url.c_str());
+        // Listings are verbose XML, let the server compress them; curl inflates before the parser sees it
+        curl_easy_setopt(handle, CURLOPT_ACCEPT_ENCODING, "");
+        curl_easy_setopt(handle, CURLOPT_CUSTOMREQUEST, "PROPFIND");
+        // Parse while receiving
+        curl_easy_setopt(handle, CURLOPT_WRITEFUNCTION, MultistatusParser::write_callback);
+        curl_easy_setopt(handle, CURLOPT_WRITEDATA, &parser);
+        curl_easy_setopt(handle, CURLOPT_POSTFIELDS, this->caps.oc_properties ? query : plain_query);
+        const HeaderList &headers = strcmp(depth, "0") == 0 ? this->depth_zero : strcmp(depth, "1") == 0 ? this->depth_one : this->depth_infinity;
+        curl_easy_setopt(handle, CURLOPT_HTTPHEADER, headers.get());
+
+        CURLcode curl_res = this->perform("PROPFIND", [&]()
+                                          {
+                                              return parser.restart();
+                                          });
+        this->reset(handle);
+        if (parser.failed())
+        {
+            // Already explained by the parser
+            return nullopt;
+        }
         if (curl_res != CURLE_OK)
         {
-            long response_code;
-            curl_easy_getinfo(this->curl, CURLINFO_RESPONSE_CODE, &response_code);
-            printf("curl PROPFIND failed: %s (%d)\n", curl_easy_strerror(curl_res), curl_res);
-            printf("Response code: %ld\n", response_code);
-            consoleUpdate(NULL);
-            this->reset();
-            return nullopt;
+            console_printf("curl PROPFIND failed: %s (%d)\n", curl_easy_strerror(curl_res), curl_res);
+            this->print_request_details(url);
+            return nullopt;
+        }
+        return parser.finish();
+    }
+    else
+    {
+        console_printf("can't initalize curl!\n");
+        return nullopt;
+    }
+}
+
+/// Copy the subtree of an unchanged folder from the last sync's records, sorted by path
+static bool reuse_subtree(const vector<TreeRecord> &previous, const string &folder, time_t mtime, FileList &out)
+{
+    auto it = lower_bound(previous.begin(), previous.end(), folder, [](const TreeRecord &r, const string &path)
+                          {
+                              return r.path < path;
+                          });
+    if (it == previous.end() || it->path != folder || !it->folder || it->local_mtime != mtime)
+    {
+        return false;
+    }
+    // Everything below shares the prefix, so it follows directly
+    for (++it; it != previous.end() && it->path.compare(0, folder.size(), folder) == 0; ++it)
+    {
+        out.add_path(it->path, it->folder, it->size, it->local_mtime);
+    }
+    return true;
+}
+
+static void scan_dir(const PathFilter &filter, const string &base_path, FileList &out, u32 parent, string &rel_path,
+                     const vector<TreeRecord> *previous)
+{
+    LocalDir dir(base_path + rel_path);
+    if (!dir.is_open())
+    {
+        return;
+    }
+    PhaseTimer::sample();
+    LocalDir::Entry *ent;
+    while ((ent = dir.next()) != NULL)
+    {
+        // One path buffer for the whole walk, each level appends and truncates its part
+        size_t len = rel_path.size();
+        rel_path += '/';
+        rel_path += ent->name;
+        // Prune before touching the entry, skipped folders are never opened
+        bool folder = ent->folder;
+        if (folder)
+            rel_path += '/';
+        if (!filter.skip(rel_path, folder))
+        {
+            if (folder)
+                rel_path.pop_back();
+            if (dir.details(*ent))
+            {
+                if (!ent->folder)
+                {
+                    out.add(parent, ent->name, false, ent->size, ent->mtime);
+                }
+                else if (folder || !filter.skip(rel_path + "/", true))
+                {
+                    u32 i = out.add(parent, ent->name, true, 0, ent->mtime);
+                    if (!previous || !reuse_subtree(*previous, rel_path + "/", ent->mtime, out))
+                        scan_dir(filter, base_path, out, i, rel_path, previous);
+                }
+            }
+        }
+        rel_path.resize(len);
+    }
+}
+
+/// Scan a local tree. With `previous` (sorted by path), folders whose mtime
+/// matches their record aren't opened, their contents come from the records.
+FileList recursively_get_dir(const PathFilter &filter, const string &base_path, const vector<TreeRecord> *previous = NULL)
+{
+    FileList files;
+    struct stat attr;
+    if (stat(base_path.c_str(), &attr) != 0 || !S_ISDIR(attr.st_mode))
+    {
+        console_printf("directory %s not found\n", base_path.c_str());
+        return files;
+    }
+    files.set_mtime(FileList::root, attr.st_mtime);
+    if (previous && reuse_subtree(*previous, "/", attr.st_mtime, files))
+    {
+        return files;
+    }
+    string rel_path;
+    scan_dir(filter, base_path, files, FileList::root, rel_path, previous);
+    return files;
+}
+
+bool WebDavClient::ensure_collection(string web_rel_path)
+{
+    // Create every missing parent, remembering what exists to save requests
+    for (size_t slash = web_rel_path.find('/', 1); slash != string::npos; slash = web_rel_path.find('/', slash + 1))
+    {
+        string dir = web_rel_path.substr(0, slash + 1);
+        {
+            lock_guard<mutex> guard(this->state_lock);
+            if (this->known_collections.count(dir))
+                continue;
+        }
+        // Two lanes may race to create the same folder, MKCOL checks for it first
+        if (!this->mkcol(dir, nullopt))
+            return false;
+        lock_guard<mutex> guard(this->state_lock);
+        this->known_collections.insert(dir);
+    }
+    return true;
+}
+
+optional<string> WebDavClient::snapshot(const FileEntry &remote_file)
+{
+    string dir = this->versions_path + remote_file.path + "/";
+    if (!this->ensure_collection(dir))
+    {
+        return nullopt;
+    }
+    // Versions are named after the mtime they had, so they sort chronologically
+    char stamp[32];
+    struct tm tm;
+    gmtime_r(&remote_file.last_modified, &tm);
+    strftime(stamp, sizeof(stamp), "%Y%m%dT%H%M%SZ", &tm);
+    string version = dir + stamp;
+    string version_url = formulate_actual_url(this->web_root, version);
+    string current_url = formulate_actual_url(this->web_root, remote_file.path);
+    // A MOVE is just a rename on the server, no data is copied
+    if (!this->relocate("MOVE", current_url, version_url, true))
+    {
+        return nullopt;
+    }
+
+    string dir_url = formulate_actual_url(this->web_root, dir);
+    optional<FileList> versions = this->propfind(dir_url, "1");
+    if (versions)
+    {
+        vector<string> names;
+        for (u32 i = 1; i < versions->size(); i++)
+        {
+            if (!versions->folder(i))
+                names.push_back(versions->path(i));
+        }
+        sort(names.begin(), names.end(), greater<string>());
+        lock_guard<mutex> guard(this->state_lock);
+        for (size_t i = this->keep_versions; i < names.size(); i++)
+        {
+            // Deleted together at the end of the run
+            this->pending_prunes.push_back(dir + names[i].substr(1));
+        }
+    }
+    return version_url;
+}
+
+void WebDavClient::flush_prunes()
+{
+    for (const string &path : this->pending_prunes)
+    {
+        this->remove(path);
+    }
+    this->pending_prunes.clear();
+}
+
+bool WebDavClient::upload(const FileEntry &local_file, const FileEntry *replaced, string &checksum, bool create_only)
+{
+    string path = local_file.path;
+    string local_real_path = this->local_root + path;
+    string url = formulate_actual_url(this->web_root, path);
+    checksum = "";
+
+    // Preserve what we're about to overwrite
+    optional<string> version;
+    if (replaced && this->keep_versions > 0)
+    {
+        version = this->snapshot(*replaced);
+        if (!version)
+        {
+            console_printf("%s: can't preserve the previous version, not overwriting\n", path.c_str());
+            return false;
+        }
+    }
+    bool overwrite = replaced && !version;
+
+    bool done = false;
+    bool copied = false;
+    if (this->content_index)
+    {
+        // Whatever used to be at this URL is about to be replaced
+        this->content_index->forget(url);
+        if (version)
+        {
+            this->content_index->add(replaced->size, replaced->checksum, version.value());
+        }
+        // Hashing costs a full read of the file, pointless if nothing on the server is that big
+        if (this->content_index->has_size(local_file.size))
+        {
+            checksum = file_sha1(local_real_path).value_or("");
+        }
+        optional<string> source;
+        while (!done && !checksum.empty() && (source = this->content_index->find(local_file.size, checksum, url)))
+        {
+            console_printf("%s: identical content on server, copying...\n\n", path.c_str());
+            if (this->copy(source.value(), path, overwrite))
+            {
+                // COPY keeps the source's mtime, ours is what the next comparison needs
+                copied = true;
+                done = this->set_remote_mtime(path, local_file.last_modified);
+                if (!done)
+                {
+                    console_printf("%s: can't set the copy's modification time, uploading instead...\n\n", path.c_str());
+                    break;
+                }
+            }
+            else
+            {
+                this->content_index->forget(source.value());
+            }
+        }
+    }
+    bool delta = this->delta_block > 0 && this->caps.partial_update && local_file.size >= this->delta_min;
+    // A copy that took the old content's place can't be patched against its block map
+    if (!done && delta && replaced && !copied)
+    {
+        // A snapshot moved the old version away, the copy is made from there
+        done = this->delta_push(local_file, *replaced, version ? version.value() : url);
+    }
+    if (!done)
+    {
+        // The copy is in the way of a create-only PUT, and ours anyway
+        done = this->push(local_real_path, path, checksum, create_only && !copied);
+        if (done && delta)
+        {
+            this->remember_blocks(local_file);
+        }
+    }
+
+    if (!done)
+    {
+        if (version)
+        {
+            // Put the previous version back in place, over a copy that couldn't be fixed up
+            this->relocate("MOVE", version.value(), url, copied);
+        }
+        return false;
+    }
+    if (this->content_index)
+    {
+        this->content_index->add(local_file.size, checksum, url);
+    }
+    return true;
+}
+
+/// Most files in one bulk request, as the Nextcloud desktop client does
+static const size_t max_batch_files = 100;
+
+void WebDavClient::batch_uploads(vector<TransferJob> &transfers, const vector<QueuedOp> &ops, const Recorder &record)
+{
+    optional<BulkEndpoint> endpoint = bulk_endpoint(this->web_root);
+    if (!this->caps.bulk_upload || this->bulk_limit == 0 || !endpoint)
+    {
+        return;
+    }
+    vector<TransferJob> kept;
+    vector<vector<size_t>> batches(1);
+    u64 volume = 0;
+    for (size_t i = 0; i < transfers.size(); i++)
+    {
+        const QueuedOp &op = ops[i];
+        // Only upload() preserves a replaced file's previous version
+        bool small = op.size <= this->bulk_limit / 4;
+        if (!small || op.kind == QueuedOp::Download || (op.kind == QueuedOp::Replace && this->keep_versions > 0))
+        {
+            kept.push_back(std::move(transfers[i]));
+            continue;
+        }
+        if (batches.back().size() == max_batch_files || volume + op.size > this->bulk_limit)
+        {
+            batches.emplace_back();
+            volume = 0;
+        }
+        batches.back().push_back(i);
+        volume += op.size;
+    }
+    for (const vector<size_t> &batch : batches)
+    {
+        if (batch.size() < 2)
+        {
+            for (size_t i : batch)
+                kept.push_back(std::move(transfers[i]));
+            continue;
+        }
+        vector<QueuedOp> batch_ops;
+        vector<TransferJob> singles;
+        u64 size = 0;
+        time_t newest = 0;
+        for (size_t i : batch)
+        {
+            batch_ops.push_back(ops[i]);
+            singles.push_back(std::move(transfers[i]));
+            size += ops[i].size;
+            newest = max(newest, ops[i].mtime);
+        }
+        kept.push_back(TransferJob{batch_ops.front().path, size, newest, [this, endpoint, batch_ops, singles, &record]()
+                                   {
+                                       this->upload_batch(endpoint.value(), batch_ops, singles, record);
+                                   }});
+    }
+    transfers = std::move(kept);
+}
+
+void WebDavClient::upload_batch(const BulkEndpoint &endpoint, const vector<QueuedOp> &ops, const vector<TransferJob> &singles,
+                                const Recorder &record)
+{
+    vector<bool> done(ops.size(), false);
+    vector<BulkPart> parts;
+    vector<size_t> members;
+    for (size_t i = 0; i < ops.size(); i++)
+    {
+        // Files changed since planning go on their own, X-File-Mtime must match what's sent
+        string local_real_path = this->local_root + ops[i].path;
+        struct stat attr;
+        if (stat(local_real_path.c_str(), &attr) != 0 || (u64)attr.st_size != ops[i].size || attr.st_mtime != ops[i].mtime)
+            continue;
+        optional<string> md5 = file_md5(local_real_path);
+        if (!md5)
+            continue;
+        parts.push_back(BulkPart{local_real_path, endpoint.folder + ops[i].path, ops[i].size, ops[i].mtime, md5.value()});
+        members.push_back(i);
+    }
+
+    optional<map<string, BulkResult>> results;
+    if (!parts.empty())
+    {
+        console_printf("Uploading %zu small files in one request...\n\n", parts.size());
+        results = this->bulk_push(endpoint.url, parts);
+    }
+    for (size_t k = 0; results && k < parts.size(); k++)
+    {
+        const QueuedOp &op = ops[members[k]];
+        auto result = results->find(parts[k].target);
+        if (result == results->end())
+        {
+            continue;
+        }
+        if (!result->second.ok)
+        {
+            console_printf("%s: not taken in bulk (%s), uploading on its own...\n", op.path.c_str(), result->second.message.c_str());
+            continue;
+        }
+        // Batched files skip deduplication, but can still be the source of later copies
+        string checksum;
+        if (this->content_index)
+        {
+            string url = formulate_actual_url(this->web_root, op.path);
+            checksum = file_sha1(parts[k].local_path).value_or("");
+            this->content_index->forget(url);
+            this->content_index->add(op.size, checksum, url);
+        }
+        record(op.path, false, op.mtime, checksum);
+        done[members[k]] = true;
+    }
+    for (size_t i = 0; i < ops.size(); i++)
+    {
+        if (!done[i])
+        {
+            singles[i].run();
+        }
+    }
+}
+
+optional<map<string, BulkResult>> WebDavClient::bulk_push(const string &url, const vector<BulkPart> &parts)
+{
+    BulkBody body(parts);
+    string response;
+    HeaderList headers;
+    headers.append("Content-Type: " + body.content_type());
+    curl_easy_setopt(this->handle(), CURLOPT_URL, url.c_str());
+    curl_easy_setopt(this->handle(), CURLOPT_UPLOAD, 1L);
+    curl_easy_setopt(this->handle(), CURLOPT_CUSTOMREQUEST, "POST");
+    curl_easy_setopt(this->handle(), CURLOPT_INFILESIZE_LARGE, (curl_off_t)body.length());
+    curl_easy_setopt(this->handle(), CURLOPT_READFUNCTION, BulkBody::read);
+    curl_easy_setopt(this->handle(), CURLOPT_READDATA, &body);
+    curl_easy_setopt(this->handle(), CURLOPT_HTTPHEADER, headers.get());
+    curl_easy_setopt(this->handle(), CURLOPT_WRITEFUNCTION, curl_write_to_string);
+    curl_easy_setopt(this->handle(), CURLOPT_WRITEDATA, &response);
+    FileProgress progress(this->status, to_string(parts.size()) + " files", body.length());
+    this->track_progress(progress);
+    this->limit_stalls();
+    CURLcode res = this->perform("POST", [&]()
+                                 {
+                                     response.clear();
+                                     progress.update(0);
+                                     return body.rewind();
+                                 });
+    this->reset();
+    if (res != CURLE_OK)
+    {
+        long code = last_timing.response_code;
+        if (body.failed())
+        {
+            console_printf("bulk upload: a file changed while sending, uploading one by one\n");
+        }
+        else
+        {
+            console_printf("error in bulk upload: %s\n", curl_easy_strerror(res));
+            this->print_request_details(url);
+        }
+        if (code == 404 || code == 405 || code == 501)
+        {
+            // Disabled since it was probed, don't try again until the next probe
+            lock_guard<mutex> lock(this->state_lock);
+            if (this->caps.bulk_upload)
+            {
+                this->caps.bulk_upload = false;
+                if (!this->state_file.empty())
+                {
+                    save_capabilities(this->state_file + ".caps", this->caps);
+                }
+            }
+        }
+        return nullopt;
+    }
+    optional<map<string, BulkResult>> results = parse_bulk_response(response);
+    if (!results)
+    {
+        console_printf("bulk upload: unexpected response, uploading one by one\n");
+    }
+    return results;
+}
+
+/// Reads a byte range of a file, for uploading just that part
+struct RangeReader
+{
+    FILE *fp;
+    u64 remaining;
+
+    static size_t read(char *buffer, size_t size, size_t nitems, void *userp)
+    {
+        RangeReader *range = (RangeReader *)userp;
+        size_t n = fread(buffer, 1, min((u64)(size * nitems), range->remaining), range->fp);
+        range->remaining -= n;
+        return n;
+    }
+};
+
+bool WebDavClient::patch_range(const string &url, FILE *fp, u64 first, u64 last, FileProgress &progress)
+{
+    RangeReader range{fp, last - first};
+    if (fseeko(fp, first, SEEK_SET) != 0)
+    {
+        return false;
+    }
+    HeaderList headers;
+    headers.append("Content-Type: application/x-sabredav-partialupdate");
+    headers.append("X-Update-Range: bytes=" + to_string(first) + "-" + to_string(last - 1));
+    curl_easy_setopt(this->handle(), CURLOPT_URL, url.c_str());
+    curl_easy_setopt(this->handle(), CURLOPT_CUSTOMREQUEST, "PATCH");
+    curl_easy_setopt(this->handle(), CURLOPT_UPLOAD, 1L);
+    curl_easy_setopt(this->handle(), CURLOPT_INFILESIZE_LARGE, (curl_off_t)(last - first));
+    curl_easy_setopt(this->handle(), CURLOPT_READFUNCTION, RangeReader::read);
+    curl_easy_setopt(this->handle(), CURLOPT_READDATA, &range);
+    curl_easy_setopt(this->handle(), CURLOPT_HTTPHEADER, headers.get());
+    this->track_progress(progress);
+    this->limit_stalls();
+    CURLcode res = this->perform("PATCH", [&]()
+                                 {
+                                     progress.update(0);
+                                     range.remaining = last - first;
+                                     return fseeko(fp, first, SEEK_SET) == 0;
+                                 });
+    this->reset();
+    if (res != CURLE_OK)
+    {
+        console_printf("error patching %s: %s\n", url.c_str(), curl_easy_strerror(res));
+        this->print_request_details(url);
+        return false;
+    }
+    return true;
+}
+
+bool WebDavClient::delta_push(const FileEntry &local_file, const FileEntry &replaced, const string &source_url)
+{
+    const string &path = local_file.path;
+    string local_real_path = this->local_root + path;
+    // Only valid for exactly the remote version it was made from
+    optional<BlockMap> before = this->block_maps.get(path);
+    if (!before || before->block_size != this->delta_block || before->size != replaced.size ||
+        before->mtime != replaced.last_modified)
+    {
+        return false;
+    }
+    optional<BlockMap> now = hash_blocks(local_real_path, this->delta_block);
+    // Range writes can't shorten a file
+    if (!now || now->size < before->size)
+    {
+        return false;
+    }
+    vector<pair<u64, u64>> ranges = changed_ranges(before.value(), now.value());
+    u64 volume = 0;
+    for (const pair<u64, u64> &range : ranges)
+    {
+        volume += range.second - range.first;
+    }
+    if (volume > now->size / 2)
+    {
+        // Not worth the copy and the extra requests
+        return false;
+    }
+
+    console_printf("%s: %s of %s changed, uploading the difference...\n\n", path.c_str(), format_bytes(volume).c_str(),
+                   format_bytes(now->size).c_str());
+    // Patched on a copy that replaces the file in one MOVE, so an interruption leaves the old version intact
+    string staging = delta_staging + path;
+    string staging_url = formulate_actual_url(this->web_root, staging);
+    if (!this->ensure_collection(delta_staging + path.substr(0, path.rfind('/') + 1)) ||
+        !this->relocate("COPY", source_url, staging_url, true))
+    {
+        return false;
+    }
+    FILE *fp = fopen(local_real_path.c_str(), "rb");
+    bool ok = fp != NULL;
+    {
+        FileProgress progress(this->status, path, volume);
+        u64 sent = 0;
+        for (size_t i = 0; ok && i < ranges.size(); i++)
+        {
+            progress.restart_at(sent);
+            ok = this->patch_range(staging_url, fp, ranges[i].first, ranges[i].second, progress);
+            sent += ranges[i].second - ranges[i].first;
+        }
+    }
+    if (fp)
+    {
+        fclose(fp);
+    }
+    // The hashes must describe what was sent
+    struct stat attr;
+    ok = ok && stat(local_real_path.c_str(), &attr) == 0 && (u64)attr.st_size == now->size && attr.st_mtime == local_file.last_modified;
+    if (ok)
+    {
+        this->set_remote_mtime(staging, local_file.last_modified);
+        ok = this->relocate("MOVE", staging_url, formulate_actual_url(this->web_root, path), true);
+    }
+    if (!ok)
+    {
+        this->remove(staging);
+        return false;
+    }
+    optional<time_t> mtime = this->remote_mtime(path);
+    if (mtime)
+    {
+        now->mtime = mtime.value();
+        this->block_maps.put(path, now.value());
+    }
+    return true;
+}
+
+void WebDavClient::remember_blocks(const FileEntry &local_file)
+{
+    string local_real_path = this->local_root + local_file.path;
+    optional<BlockMap> blocks = hash_blocks(local_real_path, this->delta_block);
+    struct stat attr;
+    // Changed since the upload, then the map wouldn't match the server
+    if (!blocks || stat(local_real_path.c_str(), &attr) != 0 || (u64)attr.st_size != blocks->size ||
+        attr.st_mtime != local_file.last_modified)
+    {
+        return;
+    }
+    // Keyed on the mtime the server lists, which it may not have taken from us
+    optional<time_t> mtime = this->remote_mtime(local_file.path);
+    if (mtime)
+    {
+        blocks->mtime = mtime.value();
+        this->block_maps.put(local_file.path, blocks.value());
+    }
+}
+
+/// Upper bound of the bytes a sync of these listings will transfer
+static u64 planned_volume(const FileList &local_files, const FileList &remote_files)
+{
+    u64 total = 0;
+    vector<bool> matched(remote_files.size(), false);
+    // Both lists are parent-first, so each local entry's remote parent is already known
+    vector<u32> counterpart(local_files.size(), FileList::npos);
+    counterpart[FileList::root] = FileList::root;
+    for (u32 i = 0; i < local_files.size(); i++)
+    {
+        if (local_files.claimed(i) || !local_files.visible(i))
+            continue;
+        const FileList::Entry &f = local_files[i];
+        u32 r = i == FileList::root ? FileList::root : FileList::npos;
+        if (i != FileList::root && counterpart[f.parent] != FileList::npos)
+        {
+            r = remote_files.child(counterpart[f.parent], local_files.name(i));
+        }
+        if (r == FileList::npos || !remote_files.visible(r))
+        {
+            total += f.size;
+            continue;
+        }
+        counterpart[i] = r;
+        matched[r] = true;
+        if (!local_files.folder(i) && remote_files[r].mtime != f.mtime)
+            total += max(f.size, remote_files[r].size);
+    }
+    for (u32 r = 0; r < remote_files.size(); r++)
+    {
+        if (!matched[r] && !remote_files.claimed(r) && remote_files.visible(r))
+            total += remote_files[r].size;
+    }
+    return total;
+}
+
+bool WebDavClient::user_confirm(const string &path, const char *reason, const char *question)
+{
+    if (this->confirm_policy != ConfirmPolicy::Ask)
+    {
+        bool yes = this->confirm_policy == ConfirmPolicy::Yes;
+        console_printf("\n%s\n" CONSOLE_YELLOW "%s %s\n" CONSOLE_RESET, path.c_str(), reason, yes ? "Syncing it." : "Leaving it alone.");
+        return yes;
+    }
+    // Only one profile at a time may ask, or answers would go to the wrong file
+    lock_guard<mutex> lock(console_prompt_lock());
+    console_printf("\n%s\n" CONSOLE_YELLOW "%s\n%s\n" CONSOLE_RESET, path.c_str(), reason, question);
+    while (appletMainLoop())
+    {
+        padUpdate(this->pad);
+        u32 kDown = padGetButtonsDown(this->pad);
+        if (kDown & HidNpadButton_A)
+        {
+            return true;
         }
-        this->reset();
+        else if (kDown & HidNpadButton_B)
+        {
+            return false;
+        }
+    }
+    return false;
+}
+
+optional<FileList> WebDavClient::overlap_listing(FileList &local_files, const vector<TreeRecord> &previous,
+                                                 const Recorder &record, u64 &transferred)
+{
+    // Entries as they are parsed, handed over by the listing thread
+    struct
+    {
+        mutex lock;
+        condition_variable cv;
+        deque<FileEntry> entries;
+        bool done = false;
+        optional<FileList> files;
+    } stream;
+
+    // The listing gets its own connection, transfers keep using ours
+    thread lister([&, profile = console_profile()]()
+                  {
+                      console_set_profile(profile);
+                      optional<FileList> files;
+                      if (this->open_thread_connection())
+                      {
+                          files = this->propfind(this->web_root, "infinity", &this->filter, [&](const FileEntry &e)
+                                                 {
+                                                     lock_guard<mutex> guard(stream.lock);
+                                                     stream.entries.push_back(e);
+                                                     stream.cv.notify_one();
+                                                 });
+                          this->close_thread_connection();
+                      }
+                      lock_guard<mutex> guard(stream.lock);
+                      stream.files = std::move(files);
+                      stream.done = true;
+                      stream.cv.notify_one();
+                  });
 
-        // Now read it!
-        XMLDocument doc;
-        XMLError parse_res = doc.Parse(response.c_str());
+    local_files = recursively_get_dir(this->filter, this->local_root);
+
+    // Only paths the last sync never saw are handled early, and none that
+    // could be one end of a move: those need the complete listing
+    set<string> known;
+    set<pair<u64, time_t>> local_keys, remote_keys;
+    for (const TreeRecord &r : previous)
+    {
+        known.insert(r.path);
+        if (this->detect_moves && !r.folder)
+        {
+            local_keys.insert({r.size, r.local_mtime});
+            remote_keys.insert({r.size, r.remote_mtime});
+        }
+    }
+    vector<u32> uploads;
+    for (u32 i = 1; i < local_files.size(); i++)
+    {
+        if (!local_files.folder(i) && !local_keys.count({local_files[i].size, (time_t)local_files[i].mtime}) && !known.count(local_files.path(i)))
+        {
+            uploads.push_back(i);
+        }
+    }
 
-        vector<FileEntry> res;
-        if (parse_res == tinyxml2::XML_SUCCESS)
+    // Remote paths listed so far, and those taken care of here
+    set<string> seen, created;
+    vector<string> handled;
+    size_t next_upload = 0;
+    unique_lock<mutex> guard(stream.lock);
+    while (true)
+    {
+        if (!stream.entries.empty())
         {
-            XMLElement *root = doc.RootElement();
-            for (XMLElement *e = root->FirstChildElement(); e != NULL; e = e->NextSiblingElement())
+            // New on the server: the local scan is complete, so absence there is certain
+            FileEntry remote_file = std::move(stream.entries.front());
+            stream.entries.pop_front();
+            guard.unlock();
+            seen.insert(remote_file.path);
+            if (!remote_file.folder && local_files.find(remote_file.path) == FileList::npos &&
+                !known.count(remote_file.path) && !remote_keys.count({remote_file.size, remote_file.last_modified}))
             {
-                string path;
-                time_t time;
-                bool folder = false;
-                int size;
-                // Get file path
-                if (e->FirstChildElement("d:href"))
+                // Parent folders may not have been listed yet, create them as needed
+                for (size_t slash = remote_file.path.find('/', 1); slash != string::npos; slash = remote_file.path.find('/', slash + 1))
                 {
-                    const char *text = e->FirstChildElement("d:href")->GetText();
-                    // The path here is escaped. Convert them back to unescaped form
-                    char *decoded = curl_easy_unescape(this->curl, text, 0, NULL);
-                    path = string(decoded);
-                }
-                else
-                {
-                    printf("malformed WebDAV response: missing d:href in PROPFIND\n");
-                    consoleUpdate(NULL);
-                    return nullopt;
-                }
-                if (e->FirstChildElement("d:propstat"))
-                {
-                    if (e->FirstChildElement("d:propstat")->FirstChildElement("d:prop"))
-                    {
-                        XMLElement *prop = e->FirstChildElement("d:propstat")->FirstChildElement("d:prop");
-                        if (prop->FirstChildElement("d:getlastmodified"))
-                        {
-                            string time_str = prop->FirstChildElement("d:getlastmodified")->GetText();
-                            time = curl_getdate(time_str.c_str(), NULL);
-                        }
-                        else
-                        {
-                            printf("malformed WebDAV response: missing d:getlastmodified in PROPFIND\n");
-                            consoleUpdate(NULL);
-                            return nullopt;
-                        }
-                        if (prop->FirstChildElement("d:getcontentlength"))
-                        {
-                            string size_str = prop->FirstChildElement("d:getcontentlength")->GetText();
-                            size = stoi(size_str);
-                        }
-                        else
-                        {
-                            size = 0;
-                        }
-                        if (prop->FirstChildElement("d:resourcetype") && prop->FirstChildElement("d:resourcetype")->FirstChildElement("d:collection"))
-                        {
-                            folder = true;
-                        }
-                    }
-                    else
+                    string dir = remote_file.path.substr(0, slash + 1);
+                    if (local_files.find(dir) == FileList::npos && !created.count(dir) && mkdir((this->local_root + dir).c_str(), 0777) == 0)
                     {
-                        printf("malformed WebDAV response: missing d:prop in PROPFIND\n");
-                        consoleUpdate(NULL);
-                        return nullopt;
+                        created.insert(dir);
+                        handled.push_back(dir);
                     }
                 }
-                else
+                console_printf("%s: new remote file, downloading...\n\n", remote_file.path.c_str());
+                if (this->pull(this->local_root + remote_file.path, remote_file.path, remote_file.size))
                 {
-                    printf("malformed WebDAV response: missing d:propstat in PROPFIND\n");
-                    consoleUpdate(NULL);
-                    return nullopt;
+                    handled.push_back(remote_file.path);
+                    transferred += remote_file.size;
+                    record(remote_file.path, false, remote_file.last_modified, remote_file.checksum);
+                }
+            }
+            guard.lock();
+        }
+        else if (next_upload < uploads.size())
+        {
+            // New locally: may still be in the unlisted part of the server, so only create, never replace
+            guard.unlock();
+            u32 i = uploads[next_upload++];
+            FileEntry local_file = local_files.entry(i);
+            string checksum;
+            if (!seen.count(local_file.path) && this->ensure_collection(local_file.path))
+            {
+                console_printf("%s: new local file, uploading...\n\n", local_file.path.c_str());
+                if (this->upload(local_file, NULL, checksum, true))
+                {
+                    local_files.claim(i);
+                    handled.push_back(local_file.path);
+                    transferred += local_file.size;
+                    record(local_file.path, false, local_file.last_modified, checksum);
                 }
-
-                res.push_back(FileEntry{path, time, folder, size});
             }
+            guard.lock();
+        }
+        else if (stream.done)
+        {
+            break;
         }
         else
         {
-            printf("malformed XML response: %d\n", parse_res);
-            consoleUpdate(NULL);
-            return nullopt;
+            stream.cv.wait(guard);
         }
-        // Turn file paths into canonical form
-        auto out = normalize_filelist(res);
-        return out;
     }
-    else
+    guard.unlock();
+    lister.join();
+
+    optional<FileList> files = std::move(stream.files);
+    if (files)
+    {
+        // Done here, keep the comparison away from them
+        for (const string &path : handled)
+        {
+            u32 r = files->find(path);
+            if (r == FileList::npos)
+                continue;
+            files->claim(r);
+            if (files->folder(r))
+                record(path, true, (*files)[r].mtime, "");
+        }
+    }
+    return files;
+}
+
+optional<time_t> WebDavClient::remote_mtime(const string &web_rel_path)
+{
+    optional<FileList> entry = this->propfind(formulate_actual_url(this->web_root, web_rel_path), "0");
+    if (!entry)
     {
-        printf("can't initalize curl!\n");
-        consoleUpdate(NULL);
         return nullopt;
     }
+    return (*entry)[FileList::root].mtime;
+}
+
+string WebDavClient::queue_file() const
+{
+    return this->state_file + ".queue";
 }
 
-optional<FileEntry> get_file(vector<FileEntry> *files, string path)
+bool WebDavClient::resume(const vector<QueuedOp> &ops)
 {
-    for (unsigned i = 0; i < files->size(); i++)
+    console_printf(CONSOLE_BLUE "Resuming %zu transfers of an interrupted sync...\n\n" CONSOLE_RESET, ops.size());
+    atomic<bool> success(true);
+    OpQueue queue;
+    // Compacts the journal to what is left
+    queue.begin(this->queue_file(), ops);
+    vector<TransferJob> transfers;
+    u64 volume = 0;
+    for (const QueuedOp &op : ops)
     {
-        if ((*files)[i].path == path)
-        {
-            FileEntry f = (*files)[i];
-            files->erase(files->begin() + i);
-            return f;
-        }
+        volume += op.size;
+        transfers.push_back(TransferJob{op.path, op.size, op.mtime, [this, op, &queue, &success]()
+                                        {
+                                            // Either side may have changed meanwhile, then the next sync decides anew
+                                            struct stat attr;
+                                            bool local_same = stat((this->local_root + op.path).c_str(), &attr) == 0 &&
+                                                              (u64)attr.st_size == op.size && attr.st_mtime == op.mtime;
+                                            bool valid;
+                                            if (op.kind == QueuedOp::Download)
+                                                valid = this->remote_mtime(op.path) == optional<time_t>(op.mtime);
+                                            else if (op.kind == QueuedOp::Replace)
+                                                valid = local_same && this->remote_mtime(op.path) == optional<time_t>(op.remote_mtime);
+                                            else
+                                                valid = local_same;
+                                            if (!valid)
+                                            {
+                                                console_printf("%s: changed since, left for the next sync.\n", op.path.c_str());
+                                                queue.complete(op.path);
+                                                return;
+                                            }
+
+                                            bool ok;
+                                            string checksum;
+                                            FileEntry local_file{op.path, op.mtime, false, op.size, ""};
+                                            if (op.kind == QueuedOp::Download)
+                                            {
+                                                console_printf("%s: resuming download...\n\n", op.path.c_str());
+                                                ok = this->pull(this->local_root + op.path, op.path, op.size);
+                                            }
+                                            else if (op.kind == QueuedOp::Replace)
+                                            {
+                                                console_printf("%s: resuming upload...\n\n", op.path.c_str());
+                                                FileEntry replaced{op.path, op.remote_mtime, false, op.remote_size, op.checksum};
+                                                ok = this->upload(local_file, &replaced, checksum);
+                                            }
+                                            else
+                                            {
+                                                // May have made it to the server before the interruption
+                                                console_printf("%s: resuming upload...\n\n", op.path.c_str());
+                                                ok = this->upload(local_file, NULL, checksum, true) || last_timing.response_code == 412;
+                                            }
+                                            if (ok)
+                                            {
+                                                queue.complete(op.path);
+                                            }
+                                            else
+                                            {
+                                                console_printf(CONSOLE_RED "%s: transfer failed.\n" CONSOLE_RESET, op.path.c_str());
+                                                success = false;
+                                            }
+                                        }});
     }
-    return nullopt;
+    if (this->status)
+    {
+        this->status->plan(volume);
+    }
+    string profile = console_profile();
+    run_transfers(transfers, this->lanes,
+                  [this, profile]()
+                  {
+                      console_set_profile(profile);
+                      return this->open_thread_connection();
+                  },
+                  [this]()
+                  {
+                      this->close_thread_connection();
+                  });
+    if (this->status)
+    {
+        this->status->finish();
+    }
+    this->flush_prunes();
+    queue.finish();
+    return success;
 }
 
-vector<pair<string, bool>> recursively_get_dir(string base_path, string ext_path = "")
+optional<FileEntry> WebDavClient::find_archive()
 {
-    vector<pair<string, bool>> paths;
+    optional<FileList> listing = this->propfind(this->web_root, "1");
+    u32 i = listing ? listing->find("/" + this->archive_name) : FileList::npos;
+    if (i == FileList::npos || listing->folder(i))
+    {
+        return nullopt;
+    }
+    return listing->entry(i);
+}
 
-    DIR *dir;
-    struct dirent *ent;
-    string path = base_path + ext_path;
-    if ((dir = opendir(path.c_str())) != NULL)
+bool WebDavClient::upload_archive()
+{
+    PhaseTimer phase(this->metrics, "scan");
+    FileList files = recursively_get_dir(this->filter, this->local_root);
+    TreeSummary summary = summarize(files);
+    string manifest_file = this->state_file.empty() ? "" : this->state_file + ".archive";
+    optional<ArchiveManifest> manifest = manifest_file.empty() ? nullopt : load_archive_manifest(manifest_file);
+    if (manifest && manifest->local == summary)
     {
-        paths.push_back(pair(ext_path + "/", true));
-        while ((ent = readdir(dir)) != NULL)
+        // Unless the archive was replaced or deleted on the server since
+        optional<FileEntry> remote = this->find_archive();
+        if (remote && remote->last_modified == manifest->remote_mtime)
         {
-            vector<pair<string, bool>> subdir = recursively_get_dir(base_path, ext_path + "/" + ent->d_name);
-            paths.insert(paths.end(), subdir.begin(), subdir.end());
+            console_printf("%s: no changes since the last archive.\n", this->archive_name.c_str());
+            this->changed = false;
+            return true;
         }
     }
-    else
+
+    phase.next("upload");
+    this->mkcol("", nullopt);
+    console_printf("%s: archiving %u entries, %s...\n\n", this->archive_name.c_str(), summary.count,
+                   format_bytes(summary.size).c_str());
+    if (this->status)
     {
-        if (ext_path != "")
+        this->status->plan(summary.size);
+    }
+    string url = formulate_actual_url(this->web_root, "/" + this->archive_name);
+    CURLcode res;
+    bool unreadable;
+    {
+        FileProgress progress(this->status, this->archive_name, summary.size);
+        ArchiveWriter writer(this->local_root, files, &progress);
+        curl_easy_setopt(this->handle(), CURLOPT_URL, url.c_str());
+        curl_easy_setopt(this->handle(), CURLOPT_UPLOAD, 1L);
+        // The compressed size is only known at the end, so the body goes out chunked
+        curl_easy_setopt(this->handle(), CURLOPT_READFUNCTION, ArchiveWriter::read);
+        curl_easy_setopt(this->handle(), CURLOPT_READDATA, &writer);
+        // Progress comes from the writer, which knows the uncompressed size
+        this->meter(NULL);
+        this->limit_stalls();
+        res = this->perform("PUT", [&]()
+                            {
+                                return writer.rewind();
+                            });
+        unreadable = writer.failed();
+        this->reset();
+    }
+    if (this->status)
+    {
+        this->status->finish();
+    }
+    if (res != CURLE_OK)
+    {
+        if (unreadable)
         {
-            paths.push_back(make_pair(ext_path, false));
+            console_printf(CONSOLE_RED "%s: a file changed or couldn't be read while archiving.\n" CONSOLE_RESET, this->archive_name.c_str());
         }
         else
         {
-            printf("directory %s not found\n", path.c_str());
-            consoleUpdate(NULL);
+            console_printf("error uploading archive %s: %s\n", this->archive_name.c_str(), curl_easy_strerror(res));
+            this->print_request_details(url);
         }
+        return false;
     }
-    closedir(dir);
-    return paths;
+
+    phase.next("state");
+    optional<FileEntry> remote = this->find_archive();
+    if (!manifest_file.empty() && remote)
+    {
+        save_archive_manifest(manifest_file, ArchiveManifest{summary, remote->last_modified});
+    }
+    return true;
 }
 
-bool WebDavClient::user_confirm()
+bool WebDavClient::restore_archive()
 {
-    while (appletMainLoop())
+    PhaseTimer phase(this->metrics, "download");
+    optional<FileEntry> remote = this->find_archive();
+    if (!remote)
     {
-        padUpdate(this->pad);
-        u32 kDown = padGetButtonsDown(this->pad);
-        if (kDown & HidNpadButton_A)
-        {
-            return true;
-        }
-        else if (kDown & HidNpadButton_B)
+        console_printf(CONSOLE_RED "%s: not found on the server, nothing to restore.\n" CONSOLE_RESET, this->archive_name.c_str());
+        return false;
+    }
+    string manifest_file = this->state_file.empty() ? "" : this->state_file + ".archive";
+    optional<ArchiveManifest> manifest = manifest_file.empty() ? nullopt : load_archive_manifest(manifest_file);
+    if (manifest && manifest->remote_mtime == remote->last_modified &&
+        summarize(recursively_get_dir(this->filter, this->local_root)) == manifest->local)
+    {
+        console_printf("%s: already restored.\n", this->archive_name.c_str());
+        this->changed = false;
+        return true;
+    }
+
+    console_printf("%s: restoring %s...\n\n", this->archive_name.c_str(), format_bytes(remote->size).c_str());
+    if (this->status)
+    {
+        this->status->plan(remote->size);
+    }
+    string url = formulate_actual_url(this->web_root, "/" + this->archive_name);
+    CURLcode res;
+    bool complete;
+    u32 restored;
+    {
+        FileProgress progress(this->status, this->archive_name, remote->size);
+        ArchiveReader reader(this->local_root);
+        curl_easy_setopt(this->handle(), CURLOPT_URL, url.c_str());
+        curl_easy_setopt(this->handle(), CURLOPT_WRITEFUNCTION, ArchiveReader::write);
+        curl_easy_setopt(this->handle(), CURLOPT_WRITEDATA, &reader);
+        this->track_progress(progress);
+        this->limit_stalls();
+        // A retry unpacks from the start again, overwriting what the last attempt wrote
+        res = this->perform("GET", [&]()
+                            {
+                                progress.update(0);
+                                return reader.restart();
+                            });
+        this->reset();
+        // The reader explains its own failures
+        if (res != CURLE_OK && !reader.failed())
         {
-            return false;
+            console_printf("error downloading archive %s: %s\n", this->archive_name.c_str(), curl_easy_strerror(res));
+            this->print_request_details(url);
         }
+        complete = reader.finish();
+        restored = reader.file_count();
     }
-    return false;
+    if (this->status)
+    {
+        this->status->finish();
+    }
+    if (res != CURLE_OK || !complete)
+    {
+        console_printf(CONSOLE_RED "%s: restore incomplete.\n" CONSOLE_RESET, this->archive_name.c_str());
+        return false;
+    }
+    console_printf("%s: restored %u files.\n", this->archive_name.c_str(), restored);
+
+    phase.next("state");
+    if (!manifest_file.empty())
+    {
+        FileList files = recursively_get_dir(this->filter, this->local_root);
+        save_archive_manifest(manifest_file, ArchiveManifest{summarize(files), remote->last_modified});
+    }
+    return true;
+}
+
+/// The server side of the last sync's records, as a listing. Only valid
+/// while the server's root version hasn't changed since they were saved.
+static FileList remote_from_records(const vector<TreeRecord> &records)
+{
+    FileList files;
+    for (const TreeRecord &r : records)
+    {
+        u32 i = files.add_path(r.path, r.folder, r.folder ? 0 : r.size, r.remote_mtime);
+        if (!r.checksum.empty())
+            files.set_checksum(i, r.checksum);
+    }
+    return files;
 }
 
 bool WebDavClient::compareAndUpdate()
 {
-    bool success = true;
+    // Also cleared by transfers running on other lanes
+    atomic<bool> success(true);
+    PhaseTimer total(this->metrics, "sync");
+    this->changed = true;
+    if (this->status)
+    {
+        // Continuous mode runs this again and again
+        this->status->reset();
+    }
 
     struct stat rootstat;
     if (!stat(this->local_root.c_str(), &rootstat))
@@ -483,36 +2243,237 @@ bool WebDavClient::compareAndUpdate()
     }
     else if (!S_ISDIR(rootstat.st_mode))
     {
-        printf(CONSOLE_RED "specified local dir is not a dir!" CONSOLE_RESET);
-        consoleUpdate(NULL);
+        console_printf(CONSOLE_RED "specified local dir is not a dir!" CONSOLE_RESET);
         return false;
     }
+    if (this->mode == SyncMode::Archive)
+    {
+        return this->upload_archive();
+    }
+    if (this->mode == SyncMode::Restore)
+    {
+        return this->restore_archive();
+    }
 
-    this->mkcol("", nullopt);
+    // What both sides agree on after this run, saved for the next move detection
+    vector<TreeRecord> synced;
+    mutex synced_lock;
+    // Checkpoints transfers once they start
+    OpQueue queue;
+    Recorder record = [&](const string &path, bool folder, time_t remote_mtime, const string &checksum)
+    {
+        queue.complete(path);
+        struct stat attr;
+        if (stat((this->local_root + path).c_str(), &attr) == 0)
+        {
+            lock_guard<mutex> guard(synced_lock);
+            synced.push_back(TreeRecord{path, folder, folder ? 0 : (u64)attr.st_size, attr.st_mtime, remote_mtime, checksum});
+        }
+    };
+
+    PhaseTimer phase(this->metrics, "mkcol");
+    optional<string> version;
+    if (!this->state_file.empty())
+    {
+        version = this->root_version();
+    }
+    if (!version)
+    {
+        this->mkcol("", nullopt);
+    }
+    // Decides how to list, download and upload. Asked once the root exists, the probe lists it.
+    this->discover_capabilities();
+
+    bool resumed = false;
+    if (!this->state_file.empty())
+    {
+        optional<vector<QueuedOp>> left = OpQueue::pending(this->queue_file());
+        if (left && !left->empty())
+        {
+            // Discovery already happened in the interrupted run. What changed since is synced right after.
+            success = this->resume(left.value());
+            resumed = true;
+            if (this->status)
+            {
+                this->status->reset();
+            }
+            if (version)
+            {
+                version = this->root_version();
+            }
+        }
+        OpQueue::discard(this->queue_file());
+    }
+
+    vector<TreeRecord> previous;
+    TreeStamp stamp;
+    if (!this->state_file.empty())
+    {
+        previous = load_tree_state(this->state_file, &stamp);
+        sort(previous.begin(), previous.end(), [](const TreeRecord &a, const TreeRecord &b)
+             {
+                 return a.path < b.path;
+             });
+    }
+    // The records only stand in for a listing made with the same filters
+    size_t config = hash<string>()(this->filter_config);
+    bool same_config = !previous.empty() && stamp.config == config;
 
-    optional<vector<FileEntry>> remote_files_optional = this->get_remote_files();
+    // Nothing changed on the server since the records were saved
+    bool remote_unchanged = same_config && version && !stamp.remote_version.empty() && version.value() == stamp.remote_version;
+    // Whether the server still matches `version` after this run, so the next one may rely on it
+    atomic<bool> clean(true);
+
+    optional<FileList> remote_files_optional;
+    FileList local_files;
+    // Bytes already moved before the plan was made
+    u64 transferred = 0;
+    if (remote_unchanged)
+    {
+        phase.next("scan");
+        local_files = recursively_get_dir(this->filter, this->local_root, this->quick_scan ? &previous : NULL);
+        if (summarize(local_files) == summarize(previous))
+        {
+            console_printf("No changes since the last sync.\n");
+            this->changed = resumed;
+            if (this->status)
+            {
+                this->status->finish();
+            }
+            return success;
+        }
+        remote_files_optional = remote_from_records(previous);
+    }
+    else if (this->pipelined && this->caps.infinite_depth)
+    {
+        phase.next("pipeline");
+        remote_files_optional = this->overlap_listing(local_files, previous, record, transferred);
+        for (u32 i = 0; i < local_files.size(); i++)
+        {
+            // Claimed early means uploaded
+            if (local_files.claimed(i))
+                clean = false;
+        }
+    }
+    else
+    {
+        phase.next("listing");
+        remote_files_optional = this->get_remote_files();
+        if (remote_files_optional)
+        {
+            phase.next("scan");
+            local_files = recursively_get_dir(this->filter, this->local_root, this->quick_scan && same_config ? &previous : NULL);
+        }
+    }
     if (!remote_files_optional)
     {
-        printf("failed to fetch remote file list\n");
-        consoleUpdate(NULL);
+        console_printf("failed to fetch remote file list\n");
         return false;
     }
+    FileList remote_files = std::move(remote_files_optional.value());
+    phase.next("plan");
+
+    if (this->content_index)
+    {
+        for (const TreeRecord &r : previous)
+        {
+            // Servers that don't store checksums still have the ones we saw last time
+            u32 i = r.folder || r.checksum.empty() ? FileList::npos : remote_files.find(r.path);
+            if (i != FileList::npos && !remote_files.folder(i) && remote_files.checksum(i).empty() &&
+                remote_files[i].size == r.size && remote_files[i].mtime == r.remote_mtime)
+            {
+                remote_files.set_checksum(i, r.checksum);
+            }
+        }
+        for (u32 i = 0; i < remote_files.size(); i++)
+        {
+            if (!remote_files.folder(i))
+                this->content_index->add(remote_files[i].size, remote_files.checksum(i), formulate_actual_url(this->web_root, remote_files.path(i)));
+        }
+    }
+
+    MovePlan plan;
+    // Remote entries detached from the comparison while their MOVE is pending, by new path
+    map<string, u32> moving;
+    if (this->detect_moves)
+    {
+        plan = plan_moves(previous, local_files, remote_files, this->local_root, this->verify_move_hash);
+        for (auto &[to, from] : plan.remote_moves)
+        {
+            // The old remote path must not be pulled back as a new remote file
+            u32 i = remote_files.find(from);
+            if (i != FileList::npos)
+            {
+                remote_files.detach(i);
+                moving[to] = i;
+            }
+        }
+        for (auto &[to, from] : plan.local_moves)
+        {
+            // The old local path must not be pushed back
+            u32 i = local_files.find(from);
+            if (i != FileList::npos)
+            {
+                local_files.detach(i);
+            }
+        }
+    }
+
+    if (this->status)
+    {
+        this->status->plan(transferred + planned_volume(local_files, remote_files));
+    }
 
-    vector<FileEntry> remote_files = remote_files_optional.value();
-    vector<pair<string, bool>> local_files = recursively_get_dir(this->local_root);
-    for (auto [path, is_dir] : local_files)
+    phase.next("transfers");
+    // Uploads and downloads are queued while comparing and run at the end, in lanes
+    vector<TransferJob> transfers;
+    // The same, for the operation queue
+    vector<QueuedOp> ops;
+    for (u32 li = 0; li < local_files.size(); li++)
     {
+        if (local_files.claimed(li) || !local_files.visible(li))
+        {
+            continue;
+        }
+        FileEntry local_file = local_files.entry(li);
+        const string &path = local_file.path;
+        bool is_dir = local_file.folder;
         string local_real_path = this->local_root + path;
-        time_t local_mtime;
-        struct stat attr;
-        stat(local_real_path.c_str(), &attr);
-        local_mtime = attr.st_mtime;
+        time_t local_mtime = local_file.last_modified;
         // fsdev_getmtime(local_real_path.c_str(), &local_mtime);
 
-        optional<FileEntry> remote_file_optional = get_file(&remote_files, path);
-        if (remote_file_optional)
+        auto planned = plan.remote_moves.find(path);
+        if (planned != plan.remote_moves.end())
+        {
+            const string &from = planned->second;
+            auto detached = moving.find(path);
+            console_printf("%s: renamed from %s, moving on server...\n\n", path.c_str(), from.c_str());
+            clean = false;
+            if (this->move(from, path))
+            {
+                // Everything below now exists remotely under the new name
+                if (detached != moving.end())
+                {
+                    remote_files.rename(detached->second, path);
+                }
+            }
+            else
+            {
+                // Fall back to transferring both paths
+                console_printf(CONSOLE_RED "%s: move failed, transferring instead.\n" CONSOLE_RESET, path.c_str());
+            }
+            if (detached != moving.end())
+            {
+                remote_files.attach(detached->second);
+            }
+        }
+
+        u32 ri = remote_files.find(path);
+        if (ri != FileList::npos && !remote_files.claimed(ri))
         {
-            FileEntry remote_file = remote_file_optional.value();
+            remote_files.claim(ri);
+            FileEntry remote_file = remote_files.entry(ri);
+            bool in_sync = true;
 
             if (is_dir)
             {
@@ -521,78 +2482,138 @@ bool WebDavClient::compareAndUpdate()
             else if (local_mtime > remote_file.last_modified)
             {
                 // Ask if we should do an upload
-                printf("\n%s", path.c_str());
-                printf(CONSOLE_YELLOW "Local version newer on above file.\n" CONSOLE_RESET);
-                printf(CONSOLE_YELLOW "Upload (A) or Not (B)?\n" CONSOLE_RESET);
-                consoleUpdate(NULL);
-                if (this->user_confirm())
+                if (this->user_confirm(path, "Local version newer on above file.", "Upload (A) or Not (B)?"))
                 {
                     // Upload local version
-                    printf("%s: local modified, uploading...\n\n", path.c_str());
-                    consoleUpdate(NULL);
-                    if (!this->push(local_real_path, path))
-                    {
-                        printf(CONSOLE_RED "%s: local modified, upload failed.\n", path.c_str());
-                        printf(CONSOLE_RESET);
-                        consoleUpdate(NULL);
-                        success = false;
-                    }
+                    in_sync = false;
+                    clean = false;
+                    ops.push_back(QueuedOp{QueuedOp::Replace, path, local_file.size, local_mtime, remote_file.size, remote_file.last_modified, remote_file.checksum});
+                    transfers.push_back(TransferJob{path, local_file.size, local_mtime, [this, local_file, remote_file, &record, &success]()
+                                                    {
+                                                        const string &path = local_file.path;
+                                                        console_printf("%s: local modified, uploading...\n\n", path.c_str());
+                                                        string checksum;
+                                                        if (!this->upload(local_file, &remote_file, checksum))
+                                                        {
+                                                            console_printf(CONSOLE_RED "%s: local modified, upload failed.\n" CONSOLE_RESET, path.c_str());
+                                                            success = false;
+                                                        }
+                                                        else
+                                                        {
+                                                            record(path, false, local_file.last_modified, checksum);
+                                                        }
+                                                    }});
+                }
+                else
+                {
+                    // Asked again next time
+                    clean = false;
                 }
             }
             else if (local_mtime < remote_file.last_modified)
             {
                 // Ask if we should do an upload
-                printf("\n%s", path.c_str());
-                printf(CONSOLE_YELLOW "Local version older on above file.\n" CONSOLE_RESET);
-                printf(CONSOLE_YELLOW "Download (A) or Not (B)?\n" CONSOLE_RESET);
-                consoleUpdate(NULL);
                 // Pull remote version
-                if (this->user_confirm())
+                if (this->user_confirm(path, "Local version older on above file.", "Download (A) or Not (B)?"))
                 {
-                    printf("%s: remote modified, downloading...\n\n", remote_file.path.c_str());
-                    consoleUpdate(NULL);
-                    if (!this->pull(local_real_path, remote_file.path))
-                    {
-                        printf(CONSOLE_RED "%s: remote modified, download failed.\n", path.c_str());
-                        printf(CONSOLE_RESET);
-                        consoleUpdate(NULL);
-                        success = false;
-                    }
+                    in_sync = false;
+                    ops.push_back(QueuedOp{QueuedOp::Download, path, remote_file.size, remote_file.last_modified, 0, 0, remote_file.checksum});
+                    transfers.push_back(TransferJob{path, remote_file.size, remote_file.last_modified, [this, local_real_path, remote_file, &record, &success]()
+                                                    {
+                                                        const string &path = remote_file.path;
+                                                        console_printf("%s: remote modified, downloading...\n\n", path.c_str());
+                                                        if (!this->pull(local_real_path, path, remote_file.size))
+                                                        {
+                                                            console_printf(CONSOLE_RED "%s: remote modified, download failed.\n" CONSOLE_RESET, path.c_str());
+                                                            success = false;
+                                                        }
+                                                        else
+                                                        {
+                                                            record(path, false, remote_file.last_modified, remote_file.checksum);
+                                                        }
+                                                    }});
+                }
+                else
+                {
+                    // Asked again next time
+                    clean = false;
                 }
             }
             else
             {
                 // Identical, don't do anything
             }
+            if (in_sync)
+            {
+                record(path, is_dir, remote_file.last_modified, remote_file.checksum);
+            }
         }
         else
         {
             // Remote file DNE, upload local version
+            clean = false;
             if (is_dir)
             {
-                this->mkcol(path, local_mtime);
+                if (this->mkcol(path, local_mtime))
+                {
+                    record(path, true, local_mtime, "");
+                }
             }
             else
             {
-                printf("%s: new local file, uploading...\n\n", path.c_str());
-                consoleUpdate(NULL);
-                if (!this->push(local_real_path, path))
-                {
-                    printf(CONSOLE_RED "%s: upload failed.\n\n", path.c_str());
-                    printf(CONSOLE_RESET);
-                    consoleUpdate(NULL);
-                    success = false;
-                }
-                else
-                {
-                }
+                ops.push_back(QueuedOp{QueuedOp::Upload, path, local_file.size, local_mtime, 0, 0, ""});
+                transfers.push_back(TransferJob{path, local_file.size, local_mtime, [this, local_file, &record, &success]()
+                                                {
+                                                    const string &path = local_file.path;
+                                                    console_printf("%s: new local file, uploading...\n\n", path.c_str());
+                                                    string checksum;
+                                                    if (!this->upload(local_file, NULL, checksum))
+                                                    {
+                                                        console_printf(CONSOLE_RED "%s: upload failed.\n\n" CONSOLE_RESET, path.c_str());
+                                                        success = false;
+                                                    }
+                                                    else
+                                                    {
+                                                        record(path, false, local_file.last_modified, checksum);
+                                                    }
+                                                }});
             }
         }
     }
     // Pull the remaining remote files
-    for (FileEntry remote_file : remote_files)
+    for (u32 ri = 0; ri < remote_files.size(); ri++)
     {
+        if (remote_files.claimed(ri) || !remote_files.visible(ri))
+        {
+            continue;
+        }
+        FileEntry remote_file = remote_files.entry(ri);
         string real_local_path = this->local_root + remote_file.path;
+
+        auto planned = plan.local_moves.find(remote_file.path);
+        if (planned != plan.local_moves.end())
+        {
+            const string &from = planned->second;
+            string real_from_path = this->local_root + from;
+            console_printf("%s: renamed on server from %s, moving locally...\n\n", remote_file.path.c_str(), from.c_str());
+            if (rename(real_from_path.c_str(), real_local_path.c_str()) == 0)
+            {
+                record(remote_file.path, remote_file.folder, remote_file.last_modified, remote_file.checksum);
+                // Renames can leave contents ahead of their folder in index order
+                for (u32 j = 0; remote_file.folder && j < remote_files.size(); j++)
+                {
+                    if (j != ri && !remote_files.claimed(j) && remote_files.within(j, ri))
+                    {
+                        remote_files.claim(j);
+                        record(remote_files.path(j), remote_files.folder(j), remote_files[j].mtime, remote_files.checksum(j));
+                    }
+                }
+                continue;
+            }
+            // Its contents stay unclaimed and are downloaded below
+            console_printf(CONSOLE_RED "can't rename %s: %s, downloading instead.\n" CONSOLE_RESET, real_from_path.c_str(), strerror(errno));
+        }
+
         if (remote_file.path == "/")
         {
             continue;
@@ -602,27 +2623,83 @@ bool WebDavClient::compareAndUpdate()
             int status = mkdir(real_local_path.c_str(), 0777);
             if (status != 0)
             {
-                printf("can't create local dir %s: %s\n", real_local_path.c_str(), strerror(errno));
-                consoleUpdate(NULL);
+                console_printf("can't create local dir %s: %s\n", real_local_path.c_str(), strerror(errno));
                 success = false;
             }
+            else
+            {
+                record(remote_file.path, true, remote_file.last_modified, remote_file.checksum);
+            }
         }
         else
         {
             // It's a file
+            ops.push_back(QueuedOp{QueuedOp::Download, remote_file.path, remote_file.size, remote_file.last_modified, 0, 0, remote_file.checksum});
+            transfers.push_back(TransferJob{remote_file.path, remote_file.size, remote_file.last_modified, [this, real_local_path, remote_file, &record, &success]()
+                                            {
+                                                console_printf("%s: new remote file, downloading...\n\n", remote_file.path.c_str());
+                                                if (!this->pull(real_local_path, remote_file.path, remote_file.size))
+                                                {
+                                                    console_printf("can't download remote file %s\n", remote_file.path.c_str());
+                                                    success = false;
+                                                }
+                                                else
+                                                {
+                                                    record(remote_file.path, false, remote_file.last_modified, remote_file.checksum);
+                                                }
+                                            }});
+        }
+    }
 
-            printf("%s: new remote file, downloading...\n\n", remote_file.path.c_str());
-            consoleUpdate(NULL);
-            if (!this->pull(real_local_path, remote_file.path))
-            {
-                printf("can't download remote file %s\n", remote_file.path.c_str());
-                consoleUpdate(NULL);
-                success = false;
-            }
-            else
-            {
-            }
+    // Doomed transfers never start
+    size_t planned = transfers.size();
+    this->fit_transfers(transfers, ops);
+    if (transfers.size() < planned)
+    {
+        success = false;
+        clean = false;
+        if (this->status)
+        {
+            u64 volume = 0;
+            for (const TransferJob &job : transfers)
+                volume += job.size;
+            this->status->plan(transferred + volume);
         }
     }
+
+    // Folders exist on both sides by now, only file contents are left to move
+    if (!this->state_file.empty() && !ops.empty())
+    {
+        queue.begin(this->queue_file(), ops);
+    }
+    // The queue keeps listing batched files one by one
+    this->batch_uploads(transfers, ops, record);
+    string profile = console_profile();
+    run_transfers(transfers, this->lanes,
+                  [this, profile]()
+                  {
+                      console_set_profile(profile);
+                      return this->open_thread_connection();
+                  },
+                  [this]()
+                  {
+                      this->close_thread_connection();
+                  });
+
+    if (this->status)
+    {
+        this->status->finish();
+    }
+
+    phase.next("prune");
+    this->flush_prunes();
+    phase.next("state");
+    if (!this->state_file.empty())
+    {
+        stamp.config = config;
+        stamp.remote_version = success && clean && version ? version.value() : "";
+        save_tree_state(this->state_file, synced, stamp);
+    }
+    queue.finish();
     return success;
-}
\ No newline at end of file
+}
@@ -4,18 +4,69 @@
 #include <optional>
 #include <ctime>
 #include <vector>
+#include <set>
+#include <map>
+#include <functional>
+#include <mutex>
 #include <switch.h>
 
 #include <curl/curl.h>
 
-struct FileEntry
+#include "content_index.hpp"
+#include "path_filter.hpp"
+#include "metrics.hpp"
+#include "progress.hpp"
+#include "file_list.hpp"
+#include "multistatus.hpp"
+#include "transfer_queue.hpp"
+#include "retry.hpp"
+#include "net_tuning.hpp"
+#include "tree_state.hpp"
+#include "op_queue.hpp"
+#include "capabilities.hpp"
+#include "bulk_upload.hpp"
+#include "archive.hpp"
+#include "block_map.hpp"
+#include "rate_limit.hpp"
+
+/// Owns a curl header list, freeing it when the request is done
+class HeaderList
+{
+public:
+    HeaderList();
+    HeaderList(const HeaderList &) = delete;
+    HeaderList &operator=(const HeaderList &) = delete;
+    ~HeaderList();
+
+    void append(const std::string &header);
+    curl_slist *get() const;
+
+private:
+    curl_slist *list;
+};
+
+/// How questions about conflicting files are answered
+enum class ConfirmPolicy
 {
-    std::string path;
-    time_t last_modified;
-    bool folder;
-    int size;
+    Ask,
+    Yes,
+    No,
 };
 
+/// Parse "ask", "yes" or "no"
+std::optional<ConfirmPolicy> parse_confirm_policy(const std::string &name);
+
+/// What a profile does with its folders
+enum class SyncMode
+{
+    Sync,    // Two-way sync, file by file
+    Archive, // Upload the local folder as a single compressed archive
+    Restore, // Unpack that archive into the local folder
+};
+
+/// Parse "sync", "archive" or "restore"
+std::optional<SyncMode> parse_sync_mode(const std::string &name);
+
 class WebDavClient
 {
 public:
@@ -25,18 +76,75 @@ public:
     void set_basic_auth(std::string username, std::string password);
     /// Configure the pad state for user confirmation
     void set_pad_state(PadState *pad);
+    /// Remember the synced tree in this file, enabling move detection on the next run
+    void set_state_file(std::string path);
+    /// Replay renames as MOVE/rename() instead of transfers, optionally verifying by SHA1
+    void set_move_detection(bool enabled, bool verify_hash);
+    /// Reuse content already on the server via COPY instead of uploading it again.
+    /// The index may be shared between clients; NULL disables deduplication.
+    void set_content_index(ContentIndex *index);
+    /// Keep the last `keep` overwritten versions of each file below versions_path
+    /// (relative to the web root, excluded from syncing). 0 disables versioning.
+    void set_versioning(unsigned keep, std::string versions_path);
+    /// Only sync paths matching the whitespace separated include patterns (all if empty)
+    /// and not matching the exclude patterns. See PathFilter for the syntax.
+    void set_filter(std::string includes, std::string excludes);
+    /// List the server on a second connection while scanning the SD card, and
+    /// transfer files new on either side before the listing has completed
+    void set_pipelining(bool enabled);
+    /// Retries, backoff, stall detection and circuit breaking for failed requests
+    void set_retry_policy(RetryPolicy policy);
+    /// Fixed curl buffer sizes in bytes, 0 to size them from measured latency and bandwidth
+    void set_buffer_sizes(long download, long upload, u32 socket_max);
+    /// How many files to transfer at once, and in which order
+    void set_transfer_lanes(TransferLanes lanes);
+    /// Take subtrees whose folder mtime didn't change since the last sync from the
+    /// saved state instead of scanning them again
+    void set_quick_scan(bool enabled);
+    /// Probe what the server supports at most every `ttl` seconds, caching the result
+    /// next to the state file
+    void set_capability_ttl(time_t ttl);
+    /// Upload new and changed files of up to a quarter of `batch_bytes` together, in
+    /// requests of up to `batch_bytes`, if the server has Nextcloud's bulk upload.
+    /// 0 uploads every file on its own.
+    void set_bulk_upload(u64 batch_bytes);
+    /// Replace files of at least `min_size` bytes by rewriting only their changed blocks of
+    /// `block_size` bytes, where the server supports partial updates. 0 disables this.
+    void set_delta_upload(u32 block_size, u64 min_size);
+    /// Limit this profile's transfers, on top of the limits all profiles share
+    void set_rate_limits(const RateSchedule &upload, const RateSchedule &download);
+    /// Sync file by file, or keep the local folder as one archive called `archive_name` in the web root
+    void set_mode(SyncMode mode, std::string archive_name);
+    /// Answer conflict questions without waiting for the user, for unattended runs
+    void set_confirm_policy(ConfirmPolicy policy);
+    /// Report transfer progress here; NULL disables progress tracking
+    void set_transfer_status(TransferStatus *status);
+    TransferStatus *get_transfer_status();
     /// Make a directory on the remote server
     bool mkcol(std::string web_path_rel, std::optional<u64> mtime);
-    /// Push a file to the remote WebDAV collection
-    bool push(std::string path, std::string web_path_rel);
+    /// Push a file to the remote WebDAV collection, announcing its SHA1 if known.
+    /// With create_only the server refuses to replace an existing file.
+    bool push(std::string path, std::string web_path_rel, std::string checksum = "", bool create_only = false);
+    /// Move a file or collection on the remote server
+    bool move(std::string from_web_path_rel, std::string to_web_path_rel);
+    /// Copy a file on the same server (given by absolute URL) into the remote collection
+    bool copy(std::string from_url, std::string to_web_path_rel, bool overwrite);
+    /// Delete a remote file or collection
+    bool remove(std::string web_path_rel);
+    /// Set the modification time of a remote file
+    bool set_remote_mtime(std::string web_path_rel, u64 mtime);
     /// Pull a file from remote WebDAV collection
-    bool pull(std::string path, std::string web_path_rel);
+    bool pull(std::string path, std::string web_path_rel, u64 size = 0);
     /// Get a list of remote files
-    std::optional<std::vector<FileEntry>> get_remote_files();
+    std::optional<FileList> get_remote_files();
     /// compare the local file with the remote file specified by web_path_rel
     /// if local is newer, upload. if remote newer, pull and overwrite
     /// the remote path will be appended to web_root
     bool compareAndUpdate();
+    /// Whether the last compareAndUpdate() found anything to do on either side
+    bool last_sync_changed() const;
+    /// Request statistics of everything this client did so far
+    SyncMetrics &get_metrics();
 
 private:
     CURL *curl;
@@ -46,6 +154,112 @@ private:
     bool use_basic_auth;
     std::string username;
     std::string password;
+    std::string state_file;
+    bool detect_moves;
+    bool verify_move_hash;
+    ContentIndex *content_index;
+    unsigned keep_versions;
+    std::string versions_path;
+    std::set<std::string> known_collections;
+    bool pipelined;
+    bool quick_scan;
+    ConfirmPolicy confirm_policy;
+    SyncMode mode;
+    std::string archive_name;
+    ServerCapabilities caps;
+    time_t capability_ttl;
+    u64 bulk_limit;
+    u32 delta_block;
+    u64 delta_min;
+    BlockMapStore block_maps;
+    bool changed;
+    // Every include and exclude pattern, to notice filter changes between runs
+    std::string filter_config;
+    TransferLanes lanes;
+    RetryPolicy retry;
+    BufferTuner buffers;
+    RateLimits limits;
+    // Guards known_collections, pending_prunes and changes to caps, which transfers on any lane may touch
+    std::mutex state_lock;
+    PathFilter filter;
+    SyncMetrics metrics;
+    TransferStatus *status;
+    std::vector<std::string> pending_prunes;
+    // PROPFIND headers never change, so they're built once
+    HeaderList depth_infinity;
+    HeaderList depth_one;
+    HeaderList depth_zero;
+    typedef std::function<void(const std::string &path, bool folder, time_t remote_mtime, const std::string &checksum)> Recorder;
+
+    /// Connection for requests made by the calling thread
+    CURL *handle();
+    /// Give the calling thread a connection of its own until it closes it
+    bool open_thread_connection();
+    void close_thread_connection();
+    /// Set the options all requests share. Only new handles and config changes need this.
+    void configure(CURL *handle);
+    /// Undo whatever the last request set, leaving the shared options alone
     void reset();
-    bool user_confirm();
+    void reset(CURL *handle);
+    /// Perform the configured request, retrying transient failures. `restart`
+    /// rewinds whatever the request reads or writes, or returns false if it can't.
+    CURLcode perform(const char *verb, const std::function<bool()> &restart = nullptr);
+    void print_request_details(const std::string &url);
+    /// Make the next request fail, and be retried, if its transfer stalls
+    void limit_stalls();
+    /// Report the next request's progress to `progress`
+    void track_progress(FileProgress &progress);
+    /// Hold the next request to the rate limits, reporting progress to `progress` if any
+    void meter(FileProgress *progress);
+    /// Bytes per second a single transfer may use now, 0 for unlimited
+    u64 send_cap();
+    u64 receive_cap();
+    bool relocate(const char *verb, std::string from_url, std::string to_url, bool overwrite);
+    /// Bytes the server's quota still allows, nullopt if unlimited or unknown
+    std::optional<u64> remote_free_space();
+    /// Drop the planned transfers that can't fit on the receiving side
+    void fit_transfers(std::vector<TransferJob> &transfers, std::vector<QueuedOp> &ops);
+    /// Replace small uploads with jobs uploading them in batches. `ops` runs parallel to `transfers`.
+    void batch_uploads(std::vector<TransferJob> &transfers, const std::vector<QueuedOp> &ops, const Recorder &record);
+    /// Upload a batch through the bulk endpoint, running the single upload of each file it didn't take
+    void upload_batch(const BulkEndpoint &endpoint, const std::vector<QueuedOp> &ops, const std::vector<TransferJob> &singles,
+                      const Recorder &record);
+    /// One bulk request. Per-file results by X-File-Path, nullopt if the request failed as a whole.
+    std::optional<std::map<std::string, BulkResult>> bulk_push(const std::string &url, const std::vector<BulkPart> &parts);
+    /// Load or probe the server's capabilities
+    void discover_capabilities();
+    /// Listing for servers that refuse Depth: infinity, one Depth: 1 request per folder
+    std::optional<FileList> list_by_folder();
+    /// Last modification time of a remote path, nullopt if it doesn't exist or can't be reached
+    std::optional<time_t> remote_mtime(const std::string &web_rel_path);
+    /// The archive's entry in the web root, nullopt if it doesn't exist or can't be listed
+    std::optional<FileEntry> find_archive();
+    /// Archive mode: stream the local folder into the archive, unless nothing changed
+    bool upload_archive();
+    /// Restore mode: unpack the archive while downloading it, unless it is already in place
+    bool restore_archive();
+    /// Where the operation queue of this profile is kept
+    std::string queue_file() const;
+    /// Finish the transfers an interrupted sync left in the queue
+    bool resume(const std::vector<QueuedOp> &ops);
+    /// ETag of the web root, or its mtime if the server has no ETags. Changes
+    /// whenever anything below the root does.
+    std::optional<std::string> root_version();
+    /// List `url` with depth "0", "1" or "infinity"
+    std::optional<FileList> propfind(std::string url, const char *depth, PathFilter *filter = NULL,
+                                     MultistatusParser::Callback on_entry = nullptr);
+    std::optional<FileList> overlap_listing(FileList &local_files, const std::vector<TreeRecord> &previous,
+                                            const Recorder &record, u64 &transferred);
+    bool upload(const FileEntry &local_file, const FileEntry *replaced, std::string &checksum, bool create_only = false);
+    /// Replace a remote file by patching the blocks that changed since its block map was made, on a
+    /// copy (of `source_url`) that is then moved into place. False if that isn't possible or failed.
+    bool delta_push(const FileEntry &local_file, const FileEntry &replaced, const std::string &source_url);
+    /// Write bytes [first, last) of `fp` into the remote file at `url`
+    bool patch_range(const std::string &url, FILE *fp, u64 first, u64 last, FileProgress &progress);
+    /// Remember the blocks of a file just uploaded in full, for the next delta
+    void remember_blocks(const FileEntry &local_file);
+    bool ensure_collection(std::string web_path_rel);
+    std::optional<std::string> snapshot(const FileEntry &remote_file);
+    void flush_prunes();
+    bool user_confirm(const std::string &path, const char *reason, const char *question);
 };
\ No newline at end of file